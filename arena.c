@@ -0,0 +1,206 @@
+//
+// アリーナ(領域)アロケータ
+//
+// 寿命の同じオブジェクトを1つのアリーナにまとめて確保し、アリーナごとまとめて解放する
+// 確保は大きな領域(チャンク)の先頭から詰めていくだけなので、mallocより軽い
+//
+// パーサは次の3つのアリーナを使い分ける
+//   tu_arena    翻訳単位全体: 型・グローバル変数・初期化子など
+//   fn_arena    関数1つ分: Node・ローカル変数。その関数のコードを生成したら解放する
+//   scope_arena ブロックスコープの間だけ: VarScope/TagScope。スコープを抜けると巻き戻す
+//
+// 環境変数 DCC_ARENA_STATS を設定すると、終了時にアリーナの名前ごとの統計を表示する
+// 1つのアリーナは1つのスレッドからしか使わないが、統計は同じ名前のアリーナで共有する
+// そこで確保の回数とバイト数はアリーナごとに数えておき、アリーナを解放する時にロックを取って統計に足す
+//
+
+#include "dcc.h"
+
+#include <pthread.h>
+
+enum {
+  ARENA_CHUNK_SIZE = 64 * 1024,
+  ARENA_ALIGN = 8,
+};
+
+// アリーナの名前ごとの統計
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats {
+  ArenaStats *next;
+  char *name;
+  long arenas;   // 作ったアリーナの数
+  long objects;  // 確保したオブジェクトの数
+  long bytes;    // 確保したバイト数
+  long peak;     // 1つのアリーナが同時に抱えていたチャンクの合計の最大値
+};
+
+static ArenaStats *all_stats;
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk *prev;
+  long base; // このチャンクより前のチャンクで使ったバイト数の合計(arena_markの値の基準)
+  long size;
+  long used;
+  char data[];
+};
+
+struct Arena {
+  ArenaChunk *chunk; // 現在のチャンク
+  ArenaChunk *spare; // arena_releaseで空いたチャンク(再利用する)
+  long reserved;     // 抱えているチャンクの合計
+  long objects;      // まだ統計に足していない確保の回数
+  long bytes;        // まだ統計に足していないバイト数
+  ArenaStats *stats;
+  Arena *prev;       // 解放されていないアリーナの双方向リスト
+  Arena *next;
+};
+
+// all_statsと解放されていないアリーナのリストを守るロック
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static Arena *live_arenas;
+
+static ArenaStats *find_stats(char *name) {
+  for (ArenaStats *st = all_stats; st; st = st->next)
+    if (!strcmp(st->name, name))
+      return st;
+
+  ArenaStats *st = calloc(1, sizeof(ArenaStats));
+  st->name = name;
+  st->next = all_stats;
+  all_stats = st;
+  return st;
+}
+
+// 名前nameの空のアリーナを作る(名前は統計の表示に使う)
+Arena *new_arena(char *name) {
+  Arena *arena = calloc(1, sizeof(Arena));
+  pthread_mutex_lock(&stats_lock);
+  arena->stats = find_stats(name);
+  arena->stats->arenas++;
+  arena->next = live_arenas;
+  if (live_arenas)
+    live_arenas->prev = arena;
+  live_arenas = arena;
+  pthread_mutex_unlock(&stats_lock);
+  return arena;
+}
+
+// アリーナで数えた確保の回数とバイト数を統計に足す(stats_lockを取って呼ぶ)
+static void flush_stats(Arena *arena) {
+  ArenaStats *st = arena->stats;
+  st->objects += arena->objects;
+  st->bytes += arena->bytes;
+  if (st->peak < arena->reserved)
+    st->peak = arena->reserved;
+  arena->objects = 0;
+  arena->bytes = 0;
+}
+
+// sizeバイト以上の空きがあるチャンクを現在のチャンクにする
+static void new_chunk(Arena *arena, long size) {
+  ArenaChunk *chunk = NULL;
+
+  // 空いたチャンクが使えれば使う
+  for (ArenaChunk **p = &arena->spare; *p; p = &(*p)->prev) {
+    if ((*p)->size >= size) {
+      chunk = *p;
+      *p = chunk->prev;
+      break;
+    }
+  }
+
+  if (!chunk) {
+    long sz = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    chunk = malloc(sizeof(ArenaChunk) + sz);
+    chunk->size = sz;
+    arena->reserved += sz;
+  }
+
+  ArenaChunk *cur = arena->chunk;
+  chunk->base = cur ? cur->base + cur->used : 0;
+  chunk->used = 0;
+  chunk->prev = cur;
+  arena->chunk = chunk;
+}
+
+// アリーナからsizeバイトの領域を確保して返す
+// callocと同じく、領域は0で埋められている
+void *arena_alloc(Arena *arena, long size) {
+  size = (size + ARENA_ALIGN - 1) & ~(long) (ARENA_ALIGN - 1);
+
+  ArenaChunk *chunk = arena->chunk;
+  if (!chunk || chunk->size - chunk->used < size) {
+    new_chunk(arena, size);
+    chunk = arena->chunk;
+  }
+
+  void *p = chunk->data + chunk->used;
+  chunk->used += size;
+  memset(p, 0, size);
+
+  arena->objects++;
+  arena->bytes += size;
+  return p;
+}
+
+// アリーナの現在の位置を返す
+// arena_releaseにこの値を渡すと、それ以降に確保した領域をまとめて解放できる
+long arena_mark(Arena *arena) {
+  ArenaChunk *chunk = arena->chunk;
+  return chunk ? chunk->base + chunk->used : 0;
+}
+
+// arena_markで得た位置より後に確保した領域をまとめて解放する
+// 空いたチャンクはfreeせずに、次の確保で再利用する
+void arena_release(Arena *arena, long mark) {
+  while (arena->chunk && arena->chunk->base > mark) {
+    ArenaChunk *chunk = arena->chunk;
+    arena->chunk = chunk->prev;
+    chunk->prev = arena->spare;
+    arena->spare = chunk;
+  }
+
+  if (arena->chunk)
+    arena->chunk->used = mark - arena->chunk->base;
+}
+
+// アリーナとそこから確保した領域をすべて解放する
+void free_arena(Arena *arena) {
+  pthread_mutex_lock(&stats_lock);
+  flush_stats(arena);
+  if (arena->prev)
+    arena->prev->next = arena->next;
+  else
+    live_arenas = arena->next;
+  if (arena->next)
+    arena->next->prev = arena->prev;
+  pthread_mutex_unlock(&stats_lock);
+
+  arena_release(arena, 0);
+  if (arena->chunk) {
+    arena->chunk->prev = arena->spare;
+    arena->spare = arena->chunk;
+  }
+
+  for (ArenaChunk *chunk = arena->spare, *prev; chunk; chunk = prev) {
+    prev = chunk->prev;
+    free(chunk);
+  }
+  free(arena);
+}
+
+// 環境変数 DCC_ARENA_STATS が設定されていれば、アリーナの統計を標準エラー出力に表示する
+void print_arena_stats(void) {
+  if (!getenv("DCC_ARENA_STATS"))
+    return;
+
+  pthread_mutex_lock(&stats_lock);
+  for (Arena *arena = live_arenas; arena; arena = arena->next)
+    flush_stats(arena);
+  pthread_mutex_unlock(&stats_lock);
+
+  fprintf(stderr, "%-10s %8s %10s %12s %10s\n", "arena", "arenas", "objects", "bytes", "peak");
+  for (ArenaStats *st = all_stats; st; st = st->next)
+    fprintf(stderr, "%-10s %8ld %10ld %12ld %10ld\n", st->name, st->arenas, st->objects, st->bytes, st->peak);
+}
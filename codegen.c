@@ -4,651 +4,633 @@
 
 #include "dcc.h"
 
-static void gen(Node *node);
+// 関数1つ分のコード生成の状態
+// 関数ごとに別々のスレッドでコードを生成できるように、グローバル変数ではなくここに持つ
+//
+// IRの値はレジスタ割り当て(regalloc.c)で決めたレジスタか、スタックのスロットに置く
+// スロットはメモリに置くローカル変数の領域の下に並べ、その下に関数の中で使うcallee-savedレジスタを退避する
+// RAXとR11は割り当てに使わないので、命令を組み立てる作業用に使う
+//
+// 命令はすぐには出力せず、関数1つ分の命令列(AsmFunc)にためて、覗き穴最適化をかけてから出力する
+typedef struct {
+  char *funcname; // 実行中の関数の名前
+  IrFunc *ir;
+  RegAlloc *ra;
+  AsmFunc *af;
+  int locals; // メモリに置くローカル変数の領域の大きさ
+} CodeGen;
+
+enum {
+  LOC_SLOT = 16, // 値の置き場所を表す数で、16未満はレジスタ、16以上はスロット(LOC_SLOT + スロットの番号)
+};
+
+static char *reg64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+
+static char *reg32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
 
-// アセンブリのラベル番号(連番)
-static int labelseq = 1;
+static char *reg16[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+                        "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"};
 
-// break時にjmpするラベルの番号
-static int brkseq;
+static char *reg8[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                       "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
 
-// continue時にjmpするラベルの番号
-static int contseq;
+// AsmOpの順
+static char *asm_names[] = {"", "mov", "movabs", "movsx", "movsxd", "movzx", "lea", "add", "sub",
+                            "imul", "and", "or", "xor", "not", "shl", "sar", "cqo", "idiv", "cmp",
+                            "test", "set", "jmp", "j", "call", "push", "pop", "ret"};
 
-// 実行中の関数の名前
-static char *funcname;
+// CondCodeの順
+static char *cc_names[] = {"e", "ne", "l", "ge", "le", "g"};
 
-// 64bitの値を保持するためのレジスタ
+// 引数を渡すレジスタ
 // x86_64のABI(Application Binary Interface)で決まっている
-static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static int argregs[] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9};
+
+// 関数の中で使うなら、プロローグで退避してエピローグで戻すレジスタ(callee-saved)
+static int callee_saved[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+
+static char *reg_name(int reg, int size) {
+  if (size == 1)
+    return reg8[reg];
+  if (size == 2)
+    return reg16[reg];
+  if (size == 4)
+    return reg32[reg];
+  return reg64[reg];
+}
 
-// 32bitの値を保持するためのレジスタ
-static char *argreg4[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+// 命令列の最後に命令を加える
+static AsmInst *add_inst(CodeGen *cg, AsmOp op) {
+  AsmFunc *af = cg->af;
+  if (af->ninsts == af->cap) {
+    AsmInst **insts = arena_alloc(af->arena, sizeof(AsmInst *) * af->cap * 2);
+    memcpy(insts, af->insts, sizeof(AsmInst *) * af->ninsts);
+    af->insts = insts;
+    af->cap = af->cap * 2;
+  }
+  AsmInst *inst = arena_alloc(af->arena, sizeof(AsmInst));
+  inst->op = op;
+  af->insts[af->ninsts++] = inst;
+  return inst;
+}
 
-// 16bitの値を保持するためのレジスタ
-static char *argreg2[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
+static void set_reg(Operand *opd, int reg, int size) {
+  opd->kind = OPD_REG;
+  opd->reg = reg;
+  opd->size = size;
+}
 
-// 8bitの値を保持するためのレジスタ
-static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+static void set_imm(Operand *opd, long val) {
+  opd->kind = OPD_IMM;
+  opd->val = val;
+}
 
-// 与えられたノードが変数を指しているときに、その変数のアドレスを計算して、それをスタックにプッシュする
-// `x=3; y=&x; *y=5;` のような場合、`*y=5;`を評価する時にND_ASSIGNからこの関数が呼ばれ、node->kindがND_DEREFとなる。
-// この時yの値はアドレスを表す整数であるとみなしてよいので、yの値を右辺値として評価すればよい。
-// yを右辺値として評価した値はload()時にすでにスタックにpushされている。
-//
-// それ以外の場合にはエラーを返す
-void gen_addr(Node *node) {
-  switch (node->kind) {
-    case ND_VAR: {
-      // 複合リテラルの場合
-      if (node->init)
-        gen(node->init);
-
-      Var *var = node->var;
-
-      if (var->is_local) {
-        printf("  mov rax, rbp\n");
-        printf("  sub rax, %d\n", node->var->offset);
-        printf("  push rax\n");
-      } else {
-        if (var->is_extern)
-          printf("  push [_%s@GOTPCREL + rip]\n", var->name);
-        else
-          // https://kawasin73.hatenablog.com/entry/2019/01/05/183917
-          printf("  push [_%s@GOTPCREL + rip]\n", var->name);
+static void set_mem(Operand *opd, int base, long disp, int size) {
+  opd->kind = OPD_MEM;
+  opd->reg = base;
+  opd->val = disp;
+  opd->size = size;
+}
+
+static int loc_of(CodeGen *cg, IrInst *inst) {
+  int reg = cg->ra->reg[inst->id];
+  if (reg >= 0)
+    return reg;
+  return LOC_SLOT + cg->ra->slot[inst->id];
+}
+
+// 置き場所locの下位sizeバイトをオペランドにする
+static void set_loc(CodeGen *cg, Operand *opd, int loc, int size) {
+  if (loc < LOC_SLOT)
+    set_reg(opd, loc, size);
+  else
+    set_mem(opd, REG_RBP, -(cg->locals + 8 * (loc - LOC_SLOT + 1)), size);
+}
+
+// op dst, src (どちらもレジスタ)
+static AsmInst *add_rr(CodeGen *cg, AsmOp op, int dst, int src) {
+  AsmInst *inst = add_inst(cg, op);
+  set_reg(&inst->dst, dst, 8);
+  set_reg(&inst->src, src, 8);
+  return inst;
+}
+
+// op dst, val
+static AsmInst *add_ri(CodeGen *cg, AsmOp op, int dst, long val) {
+  AsmInst *inst = add_inst(cg, op);
+  set_reg(&inst->dst, dst, 8);
+  set_imm(&inst->src, val);
+  return inst;
+}
+
+// 置き場所srcの値をdstに移す
+static void emit_mov(CodeGen *cg, int dst, int src) {
+  if (dst == src)
+    return;
+  if (dst >= LOC_SLOT && src >= LOC_SLOT) {
+    // メモリからメモリへは直接移せないので、RAXを経由する
+    emit_mov(cg, REG_RAX, src);
+    emit_mov(cg, dst, REG_RAX);
+    return;
+  }
+  AsmInst *inst = add_inst(cg, ASM_MOV);
+  set_loc(cg, &inst->dst, dst, 8);
+  set_loc(cg, &inst->src, src, 8);
+}
+
+// dst[i] ← src[i] (0 <= i < n) を同時に行う
+// 他の移動の元になっているところには、その移動が済むまで書き込まない
+// 互いに元になっていて(循環して)進めない場合は、1つをR11に逃がして循環を断つ
+static void emit_parallel_move(CodeGen *cg, int *dst, int *src, int n) {
+  for (;;) {
+    bool pending = false;
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      if (src[i] < 0)
+        continue;
+      if (src[i] == dst[i]) {
+        src[i] = -1;
+        continue;
       }
+      pending = true;
+
+      bool blocked = false;
+      for (int j = 0; j < n; j++)
+        if (j != i && src[j] == dst[i])
+          blocked = true;
+      if (blocked)
+        continue;
+
+      emit_mov(cg, dst[i], src[i]);
+      src[i] = -1;
+      progress = true;
+    }
 
+    if (!pending)
       return;
+    if (progress)
+      continue;
+
+    for (int i = 0; i < n; i++) {
+      if (src[i] < 0)
+        continue;
+      int saved = dst[i];
+      emit_mov(cg, REG_R11, saved);
+      for (int j = 0; j < n; j++)
+        if (src[j] == saved)
+          src[j] = REG_R11;
+      break;
     }
-    case ND_DEREF:
-      // deref対象のポインタ型変数の値をそのまま返せばいい
-      gen(node->lhs);
-      return;
-    case ND_MEMBER:
-      // 構造体変数のアドレスを取得
-      gen_addr(node->lhs);
-      printf("  pop rax\n");
-
-//   取得したアドレスからoffset分上のアドレスに欲しいメンバのアドレスがある
-//   ========<上位アドレス>========
-//   ...
-//     --------------------------------------------
-//                                                ↑
-//     メンバBのスタック領域(offset = 4, size = 8)   |
-//                                                構造体変数全体のスタック領域
-//     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ |
-//     メンバAのスタック領域(offset = 0, size = 4)   ↓
-//     --------------------------------------------
-//     ...
-//   ========<下位アドレス>========
-      printf("  add rax, %d\n", node->member->offset);
-      printf("  push rax\n");
-      return;
-    default:
-      error("ローカル変数ではありません");
   }
 }
 
-// スタックからポップしたアドレスから値をロードし、スタックにプッシュする
-void load(Type *ty) {
-  printf("  pop rax\n");
-  if (ty->size == 1)
-    // RAXが指しているアドレスから8bitを読み込んで、符号拡張してRAXに入れる
-    printf("  movsx rax, byte ptr [rax]\n");
-  else if (ty->size == 2)
-    // RAXが指しているアドレスから16bitを読み込んで、符号拡張してRAXに入れる
-    printf("  movsx rax, word ptr [rax]\n");
-  else if (ty->size == 4)
-    // RAXが指しているアドレスから32bitを読み込んで、符号拡張してRAXに入れる
-    printf("  movsxd rax, dword ptr [rax]\n");
-  else {
-    assert(ty->size == 8);
-    printf("  mov rax, [rax]\n");
-  }
-  printf("  push rax\n");
-}
-
-// スタックから値を2つ(1つ目: 右辺値、2つ目: 左辺のアドレス)ポップして、アドレスに値を保存する。
-// そして保存した値をプッシュする
-void store(Type *ty) {
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-
-  if (ty->kind == TY_BOOL) {
-    // true: 1, false: 0
-    // _Bool型で1以上の整数だった場合はtrueとして扱う
-    printf("  cmp rdi, 0\n");
-    printf("  setne dil\n");
-    // dilの値を符号拡張せずにrdiに保存する
-    printf("  movzx rdi, dil\n");
-  }
+// 値の置き場所がレジスタならそのレジスタを、スロットならscratchに読み込んでscratchを返す
+static int src_reg(CodeGen *cg, IrInst *inst, int scratch) {
+  int loc = loc_of(cg, inst);
+  if (loc < LOC_SLOT)
+    return loc;
+  emit_mov(cg, scratch, loc);
+  return scratch;
+}
 
-  if (ty->size == 1)
-    // DILはRDIの下位8bit
-    // https://www.sigbus.info/compilerbook#%E6%95%B4%E6%95%B0%E3%83%AC%E3%82%B8%E3%82%B9%E3%82%BF%E3%81%AE%E4%B8%80%E8%A6%A7
-    printf("  mov [rax], dil\n");
-  else if (ty->size == 2)
-    // EDIはRDIの下位32bit
-    printf("  mov [rax], di\n");
-  else if (ty->size == 4)
-    // EDIはRDIの下位32bit
-    printf("  mov [rax], edi\n");
-  else {
-    assert(ty->size == 8);
-    printf("  mov [rax], rdi\n");
-  }
-  printf("  push rdi\n");
+// 命令の結果を計算するレジスタ。結果をスロットに置く場合はRAXで計算してからfinishで書き込む
+static int dst_reg(CodeGen *cg, IrInst *inst) {
+  int loc = loc_of(cg, inst);
+  return loc < LOC_SLOT ? loc : REG_RAX;
 }
 
-// RAXの値を引数のTypeにキャストする
-void truncate(Type *ty) {
-  printf("  pop rax\n");
+static void finish(CodeGen *cg, IrInst *inst, int reg) {
+  emit_mov(cg, loc_of(cg, inst), reg);
+}
 
-  if (ty->kind == TY_BOOL) {
-    printf("  cmp rax, 0\n");
-    // RAXの値が0以外だったら1、0だったら0
-    // ALはRAXの下位8bit
-    printf("  setne al\n");
+// ブロックbからsuccに移る前に、succのφ命令がbから来た時に選ぶ値を、φ命令の置き場所に移す
+static void copy_phi_args(CodeGen *cg, IrBlock *b, IrBlock *succ) {
+  int n = 0;
+  for (IrInst *phi = succ->phis; phi; phi = phi->next)
+    n++;
+  if (!n)
+    return;
+
+  int k = 0;
+  while (succ->preds[k] != b)
+    k++;
+
+  Arena *arena = cg->ir->fn->arena;
+  int *dst = arena_alloc(arena, sizeof(int) * n);
+  int *src = arena_alloc(arena, sizeof(int) * n);
+  int i = 0;
+  for (IrInst *phi = succ->phis; phi; phi = phi->next) {
+    dst[i] = loc_of(cg, phi);
+    src[i] = loc_of(cg, phi->args[k]);
+    i++;
   }
+  emit_parallel_move(cg, dst, src, n);
+}
 
-  // 符号拡張する
-  if (ty->size == 1)
-    printf("  movsx rax, al\n");
-  else if (ty->size == 2)
-    printf("  movsx rax, ax\n");
-  else if (ty->size == 4)
-    printf("  movsxd rax, eax\n");
+// 配置順で次のブロック(最後のブロックならNULL)
+static IrBlock *next_block(CodeGen *cg, IrBlock *b) {
+  if (b->id == cg->ir->nblocks)
+    return NULL;
+  return cg->ir->blocks[b->id];
+}
 
-  printf("  push rax\n");
+static void add_jump(CodeGen *cg, AsmOp op, CondCode cc, int label) {
+  AsmInst *inst = add_inst(cg, op);
+  inst->cc = cc;
+  inst->label = label;
 }
 
-// スタックトップの値をpopしてインクリメントしてスタックにpushする
-void inc(Type *ty) {
-  printf("  pop rax\n");
-  printf("  add rax, %d\n", ty->ptr_to ? ty->ptr_to->size : 1);
-  printf("  push rax\n");
+static void emit_jmp(CodeGen *cg, IrBlock *b, IrBlock *to) {
+  // 次のブロックならそのまま進めばよい
+  if (next_block(cg, b) != to)
+    add_jump(cg, ASM_JMP, CC_E, to->id);
 }
 
-// スタックトップの値をpopしてデクリメントしてスタックにpushする
-void dec(Type *ty) {
-  printf("  pop rax\n");
-  printf("  sub rax, %d\n", ty->ptr_to ? ty->ptr_to->size : 1);
-  printf("  push rax\n");
+// 関数の先頭で、レジスタで渡された引数をそれぞれの値の置き場所に移す
+// 引数の値は入口のブロックの先頭にまとまっている
+static void emit_params(CodeGen *cg, IrInst *inst) {
+  int dst[6];
+  int src[6];
+  int n = 0;
+  for (; inst && inst->op == IR_PARAM; inst = inst->next) {
+    dst[n] = loc_of(cg, inst);
+    src[n] = argregs[inst->val];
+    n++;
+  }
+  emit_parallel_move(cg, dst, src, n);
 }
 
-void gen_binary(Node *node) {
-  printf("  pop rdi\n"); // rhs
-  printf("  pop rax\n"); // lhs
+static void emit_call(CodeGen *cg, IrInst *inst) {
+  int dst[6];
+  int src[6];
+  for (int i = 0; i < inst->nargs; i++) {
+    dst[i] = argregs[i];
+    src[i] = loc_of(cg, inst->args[i]);
+  }
+  emit_parallel_move(cg, dst, src, inst->nargs);
+
+  // 可変長引数の関数のために、ベクタレジスタで渡す引数の個数(0)をALに入れる
+  // 関数呼び出しをする前にRSPが16の倍数になっていなければいけないが、スタックフレームは16の倍数に揃えてある
+  // 呼び出しをまたいで生きる値はcallee-savedレジスタかスロットにあるので、保存しなくてよい
+  add_ri(cg, ASM_MOV, REG_RAX, 0);
+  AsmInst *call = add_inst(cg, ASM_CALL);
+  call->sym = inst->name;
+  finish(cg, inst, REG_RAX);
+}
 
-  switch (node->kind) {
-    case ND_ADD:
-    case ND_ADD_EQ:
-      printf("  add rax, rdi\n");
-      break;
-    case ND_PTR_ADD:
-    case ND_PTR_ADD_EQ:
-      printf("  imul rdi, %d\n", node->ty->ptr_to->size);
-      printf("  add rax, rdi\n"); // raxに入ってるのはアドレス
-      break;
-    case ND_SUB:
-    case ND_SUB_EQ:
-      printf("  sub rax, rdi\n");
-      break;
-    case ND_PTR_SUB:
-    case ND_PTR_SUB_EQ:
-      printf("  imul rdi, %d\n", node->ty->ptr_to->size);
-      printf("  sub rax, rdi\n");
-      break;
-    case ND_PTR_DIFF:
-      printf("  sub rax, rdi\n");
-      printf("  cqo\n");
-      printf("  mov rdi, %d\n", node->ty->ptr_to->size);
-      printf(
-          "  idiv rdi\n"); // idivは暗黙のうちにRDXとRAXを取って、それを合わせたものを128ビット整数とみなして、それを引数のレジスタの64ビットの値で割り、商をRAXに、余りをRDXにセットする
-      break;
-    case ND_MUL:
-    case ND_MUL_EQ:
-      printf("  imul rax, rdi\n");
-      break;
-    case ND_DIV:
-    case ND_DIV_EQ:
-      // cqo: RAXに入っている64ビットの値を128ビットに伸ばしてRDXとRAXにセットする
-      printf("  cqo\n");
-      // idiv: 暗黙のうちにRDXとRAXを取って、それを合わせたものを128ビット整数とみなして、それを引数のレジスタの64ビットの値で割り
-      //       商をRAXに、余りをRDXにセットする
-      printf("  idiv rdi\n");
-      break;
-    case ND_EQ:
-      printf("  cmp rax, rdi\n");
-      printf("  sete al\n");
-      printf("  movzx rax, al\n");
-      break;
-    case ND_NE:
-      printf("  cmp rax, rdi\n");
-      printf("  setne al\n");
-      printf("  movzx rax, al\n");
-      break;
-    case ND_LT:
-      printf("  cmp rax, rdi\n");
-      printf("  setl al\n");
-      printf("  movzx rax, al\n");
-      break;
-    case ND_LE:
-      printf("  cmp rax, rdi\n");
-      printf("  setle al\n");
-      printf("  movzx rax, al\n");
-      break;
-    case ND_BITAND:
-    case ND_BITAND_EQ:
-      printf("  and rax, rdi\n");
-      break;
-    case ND_BITOR:
-    case ND_BITOR_EQ:
-      printf("  or rax, rdi\n");
-      break;
-    case ND_BITXOR:
-    case ND_BITXOR_EQ:
-      printf("  xor rax, rdi\n");
-      break;
-    case ND_SHL:
-    case ND_SHL_EQ:
-      printf("  mov cl, dil\n");
-      printf("  shl rax, cl\n");
-      break;
-    case ND_SHR:
-    case ND_SHR_EQ:
-      printf("  mov cl, dil\n");
-      // 論理シフトと算術シフトの違い↓
-      // http://kccn.konan-u.ac.jp/information/cs/cyber03/cy3_shc.htm
-      printf("  sar rax, cl\n");
-      break;
-    default:
-      break;
+static bool is_commutative(IrOp op) {
+  return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR;
+}
+
+// 比較の結果を0か1にする
+static void emit_cmp(CodeGen *cg, IrInst *inst, CondCode cc) {
+  int a = src_reg(cg, inst->args[0], REG_RAX);
+  AsmInst *cmp = add_inst(cg, ASM_CMP);
+  set_reg(&cmp->dst, a, 8);
+  set_loc(cg, &cmp->src, loc_of(cg, inst->args[1]), 8);
+
+  int d = dst_reg(cg, inst);
+  AsmInst *set = add_inst(cg, ASM_SETCC);
+  set->cc = cc;
+  set_reg(&set->dst, d, 1);
+  AsmInst *ext = add_inst(cg, ASM_MOVZX);
+  set_reg(&ext->dst, d, 8);
+  set_reg(&ext->src, d, 1);
+  finish(cg, inst, d);
+}
+
+// 2オペランドの演算(dst = dst op src)
+static void emit_binary(CodeGen *cg, IrInst *inst, AsmOp op) {
+  int a = loc_of(cg, inst->args[0]);
+  int b = loc_of(cg, inst->args[1]);
+  int d = dst_reg(cg, inst);
+
+  // 右辺と結果が同じレジスタなら、左辺を移すと右辺が壊れる
+  if (d == b && d != a) {
+    if (is_commutative(inst->op)) {
+      b = a;
+      a = d;
+    } else {
+      d = REG_RAX;
+    }
   }
 
-  printf("  push rax\n");
+  emit_mov(cg, d, a);
+  AsmInst *bin = add_inst(cg, op);
+  set_reg(&bin->dst, d, 8);
+  set_loc(cg, &bin->src, b, 8);
+  finish(cg, inst, d);
 }
 
-void gen(Node *node) {
-  switch (node->kind) {
-    case ND_NULL:
-      return;
-    case ND_NUM:
-      if (node->val == (int) node->val)
-        printf("  push %ld\n", node->val);
-      else {
-        // `push` は64bitの整数を直接プッシュできないので
-        // 一旦レジスタにコピーしてからプッシュする
-        printf("  movabs rax, %ld\n", node->val);
-        printf("  push rax\n");
-      }
-      return;
-    case ND_EXPR_STMT:
-      gen(node->lhs);
-      printf("  pop rax\n");
-      return;
-    case ND_RETURN:
-      if (node->lhs) {
-        gen(node->lhs);
-        printf("  pop rax\n");
+static void emit_inst(CodeGen *cg, IrInst *inst) {
+  IrBlock *b = inst->block;
+
+  switch (inst->op) {
+    case IR_CONST: {
+      int loc = loc_of(cg, inst);
+      if (inst->val == (int) inst->val) {
+        AsmInst *mov = add_inst(cg, ASM_MOV);
+        set_loc(cg, &mov->dst, loc, 8);
+        set_imm(&mov->src, inst->val);
+        return;
       }
-      printf("  jmp .L.return.%s\n", funcname);
-      return;
-    case ND_VAR:
-      // 複合リテラルの場合
-      if (node->init)
-        gen(node->init);
-      gen_addr(node);
-      if (node->ty->kind != TY_ARRAY)
-        load(node->ty);
-      return;
-    case ND_MEMBER:
-      gen_addr(node);
-      if (node->ty->kind != TY_ARRAY)
-        load(node->ty);
-      return;
-    case ND_ASSIGN:
-      gen_addr(node->lhs);
-      gen(node->rhs);
-      store(node->ty);
+      // 32bitに収まらない即値はmovabsでレジスタに読み込む
+      int d = dst_reg(cg, inst);
+      add_ri(cg, ASM_MOVABS, d, inst->val);
+      finish(cg, inst, d);
       return;
-    case ND_IF: {
-      int seq = labelseq++;
-      if (node->els) {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L.else.%d\n", seq);
-        gen(node->then);
-        printf("  jmp .L.end.%d\n", seq);
-        printf(".L.else.%d:\n", seq);
-        gen(node->els);
-        printf(".L.end.%d:\n", seq);
-      } else {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L.end.%d\n", seq);
-        gen(node->then);
-        printf(".L.end.%d:\n", seq);
-      }
+    }
+    case IR_PARAM:
+      // 最初の引数のところで、すべての引数をまとめて移す
+      if (inst->val == 0)
+        emit_params(cg, inst);
+      return;
+    case IR_LVAR: {
+      int d = dst_reg(cg, inst);
+      AsmInst *lea = add_inst(cg, ASM_LEA);
+      set_reg(&lea->dst, d, 8);
+      set_mem(&lea->src, REG_RBP, -inst->var->offset, 0);
+      finish(cg, inst, d);
       return;
     }
-    case ND_WHILE: {
-      int seq = labelseq++;
-      int brk = brkseq;
-      int cont = contseq;
-      brkseq = contseq = seq;
-
-      printf(".L.continue.%d:\n", seq);
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .L.break.%d\n", seq);
-      gen(node->then);
-      printf("  jmp .L.continue.%d\n", seq);
-      printf(".L.break.%d:\n", seq);
-
-      brkseq = brk;
-      contseq = cont;
+    case IR_GVAR: {
+      int d = dst_reg(cg, inst);
+      // https://kawasin73.hatenablog.com/entry/2019/01/05/183917
+      AsmInst *mov = add_inst(cg, ASM_MOV);
+      set_reg(&mov->dst, d, 8);
+      mov->src.kind = OPD_GOT;
+      mov->src.sym = inst->var->name;
+      finish(cg, inst, d);
       return;
     }
-    case ND_FOR: {
-      int seq = labelseq++;
-      int brk = brkseq;
-      int cont = contseq;
-      brkseq = contseq = seq;
-
-      if (node->init)
-        gen(node->init);
-
-      printf(".L.begin.%d:\n", seq);
-
-      if (node->cond) {
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .L.break.%d\n", seq);
-      }
-
-      gen(node->then);
-      printf(".L.continue.%d:\n", seq);
-
-      if (node->inc)
-        gen(node->inc);
-
-      printf("  jmp .L.begin.%d\n", seq);
-      printf(".L.break.%d:\n", seq);
-
-      brkseq = brk;
-      contseq = cont;
+    case IR_LOAD: {
+      int a = src_reg(cg, inst->args[0], REG_R11);
+      int d = dst_reg(cg, inst);
+      // アドレスから読み込んで符号拡張する
+      AsmOp op = ASM_MOV;
+      if (inst->size == 1 || inst->size == 2)
+        op = ASM_MOVSX;
+      else if (inst->size == 4)
+        op = ASM_MOVSXD;
+      AsmInst *load = add_inst(cg, op);
+      set_reg(&load->dst, d, 8);
+      set_mem(&load->src, a, 0, inst->size);
+      finish(cg, inst, d);
       return;
     }
-    case ND_DO: {
-      int seq = labelseq++;
-      int brk = brkseq;
-      int cont = contseq;
-      brkseq = contseq = seq;
-
-      printf(".L.begin.%d:\n", seq);
-      gen(node->then);
-      printf(".L.continue.%d:\n", seq);
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  jne .L.begin.%d\n", seq);
-      printf(".L.break.%d:\n", seq);
-
-      brkseq = brk;
-      contseq = cont;
+    case IR_STORE: {
+      int a = src_reg(cg, inst->args[0], REG_R11);
+      int v = src_reg(cg, inst->args[1], REG_RAX);
+      AsmInst *store = add_inst(cg, ASM_MOV);
+      set_mem(&store->dst, a, 0, inst->size);
+      set_reg(&store->src, v, inst->size);
       return;
     }
-    case ND_SWITCH: {
-      int seq = labelseq++;
-      int brk = brkseq;
-      brkseq = seq;
-
-      gen(node->cond);
-      printf("  pop rax\n");
-
-      for (Node *n = node->case_next; n; n = n->case_next) {
-        n->case_label = labelseq++;
-        printf("  cmp rax, %ld\n", n->val);
-        printf("  je .L.case.%d\n", n->case_label);
-      }
-
-      if (node->default_case) {
-        int i = labelseq++;
-        node->default_case->case_label = i;
-        printf("  jmp .L.case.%d\n", i);
-      }
-
-      printf("  jmp .L.break.%d\n", seq);
-      // 実際のcase文の処理はここで展開する
-      gen(node->then);
-      printf(".L.break.%d:\n", seq);
-
-      brkseq = brk;
+    case IR_NOT: {
+      int d = dst_reg(cg, inst);
+      emit_mov(cg, d, loc_of(cg, inst->args[0]));
+      AsmInst *not = add_inst(cg, ASM_NOT);
+      set_reg(&not->dst, d, 8);
+      finish(cg, inst, d);
       return;
     }
-    case ND_CASE:
-      printf(".L.case.%d:\n", node->case_label);
-      gen(node->lhs);
+    case IR_SEXT: {
+      int d = dst_reg(cg, inst);
+      AsmInst *ext = add_inst(cg, inst->size == 4 ? ASM_MOVSXD : ASM_MOVSX);
+      set_reg(&ext->dst, d, 8);
+      set_loc(cg, &ext->src, loc_of(cg, inst->args[0]), inst->size);
+      finish(cg, inst, d);
       return;
-    case ND_BLOCK:
-    case ND_STMT_EXPR:
-      for (Node *n = node->body; n; n = n->next)
-        gen(n);
+    }
+    case IR_CALL:
+      emit_call(cg, inst);
+      return;
+    case IR_VA_START: {
+      // https://uclibc.org/docs/psABI-x86_64.pdf
+      int a = src_reg(cg, inst->args[0], REG_RAX);
+      AsmInst *mov = add_inst(cg, ASM_MOV);
+      set_reg(&mov->dst, REG_R11, 4);
+      set_mem(&mov->src, REG_RBP, -8, 4);
+      mov = add_inst(cg, ASM_MOV);
+      set_mem(&mov->dst, a, 0, 4);
+      set_imm(&mov->src, 0);
+      mov = add_inst(cg, ASM_MOV);
+      set_mem(&mov->dst, a, 4, 4);
+      set_imm(&mov->src, 0);
+      mov = add_inst(cg, ASM_MOV);
+      set_mem(&mov->dst, a, 8, 8);
+      set_reg(&mov->src, REG_R11, 8);
+      mov = add_inst(cg, ASM_MOV);
+      set_mem(&mov->dst, a, 16, 8);
+      set_imm(&mov->src, 0);
       return;
-    case ND_FUNCALL: {
-      if(!strcmp(node->funcname, "__builtin_va_start")) {
-        // https://uclibc.org/docs/psABI-x86_64.pdf
-        printf("  pop rax\n");
-        printf("  mov edi, dword ptr [rbp-8]\n");
-        printf("  mov dword ptr [rax], 0\n");
-        printf("  mov dword ptr [rax+4], 0\n");
-        printf("  mov qword ptr [rax+8], rdi\n");
-        printf("  mov qword ptr [rax+16], 0\n");
+    }
+    case IR_JMP:
+      copy_phi_args(cg, b, b->succs[0]);
+      emit_jmp(cg, b, b->succs[0]);
+      return;
+    case IR_BR: {
+      // クリティカルエッジを分割してあるので、分岐先にφ命令はない
+      AsmInst *cmp = add_inst(cg, ASM_CMP);
+      set_loc(cg, &cmp->dst, loc_of(cg, inst->args[0]), 8);
+      set_imm(&cmp->src, 0);
+      if (next_block(cg, b) == b->succs[0]) {
+        add_jump(cg, ASM_JCC, CC_E, b->succs[1]->id);
         return;
       }
-
-      int nargs = 0; // 引数の個数
-      for (Node *arg = node->args; arg; arg = arg->next) {
-        gen(arg);
-        nargs++;
-      }
-
-      for (int i = nargs - 1; i >= 0; i--)
-        printf("  pop %s\n", argreg8[i]);
-
-      // 関数呼び出しをする前にRSPが16の倍数になっていなければいけない(ABIで決まっている)
-      int seq = labelseq++;
-      printf("  mov rax, rsp\n");
-      // 16の倍数だったら下位4ビットは全て0のはず
-      // つまり15との論理和を取ったら0になるはず
-      // 16の倍数じゃなかったらRSPに8から引く(RSPは必ず8の倍数か16の倍数になる)
-      printf("  and rax, 15\n");
-      printf("  jne .L.call.%d\n", seq);
-      printf("  mov rax, 0\n");
-      printf("  call _%s\n", node->funcname);
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.call.%d:\n", seq);
-      printf("  sub rsp, 8\n");
-      printf("  mov rax, 0\n");
-      printf("  call _%s\n", node->funcname);
-      printf("  add rsp, 8\n"); // 引いた分を戻す
-      printf(".L.end.%d:\n", seq);
-      if (node->ty->kind == TY_BOOL)
-        // _Boolを返す関数の場合、RAXの下位8bitのみが立っていないといけない
-        printf("  movzx rax, al\n");
-      printf("  push rax\n");
+      add_jump(cg, ASM_JCC, CC_NE, b->succs[0]->id);
+      emit_jmp(cg, b, b->succs[1]);
       return;
     }
-    case ND_ADDR:
-      gen_addr(node->lhs);
-      return;
-    case ND_DEREF:
-      gen(node->lhs);
-      if (node->ty->kind != TY_ARRAY)
-        load(node->ty);
+    case IR_RET:
+      if (inst->nargs)
+        emit_mov(cg, REG_RAX, loc_of(cg, inst->args[0]));
+      if (next_block(cg, b))
+        add_jump(cg, ASM_JMP, CC_E, 0);
       return;
-    case ND_CAST:
-      gen(node->lhs);
-      truncate(node->ty);
+    case IR_ADD:
+      emit_binary(cg, inst, ASM_ADD);
       return;
-    case ND_ADD_EQ:
-    case ND_PTR_ADD_EQ:
-    case ND_SUB_EQ:
-    case ND_PTR_SUB_EQ:
-    case ND_MUL_EQ:
-    case ND_DIV_EQ:
-    case ND_SHL_EQ:
-    case ND_SHR_EQ:
-    case ND_BITAND_EQ:
-    case ND_BITOR_EQ:
-    case ND_BITXOR_EQ:
-      gen_addr(node->lhs);
-      printf("  push [rsp]\n");
-      load(node->lhs->ty);
-      gen(node->rhs);
-      gen_binary(node);
-      store(node->ty);
+    case IR_SUB:
+      emit_binary(cg, inst, ASM_SUB);
       return;
-    case ND_COMMA:
-      gen(node->lhs);
-      gen(node->rhs);
+    case IR_MUL:
+      emit_binary(cg, inst, ASM_IMUL);
       return;
-    case ND_PRE_INC:
-      gen_addr(node->lhs);
-      // storeする時にスタックが
-      // -------<上位アドレス>------
-      // [アドレス]
-      // [storeする値]
-      // -------<下位アドレス>-------
-      // のようになってないといけないのでrspのアドレス(左辺値のアドレス)をpushする
-      // (loadはスタックからpopしてpushするので、ここで左辺値のアドレスをpushしておかないとstoreできない)
-      printf("  push [rsp]\n");
-      load(node->ty);
-      inc(node->ty);
-      store(node->ty);
+    case IR_AND:
+      emit_binary(cg, inst, ASM_AND);
       return;
-    case ND_PRE_DEC:
-      gen_addr(node->lhs);
-      printf("  push [rsp]\n");
-      load(node->ty);
-      dec(node->ty);
-      store(node->ty);
+    case IR_OR:
+      emit_binary(cg, inst, ASM_OR);
       return;
-    case ND_POST_INC:
-      gen_addr(node->lhs);
-      printf("  push [rsp]\n");
-      load(node->ty);
-      inc(node->ty);
-      // インクリメントした値をstoreするが、スタックのトップにはインクリメントする前の値(インクリメントしてからデクリメントした値)を残す
-      store(node->ty);
-      dec(node->ty);
+    case IR_XOR:
+      emit_binary(cg, inst, ASM_XOR);
       return;
-    case ND_POST_DEC:
-      gen_addr(node->lhs);
-      printf("  push [rsp]\n");
-      load(node->ty);
-      dec(node->ty);
-      // デクリメントした値をstoreするが、スタックのトップにはデクリメントする前の値(デクリメントしてからインクリメントした値)を残す
-      store(node->ty);
-      inc(node->ty);
-      return;
-    case ND_NOT:
-      gen(node->lhs);
-      printf("  pop rax\n");
-      // RAXの値が0だったら1、0以外だったら0に更新
-      printf("  cmp rax, 0\n");
-      printf("  sete al\n");
-      printf("  movsx rax, al\n");
-      printf("  push rax\n");
-      return;
-    case ND_BIT_NOT:
-      gen(node->lhs);
-      printf("  pop rax\n");
-      printf("  not rax\n");
-      printf("  push rax\n");
-      return;
-    case ND_LOGOR: {
-      int seq = labelseq++;
-      gen(node->lhs);
-      // lhsの値が0以外ならtrueへジャンプ
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  jne .L.true.%d\n", seq);
-      // rhsの値が0以外ならtrueへジャンプ
-      gen(node->rhs);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  jne .L.true.%d\n", seq);
-      // lhsとrhsがどちらも0なら0(false)をpush
-      printf("  push 0\n");
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.true.%d:\n", seq);
-      printf("  push 1\n");
-      printf(".L.end.%d:\n", seq);
+    case IR_DIV: {
+      // RDXは除算で壊れるので、除算をまたいで生きる値は置かれていない
+      emit_mov(cg, REG_R11, loc_of(cg, inst->args[1]));
+      emit_mov(cg, REG_RAX, loc_of(cg, inst->args[0]));
+      // cqo: RAXに入っている64ビットの値を128ビットに伸ばしてRDXとRAXにセットする
+      add_inst(cg, ASM_CQO);
+      // idiv: 暗黙のうちにRDXとRAXを取って、それを合わせたものを128ビット整数とみなして、それを引数のレジスタの64ビットの値で割り
+      //       商をRAXに、余りをRDXにセットする
+      AsmInst *div = add_inst(cg, ASM_IDIV);
+      set_reg(&div->src, REG_R11, 8);
+      finish(cg, inst, REG_RAX);
       return;
     }
-    case ND_LOGAND: {
-      int seq = labelseq++;
-      gen(node->lhs);
-      // lhsの値が0ならfalseへジャンプ
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .L.false.%d\n", seq);
-      // rhsの値が0ならfalseへジャンプ
-      gen(node->rhs);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .L.false.%d\n", seq);
-      // lhsとrhsがどちらも0でないなら1(true)をpush
-      printf("  push 1\n");
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.false.%d:\n", seq);
-      printf("  push 0\n");
-      printf(".L.end.%d:\n", seq);
+    case IR_SHL:
+    case IR_SAR: {
+      // シフト量はCLで指定する。RCXはシフトをまたいで生きる値には使われていない
+      emit_mov(cg, REG_RAX, loc_of(cg, inst->args[0]));
+      emit_mov(cg, REG_RCX, loc_of(cg, inst->args[1]));
+      // 論理シフトと算術シフトの違い↓
+      // http://kccn.konan-u.ac.jp/information/cs/cyber03/cy3_shc.htm
+      AsmInst *shift = add_inst(cg, inst->op == IR_SHL ? ASM_SHL : ASM_SAR);
+      set_reg(&shift->dst, REG_RAX, 8);
+      set_reg(&shift->src, REG_RCX, 1);
+      finish(cg, inst, REG_RAX);
       return;
     }
-    case ND_BREAK:
-      if (brkseq == 0)
-        error("break文が無効です");
-      printf("  jmp .L.break.%d\n", brkseq);
-      return;
-    case ND_CONTINUE:
-      if (contseq == 0)
-        error("continue文が無効です");
-      printf("  jmp .L.continue.%d\n", contseq);
+    case IR_EQ:
+      emit_cmp(cg, inst, CC_E);
       return;
-    case ND_GOTO:
-      printf("  jmp .L.label.%s.%s\n", funcname, node->label_name);
+    case IR_NE:
+      emit_cmp(cg, inst, CC_NE);
       return;
-    case ND_LABEL:
-      printf(".L.label.%s.%s:\n", funcname, node->label_name);
-      gen(node->lhs);
+    case IR_LT:
+      emit_cmp(cg, inst, CC_L);
       return;
-    case ND_TERNARY: {
-      int seq = labelseq++;
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .L.else.%d\n", seq);
-      gen(node->then);
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.else.%d:\n", seq);
-      gen(node->els);
-      printf(".L.end.%d:\n", seq);
+    case IR_LE:
+      emit_cmp(cg, inst, CC_LE);
       return;
-    }
-    default:;
+    default:
+      error("不正なIRの命令です");
+  }
+}
+
+static void emit_block(CodeGen *cg, IrBlock *b) {
+  add_jump(cg, ASM_LABEL, CC_E, b->id);
+  for (IrInst *inst = b->insts; inst; inst = inst->next)
+    emit_inst(cg, inst);
+}
+
+// .global _name または _name: を出力する
+static void emit_global_label(char *name, bool global) {
+  emits(global ? ".global _" : "_");
+  emits(name);
+  emits(global ? "\n" : ":\n");
+}
+
+static void emit_align(int align) {
+  emits(".align ");
+  emit_num(align);
+  emits("\n");
+}
+
+static void print_operand(Operand *opd) {
+  if (opd->kind == OPD_REG) {
+    emits(reg_name(opd->reg, opd->size));
+    return;
+  }
+  if (opd->kind == OPD_IMM) {
+    emit_num(opd->val);
+    return;
+  }
+  if (opd->kind == OPD_GOT) {
+    emits("[_");
+    emits(opd->sym);
+    emits("@GOTPCREL + rip]");
+    return;
   }
 
+  if (opd->size == 1)
+    emits("byte ptr ");
+  else if (opd->size == 2)
+    emits("word ptr ");
+  else if (opd->size == 4)
+    emits("dword ptr ");
+  else if (opd->size == 8)
+    emits("qword ptr ");
+  emits("[");
+  emits(reg64[opd->reg]);
+  if (opd->val > 0)
+    emits("+");
+  if (opd->val)
+    emit_num(opd->val);
+  emits("]");
+}
 
-  gen(node->lhs);
-  gen(node->rhs);
-  gen_binary(node);
+// ラベルの名前(.L.bb.関数名.ブロックの番号、0なら.L.return.関数名)を出力する
+static void print_label(CodeGen *cg, int label) {
+  if (label) {
+    emits(".L.bb.");
+    emits(cg->funcname);
+    emits(".");
+    emit_num(label);
+    return;
+  }
+  emits(".L.return.");
+  emits(cg->funcname);
+}
+
+// 命令列をアセンブリとして出力する
+static void print_insts(CodeGen *cg) {
+  AsmFunc *af = cg->af;
+
+  for (int i = 0; i < af->ninsts; i++) {
+    AsmInst *inst = af->insts[i];
+
+    if (inst->op == ASM_LABEL) {
+      print_label(cg, inst->label);
+      emits(":\n");
+      continue;
+    }
+
+    emits("  ");
+    emits(asm_names[inst->op]);
+    switch (inst->op) {
+      case ASM_JMP:
+        emits(" ");
+        print_label(cg, inst->label);
+        break;
+      case ASM_JCC:
+        emits(cc_names[inst->cc]);
+        emits(" ");
+        print_label(cg, inst->label);
+        break;
+      case ASM_SETCC:
+        emits(cc_names[inst->cc]);
+        emits(" ");
+        emits(reg8[inst->dst.reg]);
+        break;
+      case ASM_CALL:
+        emits(" _");
+        emits(inst->sym);
+        break;
+      case ASM_CQO:
+      case ASM_RET:
+        break;
+      case ASM_IDIV:
+      case ASM_PUSH:
+        emits(" ");
+        print_operand(&inst->src);
+        break;
+      case ASM_NOT:
+      case ASM_POP:
+        emits(" ");
+        print_operand(&inst->dst);
+        break;
+      default:
+        emits(" ");
+        print_operand(&inst->dst);
+        emits(", ");
+        print_operand(&inst->src);
+    }
+    emits("\n");
+  }
 }
 
 // データ(.data)セクションの内容を出力する
@@ -656,11 +638,11 @@ void gen(Node *node) {
 void emit_data(Program *prog) {
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     if (!vl->var->is_static)
-      printf(".global _%s\n", vl->var->name);
+      emit_global_label(vl->var->name, true);
   }
 
   // 初期化されていないグローバル変数はbss領域に格納
-  printf(".bss\n");
+  emits(".bss\n");
 
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     Var *gvar = vl->var;
@@ -668,98 +650,181 @@ void emit_data(Program *prog) {
     if (gvar->initializer)
       continue;
 
-    printf(".align %d\n", gvar->ty->align);
-    printf("_%s:\n", gvar->name);
+    emit_align(gvar->ty->align);
+    emit_global_label(gvar->name, false);
     // 指定したバイト数(var->ty->size)を0で埋める
     // https://docs.oracle.com/cd/E26502_01/html/E28388/eoiyg.html
-    printf("  .zero %d\n", gvar->ty->size);
+    emits("  .zero ");
+    emit_num(gvar->ty->size);
+    emits("\n");
   }
 
   // 初期化されているグローバル変数はdata領域に格納
-  printf(".data\n");
+  emits(".data\n");
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     Var *gvar = vl->var;
 
     if (!gvar->initializer)
       continue;
-    printf(".align %d\n", gvar->ty->align);
-    printf("_%s:\n", gvar->name);
+    emit_align(gvar->ty->align);
+    emit_global_label(gvar->name, false);
 
     for (Initializer *init = gvar->initializer; init; init = init->next) {
-      if (init->label)
+      if (init->label) {
         // 他のグローバル変数への参照
-        printf("  .quad _%s%+ld\n", init->label, init->addend);
-      else if (init->size == 1)
-        printf("  .byte %ld\n", init->val);
-      else
-        printf("  .%dbyte %ld\n", init->size, init->val);
+        emits("  .quad _");
+        emits(init->label);
+        if (init->addend >= 0)
+          emits("+");
+        emit_num(init->addend);
+      } else if (init->size == 1) {
+        emits("  .byte ");
+        emit_num(init->val);
+      } else {
+        emits("  .");
+        emit_num(init->size);
+        emits("byte ");
+        emit_num(init->val);
+      }
+      emits("\n");
     }
   }
 }
 
-void load_arg(Var *var, int idx) {
-  int sz = var->ty->size;
-  if (sz == 1) {
-    printf("  mov[rbp-%d], %s\n", var->offset, argreg1[idx]);
-  } else if (sz == 2) {
-    printf("  mov[rbp-%d], %s\n", var->offset, argreg2[idx]);
-  } else if (sz == 4) {
-    printf("  mov[rbp-%d], %s\n", var->offset, argreg4[idx]);
-  } else {
-    assert(sz == 8);
-    printf("  mov[rbp-%d], %s\n", var->offset, argreg8[idx]);
-  }
+// アセンブリの先頭部分を出力する
+void emit_header() {
+  emits(".intel_syntax noprefix\n");
+  emits(".text\n");
 }
 
-void emit_text(Program *prog) {
-  printf(".text\n");
+// 関数のローカル変数にオフセットを割り当てる
+// SSAの値に昇格した変数の分も領域を取っておき、メモリに置く変数の配置は昇格しない時と同じにする
+void assign_lvar_offsets(Function *fn) {
+  int offset = fn->has_varargs ? 56 : 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    offset = align_to(offset, var->ty->align);
+    offset += var->ty->size;
+    var->offset = offset;
+  }
+  // スタックサイズを8の倍数に整える
+  fn->stack_size = align_to(offset, 8);
+}
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    funcname = fn->name;
-    if (!fn->is_static)
-      printf(".global _%s\n", funcname);
-    printf("_%s:\n", funcname);
-
-    // プロローグ
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", fn->stack_size);
-
-    if(fn->has_varargs) {
-      int n= 0;
-      for(VarList *vl = fn->params; vl; vl = vl->next)
-        n++;
-
-      printf("mov dword ptr [rbp-8], %d\n", n * 8);
-      printf("mov [rbp-16], r9\n");
-      printf("mov [rbp-24], r8\n");
-      printf("mov [rbp-32], rcx\n");
-      printf("mov [rbp-40], rdx\n");
-      printf("mov [rbp-48], rsi\n");
-      printf("mov [rbp-56], rdi\n");
+// 使うcallee-savedレジスタを退避するスロット(戻す時はrestore)
+static void save_callee_saved(CodeGen *cg, bool restore) {
+  int offset = cg->locals + 8 * cg->ra->nslots;
+  for (int i = 0; i < 5; i++) {
+    if (!(cg->ra->used & (1 << callee_saved[i])))
+      continue;
+    offset += 8;
+    AsmInst *mov = add_inst(cg, ASM_MOV);
+    if (restore) {
+      set_reg(&mov->dst, callee_saved[i], 8);
+      set_mem(&mov->src, REG_RBP, -offset, 8);
+    } else {
+      set_mem(&mov->dst, REG_RBP, -offset, 8);
+      set_reg(&mov->src, callee_saved[i], 8);
     }
+  }
+}
 
-    // ABIで指定されたレジスタに格納されている関数の引数の値を
-    // ローカル変数のためのスタック上の領域に書き出す
-    int i = 0;
-    for (VarList *vl = fn->params; vl; vl = vl->next) {
-      load_arg(vl->var, i++);
-    }
+// 関数1つ分のコード(.text)を出力する
+// 関数本体をIRに変換し、レジスタを割り当てて命令列を作り、覗き穴最適化をかけて出力する
+// 出力し終えたら、関数fnとそのNode・ローカル変数・IRを解放する
+void emit_function(Function *fn) {
+  // このスレッドのノードプールを、この関数のものに一時的に切り替える
+  NodePool *pool = get_node_pool();
+  set_node_pool(fn->nodes);
+
+  IrFunc *ir = gen_ir(fn);
+  if (opt_verify_ir || opt_dump_ir)
+    verify_ir(ir);
+  if (opt_dump_ir) {
+    dump_ir(ir);
+    set_node_pool(pool);
+    free_arena(fn->arena);
+    return;
+  }
 
-    for (Node *n = fn->node; n; n = n->next)
-      gen(n);
+  split_critical_edges(ir);
+  if (opt_verify_ir)
+    verify_ir(ir);
+  assign_lvar_offsets(fn);
+
+  CodeGen ctx = {};
+  CodeGen *cg = &ctx;
+  cg->funcname = fn->name;
+  cg->ir = ir;
+  cg->ra = alloc_regs(ir);
+  cg->locals = fn->stack_size;
+
+  AsmFunc *af = arena_alloc(fn->arena, sizeof(AsmFunc));
+  af->arena = fn->arena;
+  af->cap = 64;
+  af->insts = arena_alloc(fn->arena, sizeof(AsmInst *) * af->cap);
+  af->nlabels = ir->nblocks + 1;
+  cg->af = af;
+
+  int saved = 0;
+  for (int i = 0; i < 5; i++)
+    if (cg->ra->used & (1 << callee_saved[i]))
+      saved++;
+
+  // プロローグ
+  // RSPを16の倍数に揃えておく
+  AsmInst *push = add_inst(cg, ASM_PUSH);
+  set_reg(&push->src, REG_RBP, 8);
+  add_rr(cg, ASM_MOV, REG_RBP, REG_RSP);
+  add_ri(cg, ASM_SUB, REG_RSP, align_to(cg->locals + 8 * cg->ra->nslots + 8 * saved, 16));
+
+  if (fn->has_varargs) {
+    int n = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+      n++;
+
+    AsmInst *mov = add_inst(cg, ASM_MOV);
+    set_mem(&mov->dst, REG_RBP, -8, 4);
+    set_imm(&mov->src, n * 8);
+    for (int i = 0; i < 6; i++) {
+      mov = add_inst(cg, ASM_MOV);
+      set_mem(&mov->dst, REG_RBP, -56 + 8 * i, 8);
+      set_reg(&mov->src, argregs[i], 8);
+    }
+  }
 
-    // エピローグ
-    printf(".L.return.%s:\n", funcname);
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    // 最後の式の値がRAXに残っているのでそれが返り値になる
-    printf("  ret\n");
+  // 使うcallee-savedレジスタはスロットの下に退避する
+  save_callee_saved(cg, false);
+
+  for (int i = 0; i < ir->nblocks; i++)
+    emit_block(cg, ir->blocks[i]);
+
+  // エピローグ
+  // 戻り値はRAXに入っている
+  add_jump(cg, ASM_LABEL, CC_E, 0);
+  save_callee_saved(cg, true);
+  add_rr(cg, ASM_MOV, REG_RSP, REG_RBP);
+  AsmInst *pop = add_inst(cg, ASM_POP);
+  set_reg(&pop->dst, REG_RBP, 8);
+  add_inst(cg, ASM_RET);
+
+  long hits[NUM_PEEP_RULES];
+  for (int i = 0; i < NUM_PEEP_RULES; i++)
+    hits[i] = 0;
+  if (opt_no_peephole != (1 << NUM_PEEP_RULES) - 1)
+    peephole(af, hits);
+  add_peephole_hits(hits);
+
+  if (opt_emit_obj) {
+    encode_function(af, cg->funcname, fn->is_static);
+  } else {
+    if (!fn->is_static)
+      emit_global_label(cg->funcname, true);
+    emit_global_label(cg->funcname, false);
+    print_insts(cg);
   }
-}
 
-void codegen(Program *prog) {
-  printf(".intel_syntax noprefix\n");
-  emit_data(prog);
-  emit_text(prog);
+  // この関数とそのNode・ローカル変数・IRはもう使わないので解放する
+  set_node_pool(pool);
+  free_arena(fn->arena);
 }
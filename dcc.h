@@ -17,6 +17,20 @@
 
 typedef struct Type Type;
 typedef struct Member Member; // 構造体のメンバ
+typedef struct Arena Arena; // まとめて解放できる領域
+typedef struct NodePool NodePool; // ASTのノードをまとめて格納する領域
+
+// --dump-ir: アセンブリの代わりにIRを出力する
+extern bool opt_dump_ir;
+
+// --verify-ir: 生成したIRを検査する
+extern bool opt_verify_ir;
+
+// --no-peephole[=規則]: 覗き穴最適化で使わない規則の集合(1 << 規則 の和)
+extern int opt_no_peephole;
+
+// -c: アセンブリの代わりにオブジェクトファイルを出力する
+extern bool opt_emit_obj;
 
 // 入力ファイル名
 extern char *filename;
@@ -29,24 +43,98 @@ extern char *user_input;
 //
 
 // トークンの種類
+// 予約語と記号は1つずつ別の種類にするので、パーサは整数の比較だけでトークンを照合できる
 typedef enum {
-  TK_RESERVED, // 記号
   TK_IDENT, // 識別子
   TK_NUM, // 整数
   TK_STR, // 文字列リテラル
   TK_EOF, // End Of File
+
+  // 予約語
+  TK_RETURN, // return
+  TK_IF, // if
+  TK_ELSE, // else
+  TK_WHILE, // while
+  TK_FOR, // for
+  TK_DO, // do
+  TK_SWITCH, // switch
+  TK_CASE, // case
+  TK_DEFAULT, // default
+  TK_BREAK, // break
+  TK_CONTINUE, // continue
+  TK_GOTO, // goto
+  TK_SIZEOF, // sizeof
+  TK_ALIGNOF, // _Alignof
+  TK_VOID, // void
+  TK_BOOL, // _Bool
+  TK_CHAR, // char
+  TK_SHORT, // short
+  TK_INT, // int
+  TK_LONG, // long
+  TK_STRUCT, // struct
+  TK_ENUM, // enum
+  TK_TYPEDEF, // typedef
+  TK_STATIC, // static
+  TK_EXTERN, // extern
+
+  // 記号
+  TK_SHL_ASSIGN, // <<=
+  TK_SHR_ASSIGN, // >>=
+  TK_ELLIPSIS, // ...
+  TK_EQ, // ==
+  TK_NE, // !=
+  TK_LE, // <=
+  TK_GE, // >=
+  TK_ARROW, // ->
+  TK_INC, // ++
+  TK_DEC, // --
+  TK_ADD_ASSIGN, // +=
+  TK_SUB_ASSIGN, // -=
+  TK_MUL_ASSIGN, // *=
+  TK_DIV_ASSIGN, // /=
+  TK_LOGAND, // &&
+  TK_LOGOR, // ||
+  TK_SHL, // <<
+  TK_SHR, // >>
+  TK_AND_ASSIGN, // &=
+  TK_OR_ASSIGN, // |=
+  TK_XOR_ASSIGN, // ^=
+  TK_PLUS, // +
+  TK_MINUS, // -
+  TK_STAR, // *
+  TK_SLASH, // /
+  TK_LPAREN, // (
+  TK_RPAREN, // )
+  TK_LT, // <
+  TK_GT, // >
+  TK_SEMICOLON, // ;
+  TK_ASSIGN, // =
+  TK_RBRACE, // }
+  TK_LBRACE, // {
+  TK_COMMA, // ,
+  TK_AMP, // &
+  TK_LBRACKET, // [
+  TK_RBRACKET, // ]
+  TK_DOT, // .
+  TK_NOT, // !
+  TK_TILDE, // ~
+  TK_PIPE, // |
+  TK_HAT, // ^
+  TK_COLON, // :
+  TK_QUESTION, // ?
 } TokenKind;
 
 // トークン型
+// トークンは位置(添字)で参照する
 typedef struct Token Token;
 struct Token {
   TokenKind kind; // トークンの種類
-  Token *next; // 次のトークン
-  int val; // kindがTK_NUMの場合、その値
-  char *str; // トークン文字列
   int len; // トークンの長さ
-  char *contents; // 文字列リテラルの内容
+  char *str; // トークン文字列
+  int val; // kindがTK_NUMの場合、その値
   int cont_len; // 文字列リテラルの長さ
+  char *contents; // 文字列リテラルの内容
+  char *ident; // kindがTK_IDENTの場合、インターンされた識別子名
 };
 
 // 変数
@@ -58,6 +146,7 @@ struct Var {
   Type *ty;
   bool is_local; // ローカル変数 or グローバル変数
   int offset; // RBPからのオフセット
+  int ssa_idx; // ローカル変数をSSAの値に昇格した場合、その番号(1から)。メモリに置く場合は0
 
   // グローバル変数
   Initializer *initializer; // グローバル変数の初期化値
@@ -90,24 +179,83 @@ void error_at(char *loc, char *fmt, ...);
 
 void warn_at(char *loc, char *fmt, ...);
 
-bool consume(char *op);
+Token *token_at(int pos);
 
-Token *peek(char *op);
+Token *cur_token(void);
+
+void release_tokens(int pos);
+
+Token *save_tokens(int begin, int end, Arena *arena);
+
+void read_saved_tokens(Token *toks, int pos, int len);
+
+bool consume(TokenKind kind);
+
+Token *peek(TokenKind kind);
 
 Token *consume_ident(void);
 
-bool expect(char *op);
+bool expect(TokenKind kind);
 
 int expect_number(void);
 
 char *expect_ident(void);
 
+char *intern(char *s, int len);
+
 bool at_eof(void);
 
-Token *tokenize(char *p);
+void tokenize(char *p);
 
-// 現在着目しているトークン
-extern Token *token;
+// 現在着目しているトークンの位置(tokensの添字)
+extern int token_pos;
+
+//
+// file.c
+//
+
+char *read_file(char *path);
+
+//
+// arena.c
+//
+
+Arena *new_arena(char *name);
+
+void *arena_alloc(Arena *arena, long size);
+
+long arena_mark(Arena *arena);
+
+void arena_release(Arena *arena, long mark);
+
+void free_arena(Arena *arena);
+
+void print_arena_stats(void);
+
+// 翻訳単位全体で使うオブジェクト(型・グローバル変数・初期化子など)の領域
+extern Arena *tu_arena;
+
+// 関数本体(Node・ローカル変数)の領域。関数の外ではtu_arenaと同じ
+extern Arena *fn_arena;
+
+// ブロックスコープの間だけ使うオブジェクト(VarScope/TagScope)の領域
+extern Arena *scope_arena;
+
+//
+// scan.c
+//
+
+void init_scan(void);
+
+char *skip_space(char *p);
+
+char *skip_line_comment(char *p);
+
+char *find_comment_end(char *p);
+
+char *skip_code_chars(char *p);
+
+char *skip_string_chars(char *p);
 
 //
 // parse.c
@@ -181,63 +329,449 @@ typedef enum {
 typedef struct Node Node;
 struct Node {
   NodeKind kind; // ノードの種類
-  Node *next; // 次のノード(';'区切りで複数の式を書く場合 or 関数の引数)
+  int id; // このノードのハンドル
+
+  // 子ノードなど、他のノードはすべてハンドルで指す(node_at()でポインタに変換する)
+  int next; // 次のノード(';'区切りで複数の式を書く場合 or 関数の引数)
+  int lhs; // 左辺 or kindがND_MEMBERの時、構造体 ex.) `a.x` の `a`
+  int rhs; // 右辺
+  int ext; // 一部の種類のノードだけが使う情報(NodeExt)のハンドル。なければ0
+
   Type *ty; // ノードの型(Type)
-  Node *lhs; // 左辺 or kindがND_MEMBERの時、構造体 ex.) `a.x` の `a`
-  Node *rhs; // 右辺
   Var *var; // kindがND_VARの場合、その変数
-  long val; // kindがND_NUMの場合、その値
+  long val; // kindがND_NUM/ND_CASEの場合、その値
+};
 
+// 一部の種類のノードだけが使う情報
+// すべてのノードに持たせると大きくなるので、ノードプールの別の配列に置いてノードのextで指す
+// 読む時はnode_ext()、書く時はalloc_node_ext()で引く
+typedef struct {
   // 制御構文
-  Node *cond; // kindがND_IF/ND_WHILE/ND_FOR/ND_SWITCHの場合、その条件式。
-  Node *then; // kindがND_IF/ND_WHILE/ND_FORの場合、条件がtrueの時に評価される式
-  Node *els; // kindがND_IF/ND_TERNARYの場合、条件がfalseの時に評価される式
-  Node *init; // kindがND_FORの場合、初期値
-  Node *inc; // kindがND_FORの場合、ループごとの増分
+  int cond; // kindがND_IF/ND_WHILE/ND_FOR/ND_SWITCHの場合、その条件式。
+  int then; // kindがND_IF/ND_WHILE/ND_FORの場合、条件がtrueの時に評価される式
+  int els; // kindがND_IF/ND_TERNARYの場合、条件がfalseの時に評価される式
+  int init; // kindがND_FORの場合、初期値
+  int inc; // kindがND_FORの場合、ループごとの増分
 
   // ブロック or Statement expression
-  Node *body; // kindがND_BLOCK or Statement expressionの時、含まれる式
-
-  // 構造体
-  Member *member; // kindがND_MEMBERの時、構造体のメンバ
+  int body; // kindがND_BLOCK or Statement expressionの時、含まれる式
 
   // 関数
-  char *funcname; // kindがND_FUNCALLの時、関数名
-  Node *args; // kindがND_FUNCALLの時、引数
-
-  // goto
-  char *label_name; // kindがND_GOTOのとき、飛ぶ先のラベル名。kindがND_LABELのとき、そのラベル名。
+  int args; // kindがND_FUNCALLの時、引数
 
   // switch-case
-  Node *case_next; // kindがND_CASEのとき、次のcase。kindがND_SWITCHのとき、最初のcase。
-  Node *default_case; // kindがND_SWITCHのとき、defaultのcase
+  int case_next; // kindがND_CASEのとき、次のcase。kindがND_SWITCHのとき、最初のcase。
+  int default_case; // kindがND_SWITCHのとき、defaultのcase
   int case_label; // kindがND_CASEのとき、アセンブリでのラベルのシーケンス番号
-};
+
+  Member *member; // kindがND_MEMBERの時、構造体のメンバ
+  char *funcname; // kindがND_FUNCALLの時、関数名
+  char *label_name; // kindがND_GOTOのとき、飛ぶ先のラベル名。kindがND_LABELのとき、そのラベル名。
+} NodeExt;
 
 typedef struct Function Function;
 struct Function {
-  Function *next; // 次に実行する関数を連結リストで管理
   char *name; // 関数名
-  Node *node; // 関数のブロック部分(実際の処理)
+  NodePool *nodes; // 関数本体のノードプール
+  int node; // 関数のブロック部分(実際の処理)
+  int body_pos; // 関数本体の"{"の位置
+  int body_end; // 関数本体の"}"の次の位置
+  Token *tokens; // 本体のパースを後回しにした場合、本体のトークンのコピー
+  struct VarScope *var_scope; // 本体から見えるトップレベルの宣言(本体の前までのもの)
+  struct TagScope *tag_scope; // 本体から見えるトップレベルのタグ
   VarList *locals; // ローカル変数
   VarList *params; // 引数
+  Type *return_ty; // 戻り値の型
   int stack_size; // 引数の個数 * 8 (関数呼び出し時にに下げるスタックの大きさ)
   bool is_static; // staticかどうか
   bool has_varargs; // 可変長引数をとるかどうか
+  Arena *arena; // この関数自体とNode・ローカル変数を確保した領域。コードを生成したら解放する
 };
 
 typedef struct {
   VarList *globals; // プログラム全体に含まれるグローバル変数
-  Function *fns; // プログラム全体に含まれる関数
 } Program;
 
-Program *program(void);
+void init_parser(void);
+
+Function *next_function(void);
+
+Program *finish_program(void);
+
+void skim_function_bodies(bool skim);
+
+void parse_body(Function *fn);
+
+void set_data_label_prefix(char *prefix);
+
+//
+// node.c
+//
+
+NodePool *new_node_pool(Arena *arena);
+
+void set_node_pool(NodePool *pool);
+
+NodePool *get_node_pool(void);
+
+Node *node_at(int id);
+
+int node_id(Node *node);
+
+Node *alloc_node(void);
+
+NodeExt *node_ext(Node *node);
+
+NodeExt *alloc_node_ext(Node *node);
+
+NodePool *preorder_nodes(int *head, Arena *arena);
+
+//
+// emit.c
+//
+
+// 再配置の種類(ELFの値)
+typedef enum {
+  R_X86_64_64 = 1,             // 8バイトの絶対アドレス
+  R_X86_64_PLT32 = 4,          // 関数(PLT)へのRIP相対の4バイト
+  R_X86_64_REX_GOTPCRELX = 42, // GOTのエントリへのRIP相対の4バイト(REXプレフィックスの付いたmov)
+} RelocType;
+
+// 出力先の中の位置offsetに置いたシンボル
+typedef struct {
+  char *name;
+  long offset;
+  bool is_global;
+} ObjSymbol;
+
+// 出力先の中の位置offsetを、シンボルsymのアドレス+addendで埋める再配置
+typedef struct {
+  long offset;
+  RelocType type;
+  char *sym;
+  long addend;
+} ObjReloc;
+
+// 出力先
+typedef struct Output Output;
+struct Output {
+  char *buf;
+  long len;
+  long cap;
+  int fd; // ファイルの出力先ならそのファイル記述子、メモリの出力先なら-1
+
+  // 機械語を出力する時に記録するシンボルと再配置(メモリの出力先でだけ使う)
+  ObjSymbol *syms;
+  int nsyms;
+  int syms_cap;
+  ObjReloc *relocs;
+  int nrelocs;
+  int relocs_cap;
+};
+
+void open_output(char *path);
+
+Output *new_output(void);
+
+Output *new_file_output(int fd);
+
+void free_output(Output *o);
+
+void set_output(Output *o);
+
+void emits(char *s);
+
+void emitn(char *p, long len);
+
+void emit_num(long val);
+
+void emitf(char *fmt, ...);
+
+void emit_symbol(char *name, bool is_global);
+
+void emit_reloc(RelocType type, char *sym, long addend);
+
+void append_output(Output *o);
+
+void flush_output(Output *o);
+
+void close_output(void);
+
+void add_peephole_hits(long *hits);
+
+void print_peephole_stats(void);
+
+//
+// ir.c
+//
+
+// IRの命令の種類
+typedef enum {
+  IR_CONST, // 定数val
+  IR_PARAM, // val番目の引数
+  IR_LVAR, // ローカル変数varのアドレス
+  IR_GVAR, // グローバル変数varのアドレス
+  IR_LOAD, // args[0]からsizeバイトを読み込んで符号拡張する
+  IR_STORE, // args[0]にargs[1]の下位sizeバイトを書き込む
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_AND,
+  IR_OR,
+  IR_XOR,
+  IR_SHL,
+  IR_SAR,
+  IR_EQ, // 比較の結果は0か1
+  IR_NE,
+  IR_LT,
+  IR_LE,
+  IR_NOT, // ビット反転
+  IR_SEXT, // 下位sizeバイトを符号拡張する
+  IR_CALL, // 関数nameをargsを引数にして呼ぶ
+  IR_VA_START, // args[0]のva_listを初期化する
+  IR_PHI, // 先行ブロックpreds[i]から来た場合にargs[i]を選ぶ
+  IR_JMP, // succs[0]へジャンプする
+  IR_BR, // args[0]が0以外ならsuccs[0]へ、0ならsuccs[1]へジャンプする
+  IR_RET, // args[0](あれば)を返す
+} IrOp;
+
+typedef struct IrInst IrInst;
+typedef struct IrBlock IrBlock;
+
+// IRの命令
+// 値を作る命令は、その値の番号(1から)をidに持つ。値を作らない命令のidは0
+struct IrInst {
+  IrInst *next; // ブロック内の次の命令
+  IrOp op;
+  int id;
+  int size; // IR_LOAD/IR_STORE/IR_SEXTのバイト数
+  IrInst **args; // 引数(値を作る命令)
+  int nargs;
+  long val; // IR_CONST/IR_PARAMの値
+  Var *var; // IR_LVAR/IR_GVARの変数
+  char *name; // IR_CALLの関数名
+  IrBlock *block; // 命令が属するブロック
+  IrInst *replace; // 不要になったφ命令の置き換え先(構築中だけ使う)
+};
+
+// 基本ブロック
+// 命令は途中で分岐せず、最後の1つの終端命令(IR_JMP/IR_BR/IR_RET)で終わる
+struct IrBlock {
+  int id; // 関数内での番号(1から、配置順)
+  IrInst *phis; // 先頭のφ命令
+  IrInst *insts; // φ命令以外の命令
+  IrInst *last;
+  IrBlock **preds; // 先行ブロック
+  int npreds;
+  int preds_cap;
+  IrBlock *succs[2]; // 後続ブロック
+  int nsuccs;
+
+  // 構築中だけ使う
+  bool sealed; // 先行ブロックがすべて揃っているか
+  bool placed; // 関数の配置順に加えたか
+  bool reachable;
+  IrInst **defs; // defs[i]はこのブロックの終わりでの、i番目の昇格した変数の値
+};
+
+// 関数1つ分のIR
+typedef struct {
+  Function *fn;
+  IrBlock **blocks; // 配置順のブロック。blocks[0]が入口
+  int nblocks;
+  int blocks_cap;
+  int nvals; // 値の個数
+} IrFunc;
+
+void init_ir(void);
+
+IrFunc *gen_ir(Function *fn);
+
+void split_critical_edges(IrFunc *ir);
+
+bool ir_has_value(IrInst *inst);
+
+bool ir_is_terminator(IrInst *inst);
+
+void verify_ir(IrFunc *ir);
+
+void dump_ir(IrFunc *ir);
+
+//
+// regalloc.c
+//
+
+// x86-64の汎用レジスタ(番号は命令のエンコードでの番号)
+typedef enum {
+  REG_RAX,
+  REG_RCX,
+  REG_RDX,
+  REG_RBX,
+  REG_RSP,
+  REG_RBP,
+  REG_RSI,
+  REG_RDI,
+  REG_R8,
+  REG_R9,
+  REG_R10,
+  REG_R11,
+  REG_R12,
+  REG_R13,
+  REG_R14,
+  REG_R15,
+} Reg;
+
+// レジスタ割り当ての結果
+typedef struct {
+  int *reg; // reg[値の番号]はその値を置くレジスタ。スタックに置く(スピルする)場合は-1
+  int *slot; // slot[値の番号]はスピルした値を置くスロットの番号(0から)
+  int nslots;
+  int used; // 割り当てたレジスタの集合(1 << レジスタ番号 の和)
+} RegAlloc;
+
+RegAlloc *alloc_regs(IrFunc *ir);
 
 //
 // codegen.c
 //
 
-void codegen(Program *prog);
+// コード生成が作る機械語の命令の種類
+// 関数1つ分の命令を列にしておき、覗き穴最適化(peephole.c)をかけてから出力する
+typedef enum {
+  ASM_LABEL, // ラベルlabel
+  ASM_MOV,
+  ASM_MOVABS,
+  ASM_MOVSX,
+  ASM_MOVSXD,
+  ASM_MOVZX,
+  ASM_LEA,
+  ASM_ADD,
+  ASM_SUB,
+  ASM_IMUL,
+  ASM_AND,
+  ASM_OR,
+  ASM_XOR,
+  ASM_NOT,
+  ASM_SHL,
+  ASM_SAR,
+  ASM_CQO,
+  ASM_IDIV,
+  ASM_CMP,
+  ASM_TEST,
+  ASM_SETCC, // 条件ccが成り立てば1
+  ASM_JMP, // ラベルlabelへジャンプする
+  ASM_JCC, // 条件ccが成り立てばラベルlabelへジャンプする
+  ASM_CALL, // 関数symを呼ぶ
+  ASM_PUSH,
+  ASM_POP,
+  ASM_RET,
+} AsmOp;
+
+// 条件。cc ^ 1 が逆の条件になるように並べる
+typedef enum {
+  CC_E,
+  CC_NE,
+  CC_L,
+  CC_GE,
+  CC_LE,
+  CC_G,
+} CondCode;
+
+// オペランドの種類
+typedef enum {
+  OPD_NONE,
+  OPD_REG, // レジスタreg(の下位sizeバイト)
+  OPD_IMM, // 即値val
+  OPD_MEM, // アドレス reg + val から始まるsizeバイト。sizeが0なら大きさを書かない(leaのオペランド)
+  OPD_GOT, // グローバル変数symのアドレスを入れたGOTのエントリ
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int size;
+  int reg;
+  long val;
+  char *sym;
+} Operand;
+
+// 機械語の命令1つ
+typedef struct {
+  AsmOp op;
+  CondCode cc;
+  Operand dst;
+  Operand src;
+  int label; // ラベルの番号。ブロックの番号か、0なら関数の出口
+  char *sym;
+} AsmInst;
+
+// 関数1つ分の命令列
+typedef struct {
+  Arena *arena;
+  AsmInst **insts;
+  int ninsts;
+  int cap;
+  int nlabels; // ラベルの番号の上限+1
+} AsmFunc;
+
+void emit_header(void);
+
+void emit_function(Function *fn);
+
+void emit_data(Program *prog);
+
+//
+// peephole.c
+//
+
+// 覗き穴最適化の規則
+typedef enum {
+  PEEP_SELF_MOV,
+  PEEP_DEAD_DEF,
+  PEEP_CMP_BRANCH,
+  PEEP_COPY_PROP,
+  PEEP_ZERO_IDIOM,
+  PEEP_TEST_ZERO,
+  NUM_PEEP_RULES,
+} PeepRule;
+
+void peephole(AsmFunc *af, long *hits);
+
+char *peephole_rule_name(int rule);
+
+int find_peephole_rule(char *name);
+
+//
+// encode.c
+//
+
+void encode_function(AsmFunc *af, char *name, bool is_static);
+
+//
+// elf.c
+//
+
+char *object_file_name(char *path);
+
+void begin_object(void);
+
+void write_object(Program *prog);
+
+//
+// pipeline.c
+//
+
+void start_codegen(void);
+
+void send_function(Function *fn);
+
+void finish_codegen(void);
+
+//
+// procs.c
+//
+
+bool compile_in_procs(void);
 
 //
 // type.c
@@ -266,6 +800,8 @@ struct Type {
   Type *ptr_to; // kindがTY_PTRの時、指しているTypeオブジェクトへのポインタ
   int array_len; // kindがTY_ARRAYの時、配列の長さ
   Member *members; // kindがTY_STRUCTの時、構造体のメンバ
+  Member **member_table; // kindがTY_STRUCTの時、メンバを名前で引くハッシュ表(メンバが少ない時はNULL)
+  int member_table_cap;
   Type *return_ty; // kindがTY_FUNCの時、関数の戻り値の型
 };
 
@@ -286,6 +822,7 @@ struct Member {
 typedef struct VarScope VarScope;
 struct VarScope {
   VarScope *next;
+  VarScope *shadow; // 同じ名前の外側のスコープでの宣言
   char *name;
   Var *var;
   int depth;
@@ -299,18 +836,33 @@ struct VarScope {
 typedef struct TagScope TagScope;
 struct TagScope {
   TagScope *next;
+  TagScope *shadow; // 同じ名前の外側のスコープでのタグ
   char *name;
   int depth;
   Type *ty;
 };
 
+// 名前ごとの、現在見えている一番内側の宣言
+// 宣言がスコープから外れると、shadowをたどって外側の宣言に戻す
+typedef struct ScopeEntry ScopeEntry;
+struct ScopeEntry {
+  char *name;
+  VarScope *var;
+  TagScope *tag;
+  Function *lazy_fn; // この名前の、本体のパースを後回しにしているstatic関数
+  bool fn_used; // この名前の関数が参照されたか
+};
+
 typedef struct {
   VarScope *var_scope; // ローカル変数/グローバル変数/typedef/enum のスコープ
   TagScope *tag_scope; // 構造体タグ/enumタグ のスコープ
+  long mark; // スコープに入った時のscope_arenaの位置
 } Scope;
 
 bool is_integer(Type *ty);
 
+int hash_long(long x);
+
 int align_to(int n, int align);
 
 Type *pointer_to(Type *ptr_to);
@@ -332,4 +884,6 @@ extern Type *bool_type;
 
 Type *array_of(Type *pointer_to, int size);
 
+Type *incomplete_array_of(Type *pointer_to);
+
 #endif //DCC_DCC_H
@@ -0,0 +1,408 @@
+//
+// ELFのオブジェクトファイル(再配置可能ファイル)の出力
+//
+// -cの時は、関数の機械語(encode.c)をメモリの出力先(.text)にためておき、
+// 最後にグローバル変数から.data/.bssを作って、シンボル・再配置と合わせて1つのファイルにする
+//
+// ファイルの中身は次の順に並べる
+//   ELFヘッダ
+//   各セクションの中身(.text .data .symtab .strtab .rela.text .rela.data .shstrtab)
+//   セクションヘッダの表
+//
+// シンボルはアセンブリと違って先頭に'_'を付けない(x86-64のELFの決まり)
+// ローカルなシンボル(staticな関数・変数、文字列リテラルのラベル)を先に、グローバルなシンボルを後に並べる
+// 定義していない関数や変数への再配置があれば、そのシンボルを未定義のグローバルなシンボルとして加える
+//
+// https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+// https://uclibc.org/docs/psABI-x86_64.pdf
+//
+
+#include "dcc.h"
+
+#include <stdint.h>
+
+typedef struct {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint64_t entry;
+  uint64_t phoff;
+  uint64_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+} ElfHeader;
+
+typedef struct {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t addralign;
+  uint64_t entsize;
+} ElfSection;
+
+typedef struct {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+  uint64_t value;
+  uint64_t size;
+} ElfSymbol;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t info;
+  int64_t addend;
+} ElfRela;
+
+enum {
+  ET_REL = 1,
+  EM_X86_64 = 62,
+
+  SHT_PROGBITS = 1,
+  SHT_SYMTAB = 2,
+  SHT_STRTAB = 3,
+  SHT_RELA = 4,
+  SHT_NOBITS = 8,
+
+  SHF_WRITE = 1,
+  SHF_ALLOC = 2,
+  SHF_EXECINSTR = 4,
+  SHF_INFO_LINK = 0x40,
+
+  STB_LOCAL = 0,
+  STB_GLOBAL = 1,
+  STT_NOTYPE = 0,
+  STT_OBJECT = 1,
+  STT_FUNC = 2,
+};
+
+// セクションの番号
+enum {
+  SEC_NULL,
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_BSS,
+  SEC_SYMTAB,
+  SEC_STRTAB,
+  SEC_RELA_TEXT,
+  SEC_RELA_DATA,
+  SEC_SHSTRTAB,
+  SEC_NOTE_GNU_STACK, // スタックを実行可能にしなくてよいことをリンカに伝える
+  NUM_SECTIONS,
+};
+
+static char *section_names[] = {"", ".text", ".data", ".bss", ".symtab", ".strtab",
+                                ".rela.text", ".rela.data", ".shstrtab", ".note.GNU-stack"};
+
+// 関数の機械語をためる出力先
+static Output *text;
+
+// シンボルの表
+// 名前からシンボルの番号を引けるように、番号(+1、0なら空き)のハッシュ表を持つ
+typedef struct {
+  ElfSymbol *syms;
+  int nsyms;
+  int cap;
+  Output *strtab;
+  int *table;
+  int table_size;
+} SymTab;
+
+// パスpathのファイル名の拡張子を.oに変えたもの(-cで-oがない時の出力先)
+char *object_file_name(char *path) {
+  char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  char *dot = strrchr(name, '.');
+  int len = dot ? dot - name : strlen(name);
+  char *buf = malloc(len + 3);
+  sprintf(buf, "%.*s.o", len, name);
+  return buf;
+}
+
+// 関数の機械語をためはじめる
+void begin_object(void) {
+  text = new_output();
+  set_output(text);
+}
+
+static int symbol_hash(char *name) {
+  unsigned h = 2166136261u;
+  for (char *p = name; *p; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+  return h & 0x7fffffff;
+}
+
+static int *find_slot(SymTab *st, char *name) {
+  for (int h = symbol_hash(name);; h++) {
+    int *slot = &st->table[h & (st->table_size - 1)];
+    if (!*slot)
+      return slot;
+    if (!strcmp(st->strtab->buf + st->syms[*slot - 1].name, name))
+      return slot;
+  }
+}
+
+static int find_symbol(SymTab *st, char *name) {
+  return *find_slot(st, name) - 1;
+}
+
+// シンボルを加えて、その番号を返す
+static int new_symbol(SymTab *st, char *name, int bind, int type, int shndx, long value, long size) {
+  if (st->nsyms == st->cap) {
+    st->cap *= 2;
+    st->syms = realloc(st->syms, sizeof(ElfSymbol) * st->cap);
+  }
+  // ハッシュ表は半分以上埋まらないようにする
+  if (st->nsyms * 2 >= st->table_size) {
+    int *old = st->table;
+    int old_size = st->table_size;
+    st->table_size *= 2;
+    st->table = calloc(st->table_size, sizeof(int));
+    for (int i = 0; i < old_size; i++)
+      if (old[i])
+        *find_slot(st, st->strtab->buf + st->syms[old[i] - 1].name) = old[i];
+    free(old);
+  }
+
+  ElfSymbol *sym = &st->syms[st->nsyms];
+  memset(sym, 0, sizeof(ElfSymbol));
+  sym->info = (bind << 4) | type;
+  sym->shndx = shndx;
+  sym->value = value;
+  sym->size = size;
+  set_output(st->strtab);
+  sym->name = st->strtab->len;
+  emitn(name, strlen(name) + 1);
+  set_output(NULL);
+  if (*name)
+    *find_slot(st, name) = st->nsyms + 1;
+  return st->nsyms++;
+}
+
+// 関数のシンボル(bindのものだけ)を加える。大きさは次の関数の先頭までとする
+static void add_func_symbols(SymTab *st, int bind) {
+  for (int i = 0; i < text->nsyms; i++) {
+    ObjSymbol *s = &text->syms[i];
+    if (s->is_global != (bind == STB_GLOBAL))
+      continue;
+    long end = i + 1 < text->nsyms ? text->syms[i + 1].offset : text->len;
+    new_symbol(st, s->name, bind, STT_FUNC, SEC_TEXT, s->offset, end - s->offset);
+  }
+}
+
+// グローバル変数のシンボル(bindのものだけ)を加える
+static void add_var_symbols(SymTab *st, Program *prog, long *offsets, int bind) {
+  int i = 0;
+  for (VarList *vl = prog->globals; vl; vl = vl->next, i++) {
+    Var *var = vl->var;
+    if (var->is_static != (bind == STB_LOCAL))
+      continue;
+    int shndx = var->initializer ? SEC_DATA : SEC_BSS;
+    new_symbol(st, var->name, bind, STT_OBJECT, shndx, offsets[i], var->ty->size);
+  }
+}
+
+// 出力先oの再配置を、.rela.*の中身にして返す
+static Output *relocations(SymTab *st, Output *o) {
+  Output *rela = new_output();
+  for (int i = 0; i < o->nrelocs; i++) {
+    ObjReloc *r = &o->relocs[i];
+    int idx = find_symbol(st, r->sym);
+    if (idx < 0)
+      idx = new_symbol(st, r->sym, STB_GLOBAL, STT_NOTYPE, 0, 0, 0);
+
+    // 同じ.textにあるstaticな関数の呼び出しは、ここで飛び先を埋めてしまう
+    ElfSymbol *sym = &st->syms[idx];
+    if (o == text && r->type == R_X86_64_PLT32 && sym->shndx == SEC_TEXT && (sym->info >> 4) == STB_LOCAL) {
+      int disp = sym->value + r->addend - r->offset;
+      memcpy(o->buf + r->offset, &disp, 4);
+      continue;
+    }
+
+    ElfRela ent = {r->offset, ((uint64_t) idx << 32) | r->type, r->addend};
+    set_output(rela);
+    emitn((char *) &ent, sizeof(ent));
+    set_output(NULL);
+  }
+  return rela;
+}
+
+static void emit_zeros(long len) {
+  static char zeros[64];
+  for (; len > 0; len -= sizeof(zeros))
+    emitn(zeros, len < sizeof(zeros) ? len : sizeof(zeros));
+}
+
+// 関数の機械語とグローバル変数を、オブジェクトファイルとして出力する
+void write_object(Program *prog) {
+  set_output(NULL);
+
+  // グローバル変数を.dataと.bssに並べる
+  int nvars = 0;
+  for (VarList *vl = prog->globals; vl; vl = vl->next)
+    nvars++;
+  long *offsets = calloc(nvars + 1, sizeof(long));
+  Output *data = new_output();
+  long bss_size = 0;
+  int data_align = 1;
+  int bss_align = 1;
+
+  set_output(data);
+  int i = 0;
+  for (VarList *vl = prog->globals; vl; vl = vl->next, i++) {
+    Var *var = vl->var;
+    int align = var->ty->align;
+
+    if (!var->initializer) {
+      bss_size = align_to(bss_size, align);
+      offsets[i] = bss_size;
+      bss_size += var->ty->size;
+      if (bss_align < align)
+        bss_align = align;
+      continue;
+    }
+
+    emit_zeros(align_to(data->len, align) - data->len);
+    offsets[i] = data->len;
+    if (data_align < align)
+      data_align = align;
+
+    for (Initializer *init = var->initializer; init; init = init->next) {
+      if (init->label) {
+        // 他のグローバル変数への参照
+        emit_reloc(R_X86_64_64, init->label, init->addend);
+        emit_zeros(8);
+        continue;
+      }
+      for (int j = 0; j < init->size; j++) {
+        char c = j < 8 ? init->val >> (j * 8) : 0;
+        emitn(&c, 1);
+      }
+    }
+  }
+  set_output(NULL);
+
+  // シンボルの表を作る
+  SymTab st = {};
+  st.cap = 64;
+  st.syms = malloc(sizeof(ElfSymbol) * st.cap);
+  st.table_size = 128;
+  st.table = calloc(st.table_size, sizeof(int));
+  st.strtab = new_output();
+  // 0番は名前のないシンボル(.strtabの先頭の空文字列を名前にする)
+  new_symbol(&st, "", STB_LOCAL, STT_NOTYPE, 0, 0, 0);
+  add_func_symbols(&st, STB_LOCAL);
+  add_var_symbols(&st, prog, offsets, STB_LOCAL);
+  int first_global = st.nsyms;
+  add_func_symbols(&st, STB_GLOBAL);
+  add_var_symbols(&st, prog, offsets, STB_GLOBAL);
+  Output *rela_text = relocations(&st, text);
+  Output *rela_data = relocations(&st, data);
+
+  Output *shstrtab = new_output();
+  ElfSection shdrs[NUM_SECTIONS] = {};
+  set_output(shstrtab);
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    shdrs[i].name = shstrtab->len;
+    emitn(section_names[i], strlen(section_names[i]) + 1);
+  }
+  set_output(NULL);
+
+  shdrs[SEC_TEXT].type = SHT_PROGBITS;
+  shdrs[SEC_TEXT].flags = SHF_ALLOC | SHF_EXECINSTR;
+  shdrs[SEC_TEXT].addralign = 16;
+  shdrs[SEC_DATA].type = SHT_PROGBITS;
+  shdrs[SEC_DATA].flags = SHF_ALLOC | SHF_WRITE;
+  shdrs[SEC_DATA].addralign = data_align;
+  shdrs[SEC_BSS].type = SHT_NOBITS;
+  shdrs[SEC_BSS].flags = SHF_ALLOC | SHF_WRITE;
+  shdrs[SEC_BSS].addralign = bss_align;
+  shdrs[SEC_BSS].size = bss_size;
+  shdrs[SEC_SYMTAB].type = SHT_SYMTAB;
+  shdrs[SEC_SYMTAB].link = SEC_STRTAB;
+  shdrs[SEC_SYMTAB].info = first_global;
+  shdrs[SEC_SYMTAB].addralign = 8;
+  shdrs[SEC_SYMTAB].entsize = sizeof(ElfSymbol);
+  shdrs[SEC_STRTAB].type = SHT_STRTAB;
+  shdrs[SEC_STRTAB].addralign = 1;
+  shdrs[SEC_RELA_TEXT].type = SHT_RELA;
+  shdrs[SEC_RELA_TEXT].flags = SHF_INFO_LINK;
+  shdrs[SEC_RELA_TEXT].link = SEC_SYMTAB;
+  shdrs[SEC_RELA_TEXT].info = SEC_TEXT;
+  shdrs[SEC_RELA_TEXT].addralign = 8;
+  shdrs[SEC_RELA_TEXT].entsize = sizeof(ElfRela);
+  shdrs[SEC_RELA_DATA].type = SHT_RELA;
+  shdrs[SEC_RELA_DATA].flags = SHF_INFO_LINK;
+  shdrs[SEC_RELA_DATA].link = SEC_SYMTAB;
+  shdrs[SEC_RELA_DATA].info = SEC_DATA;
+  shdrs[SEC_RELA_DATA].addralign = 8;
+  shdrs[SEC_RELA_DATA].entsize = sizeof(ElfRela);
+  shdrs[SEC_SHSTRTAB].type = SHT_STRTAB;
+  shdrs[SEC_SHSTRTAB].addralign = 1;
+  shdrs[SEC_NOTE_GNU_STACK].type = SHT_PROGBITS;
+  shdrs[SEC_NOTE_GNU_STACK].addralign = 1;
+
+  // ファイルの中身を出力する順(.bssと.note.GNU-stackは中身がない)
+  int order[] = {SEC_TEXT, SEC_DATA, SEC_SYMTAB, SEC_STRTAB, SEC_RELA_TEXT, SEC_RELA_DATA, SEC_SHSTRTAB};
+  char *contents[NUM_SECTIONS] = {};
+  contents[SEC_TEXT] = text->buf;
+  shdrs[SEC_TEXT].size = text->len;
+  contents[SEC_DATA] = data->buf;
+  shdrs[SEC_DATA].size = data->len;
+  contents[SEC_SYMTAB] = (char *) st.syms;
+  shdrs[SEC_SYMTAB].size = sizeof(ElfSymbol) * st.nsyms;
+  contents[SEC_STRTAB] = st.strtab->buf;
+  shdrs[SEC_STRTAB].size = st.strtab->len;
+  contents[SEC_RELA_TEXT] = rela_text->buf;
+  shdrs[SEC_RELA_TEXT].size = rela_text->len;
+  contents[SEC_RELA_DATA] = rela_data->buf;
+  shdrs[SEC_RELA_DATA].size = rela_data->len;
+  contents[SEC_SHSTRTAB] = shstrtab->buf;
+  shdrs[SEC_SHSTRTAB].size = shstrtab->len;
+
+  long pos = sizeof(ElfHeader);
+  for (int i = 0; i < sizeof(order) / sizeof(int); i++) {
+    ElfSection *sh = &shdrs[order[i]];
+    pos = align_to(pos, sh->addralign);
+    sh->offset = pos;
+    pos += sh->size;
+  }
+  long shoff = align_to(pos, 8);
+
+  ElfHeader eh = {};
+  memcpy(eh.ident, "\177ELF", 4);
+  eh.ident[4] = 2; // 64ビット
+  eh.ident[5] = 1; // リトルエンディアン
+  eh.ident[6] = 1; // ELFのバージョン
+  eh.type = ET_REL;
+  eh.machine = EM_X86_64;
+  eh.version = 1;
+  eh.shoff = shoff;
+  eh.ehsize = sizeof(ElfHeader);
+  eh.shentsize = sizeof(ElfSection);
+  eh.shnum = NUM_SECTIONS;
+  eh.shstrndx = SEC_SHSTRTAB;
+
+  emitn((char *) &eh, sizeof(eh));
+  pos = sizeof(eh);
+  for (int i = 0; i < sizeof(order) / sizeof(int); i++) {
+    ElfSection *sh = &shdrs[order[i]];
+    emit_zeros(sh->offset - pos);
+    emitn(contents[order[i]], sh->size);
+    pos = sh->offset + sh->size;
+  }
+  emit_zeros(shoff - pos);
+  emitn((char *) shdrs, sizeof(shdrs));
+}
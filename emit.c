@@ -0,0 +1,296 @@
+//
+// アセンブリの出力
+//
+// コード生成はすべてemits()/emit_num()/emitf()で、このスレッドの出力先(Output)のバッファに追記する
+// printfのように1行ごとに書式を解釈してストリームをロックすることはせず、
+// 文字列はそのままコピーし、整数は自前で10進数に変換する
+//
+// 出力先は2種類ある
+//   ファイルの出力先  バッファ(OUTPUT_BUF_SIZE)がいっぱいになるたびに、まとめてwrite()で書き出す
+//   メモリの出力先    書き出さずにバッファを伸ばしていく。関数ごとに別々のスレッドでコードを生成し、
+//                     それぞれのバッファに書いておいて、後でappend_output()で順に繋げる
+// -cで機械語を出力する時は、メモリの出力先にシンボルと再配置も記録する(encode.c、elf.c)
+// 出力先はスレッドごとに切り替えられ、切り替えていなければ最終的な出力ファイル(-o、なければ標準出力)に書く
+//
+
+#include "dcc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+  OUTPUT_BUF_SIZE = 1 << 20,
+  MEM_OUTPUT_INIT_SIZE = 4096,
+};
+
+// 最終的な出力先
+static Output main_output = {NULL, 0, 0, 1};
+
+// このスレッドの出力先。NULLならmain_output
+static __thread Output *out;
+
+// -oの出力ファイルの名前と、書き終えるまで代わりに書いておく一時ファイルの名前
+static char *output_path;
+static char *tmp_output_path;
+
+// エラーで終了した時に、書きかけの一時ファイルを消す
+static void remove_tmp_output(void) {
+  if (tmp_output_path)
+    unlink(tmp_output_path);
+}
+
+// 出力ファイルを開く。pathがNULLなら標準出力に書く
+// エラーで終了した時に空や書きかけのファイルを残さないように、同じディレクトリの一時ファイルに書いておき、
+// close_output()で出力ファイルの名前に変える
+// /dev/nullのような通常のファイルでないものには、そのまま書く
+void open_output(char *path) {
+  if (!path)
+    return;
+
+  struct stat st;
+  if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd < 0)
+      error("%s を開けません: %s", path, strerror(errno));
+    main_output.fd = fd;
+    return;
+  }
+
+  char *tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    error("%s を開けません: %s", path, strerror(errno));
+  output_path = path;
+  tmp_output_path = tmp;
+  atexit(remove_tmp_output);
+
+  // mkstempは自分だけが読み書きできるファイルを作るので、openで作った時と同じ権限にする
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0644 & ~mask);
+  main_output.fd = fd;
+}
+
+// 最終的な出力先にたまった分を書き出して閉じる
+// -oで一時ファイルに書いていたら、出力ファイルの名前に変える
+void close_output(void) {
+  flush_output(NULL);
+  if (!tmp_output_path)
+    return;
+  if (close(main_output.fd) < 0 || rename(tmp_output_path, output_path) < 0)
+    error("%s に書き出せません: %s", output_path, strerror(errno));
+  tmp_output_path = NULL;
+}
+
+// ファイル記述子fdに書き出すファイルの出力先を作る
+Output *new_file_output(int fd) {
+  Output *o = calloc(1, sizeof(Output));
+  o->fd = fd;
+  return o;
+}
+
+// メモリの出力先を作る
+Output *new_output(void) {
+  Output *o = calloc(1, sizeof(Output));
+  o->fd = -1;
+  return o;
+}
+
+void free_output(Output *o) {
+  free(o->buf);
+  free(o->syms);
+  free(o->relocs);
+  free(o);
+}
+
+// このスレッドの出力先をoにする。NULLなら最終的な出力先に戻す
+void set_output(Output *o) {
+  out = o;
+}
+
+static void write_all(int fd, char *p, long len) {
+  while (len > 0) {
+    long n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error("出力を書き込めません: %s", strerror(errno));
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// ファイルの出力先oのバッファにたまった分を書き出す
+static void flush(Output *o) {
+  write_all(o->fd, o->buf, o->len);
+  o->len = 0;
+}
+
+// 出力先oにlenバイトを追記する
+static void append(Output *o, char *p, long len) {
+  if (len == 0)
+    return;
+  if (o->len + len > o->cap) {
+    if (o->fd >= 0) {
+      if (!o->buf) {
+        o->buf = malloc(OUTPUT_BUF_SIZE);
+        o->cap = OUTPUT_BUF_SIZE;
+      }
+      flush(o);
+      // バッファより大きいものは直接書き出す
+      if (len > o->cap) {
+        write_all(o->fd, p, len);
+        return;
+      }
+    } else {
+      long cap = o->cap ? o->cap : MEM_OUTPUT_INIT_SIZE;
+      while (o->len + len > cap)
+        cap *= 2;
+      o->buf = realloc(o->buf, cap);
+      o->cap = cap;
+    }
+  }
+  memcpy(o->buf + o->len, p, len);
+  o->len += len;
+}
+
+static Output *cur_output(void) {
+  return out ? out : &main_output;
+}
+
+// 文字列sをそのまま出力する
+void emits(char *s) {
+  append(cur_output(), s, strlen(s));
+}
+
+// pからlenバイトをそのまま出力する
+void emitn(char *p, long len) {
+  append(cur_output(), p, len);
+}
+
+// 整数valを10進数で出力する
+void emit_num(long val) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  // 負の数は絶対値が表せないことがあるので、負のまま1桁ずつ取り出す
+  bool neg = val < 0;
+  if (!neg)
+    val = -val;
+  do {
+    *--p = '0' - val % 10;
+    val /= 10;
+  } while (val);
+  if (neg)
+    *--p = '-';
+  append(cur_output(), p, buf + sizeof(buf) - p);
+}
+
+// printfと同じ書式で出力する
+// 頻繁に呼ばれるところではemits()とemit_num()を使う
+void emitf(char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len < (int) sizeof(buf)) {
+    append(cur_output(), buf, len);
+    return;
+  }
+
+  char *p = malloc(len + 1);
+  va_start(ap, fmt);
+  vsnprintf(p, len + 1, fmt, ap);
+  va_end(ap);
+  append(cur_output(), p, len);
+  free(p);
+}
+
+static void add_symbol(Output *o, char *name, long offset, bool is_global) {
+  if (o->nsyms == o->syms_cap) {
+    o->syms_cap = o->syms_cap ? o->syms_cap * 2 : 16;
+    o->syms = realloc(o->syms, sizeof(ObjSymbol) * o->syms_cap);
+  }
+  ObjSymbol *s = &o->syms[o->nsyms++];
+  s->name = name;
+  s->offset = offset;
+  s->is_global = is_global;
+}
+
+static void add_reloc(Output *o, long offset, RelocType type, char *sym, long addend) {
+  if (o->nrelocs == o->relocs_cap) {
+    o->relocs_cap = o->relocs_cap ? o->relocs_cap * 2 : 16;
+    o->relocs = realloc(o->relocs, sizeof(ObjReloc) * o->relocs_cap);
+  }
+  ObjReloc *r = &o->relocs[o->nrelocs++];
+  r->offset = offset;
+  r->type = type;
+  r->sym = sym;
+  r->addend = addend;
+}
+
+// 出力先の今の位置にシンボルnameを置く
+void emit_symbol(char *name, bool is_global) {
+  Output *o = cur_output();
+  add_symbol(o, name, o->len, is_global);
+}
+
+// 出力先の今の位置から、シンボルsymへの再配置を記録する
+void emit_reloc(RelocType type, char *sym, long addend) {
+  Output *o = cur_output();
+  add_reloc(o, o->len, type, sym, addend);
+}
+
+// メモリの出力先oの内容を、このスレッドの出力先に追記する
+// シンボルと再配置も、追記した位置に合わせてずらして移す
+void append_output(Output *o) {
+  Output *dst = cur_output();
+  long base = dst->len;
+  append(dst, o->buf, o->len);
+  for (int i = 0; i < o->nsyms; i++) {
+    ObjSymbol *s = &o->syms[i];
+    add_symbol(dst, s->name, base + s->offset, s->is_global);
+  }
+  for (int i = 0; i < o->nrelocs; i++) {
+    ObjReloc *r = &o->relocs[i];
+    add_reloc(dst, base + r->offset, r->type, r->sym, r->addend);
+  }
+}
+
+// ファイルの出力先oのバッファにたまった分を書き出す。NULLなら最終的な出力先
+void flush_output(Output *o) {
+  if (!o)
+    o = &main_output;
+  if (o->len)
+    flush(o);
+}
+
+// 覗き穴最適化の規則ごとに当てはまった回数の合計
+// 関数ごとに数えたものを、コード生成スレッドからロックを取って足す
+static pthread_mutex_t peephole_lock = PTHREAD_MUTEX_INITIALIZER;
+static long peephole_hits[NUM_PEEP_RULES];
+static long peephole_funcs;
+
+void add_peephole_hits(long *hits) {
+  pthread_mutex_lock(&peephole_lock);
+  for (int i = 0; i < NUM_PEEP_RULES; i++)
+    peephole_hits[i] += hits[i];
+  peephole_funcs++;
+  pthread_mutex_unlock(&peephole_lock);
+}
+
+// 環境変数 DCC_PEEPHOLE_STATS が設定されていれば、規則ごとに当てはまった回数を標準エラー出力に表示する
+// DCC_PARSE_PROCSでコードを生成したプロセスは、それぞれ自分の分を表示する
+void print_peephole_stats(void) {
+  if (!getenv("DCC_PEEPHOLE_STATS") || !peephole_funcs)
+    return;
+
+  fprintf(stderr, "%-12s %10s  (%ld functions)\n", "rule", "hits", peephole_funcs);
+  for (int i = 0; i < NUM_PEEP_RULES; i++)
+    fprintf(stderr, "%-12s %10ld\n", peephole_rule_name(i), peephole_hits[i]);
+}
@@ -0,0 +1,320 @@
+//
+// x86-64の機械語への変換
+//
+// -cでオブジェクトファイルを作る時は、関数1つ分の命令列(AsmFunc)をアセンブリにせず、ここで直接機械語にする
+// 機械語はこのスレッドの出力先に書き、関数の名前のシンボルと、呼び出す関数・グローバル変数への再配置を記録する
+// (オブジェクトファイルにまとめるのはelf.c)
+//
+// ジャンプは飛び先までの距離が1バイトに収まれば短い形、収まらなければ4バイトの長い形にする
+// 最初はすべて短い形で置き、届かないものを長い形に変えていく
+// 長くしたジャンプの分だけ他のジャンプの飛び先も遠くなるので、変わらなくなるまで繰り返す
+//
+
+#include "dcc.h"
+
+// 命令1つ分の機械語
+typedef struct {
+  unsigned char buf[16];
+  int len;
+  int offset;     // 関数の先頭からの位置
+  int reloc_pos;  // 再配置するところの命令の中での位置。再配置がなければ-1
+  int reloc_type;
+  char *sym;
+} Code;
+
+// CondCodeの順の、条件のコード(jccとsetccのオペコードの下位4ビット)
+static int cc_codes[] = {0x4, 0x5, 0xc, 0xd, 0xe, 0xf};
+
+static void byte(Code *c, int val) {
+  c->buf[c->len++] = val;
+}
+
+// 値valの下位sizeバイトをリトルエンディアンで書く
+static void imm(Code *c, long val, int size) {
+  for (int i = 0; i < size; i++)
+    byte(c, (val >> (i * 8)) & 0xff);
+}
+
+static bool is_imm8(long val) {
+  return -128 <= val && val <= 127;
+}
+
+// プレフィックス、オペコード、ModR/M(とSIB、ディスプレースメント)を書く
+// sizeはオペランドの大きさで、2ならオペランドサイズプレフィックス(0x66)、8ならREX.Wを付ける
+// opcが0xffより大きければ2バイトのオペコード(0x0F xx)
+// regはModR/Mのregフィールドに入れるレジスタ、またはオペコードを拡張する数(/n)
+// byte_regがtrueなら1バイトのレジスタを使う命令で、spl/bpl/sil/dilを表すためにREXを付ける
+static void encode_rm(Code *c, int size, int opc, int reg, Operand *rm, bool byte_reg) {
+  if (size == 2)
+    byte(c, 0x66);
+
+  int rex = 0;
+  if (size == 8)
+    rex |= 0x48;
+  if (reg & 8)
+    rex |= 0x44;
+  if (rm->kind != OPD_GOT && (rm->reg & 8))
+    rex |= 0x41;
+  if (byte_reg && (reg >= 4 || (rm->kind == OPD_REG && rm->reg >= 4)))
+    rex |= 0x40;
+  if (rex)
+    byte(c, rex);
+
+  if (opc > 0xff)
+    byte(c, 0x0f);
+  byte(c, opc & 0xff);
+
+  int r = (reg & 7) << 3;
+  if (rm->kind == OPD_REG) {
+    byte(c, 0xc0 | r | (rm->reg & 7));
+    return;
+  }
+
+  if (rm->kind == OPD_GOT) {
+    // RIP相対: [rip + disp32]。disp32はGOTのエントリへの再配置で埋める
+    byte(c, 0x05 | r);
+    c->reloc_pos = c->len;
+    c->reloc_type = R_X86_64_REX_GOTPCRELX;
+    c->sym = rm->sym;
+    imm(c, 0, 4);
+    return;
+  }
+
+  // [base + disp]
+  // RBPとR13はディスプレースメントなしでは表せない(RIP相対になる)ので、0でもdisp8を付ける
+  // RSPとR12はSIBが要る
+  int base = rm->reg & 7;
+  long disp = rm->val;
+  int mod = 0x80;
+  if (disp == 0 && base != REG_RBP)
+    mod = 0;
+  else if (is_imm8(disp))
+    mod = 0x40;
+  byte(c, mod | r | base);
+  if (base == REG_RSP)
+    byte(c, 0x24);
+  if (mod == 0x40)
+    imm(c, disp, 1);
+  else if (mod == 0x80)
+    imm(c, disp, 4);
+}
+
+// add/or/and/sub/xor/cmp。nはその演算を表す数(/n)
+static void encode_alu(Code *c, AsmInst *inst, int n) {
+  Operand *dst = &inst->dst;
+  Operand *src = &inst->src;
+  int size = dst->size;
+
+  if (src->kind == OPD_IMM) {
+    if (size == 1) {
+      encode_rm(c, size, 0x80, n, dst, true);
+      imm(c, src->val, 1);
+    } else if (is_imm8(src->val)) {
+      encode_rm(c, size, 0x83, n, dst, false);
+      imm(c, src->val, 1);
+    } else {
+      encode_rm(c, size, 0x81, n, dst, false);
+      imm(c, src->val, size == 2 ? 2 : 4);
+    }
+    return;
+  }
+
+  int w = size == 1 ? 0 : 1;
+  if (src->kind == OPD_REG)
+    encode_rm(c, size, n * 8 + w, src->reg, dst, size == 1);
+  else
+    encode_rm(c, size, n * 8 + 2 + w, dst->reg, src, size == 1);
+}
+
+static void encode_mov(Code *c, AsmInst *inst) {
+  Operand *dst = &inst->dst;
+  Operand *src = &inst->src;
+  int size = dst->size;
+  int w = size == 1 ? 0 : 1;
+
+  if (src->kind == OPD_IMM) {
+    // 8バイトのレジスタやメモリには、4バイトの即値を符号拡張して入れる
+    encode_rm(c, size, 0xc6 + w, 0, dst, size == 1);
+    imm(c, src->val, size < 4 ? size : 4);
+    return;
+  }
+  if (src->kind == OPD_REG)
+    encode_rm(c, size, 0x88 + w, src->reg, dst, size == 1);
+  else
+    encode_rm(c, size, 0x8a + w, dst->reg, src, size == 1);
+}
+
+// 1バイトのレジスタ1つで表せる命令(push/pop)
+static void encode_push_pop(Code *c, int opc, int reg) {
+  if (reg & 8)
+    byte(c, 0x41);
+  byte(c, opc + (reg & 7));
+}
+
+// ジャンプ以外の命令を機械語にする
+static void encode_inst(Code *c, AsmInst *inst) {
+  Operand *dst = &inst->dst;
+  Operand *src = &inst->src;
+
+  switch (inst->op) {
+    case ASM_LABEL:
+      return;
+    case ASM_MOV:
+      encode_mov(c, inst);
+      return;
+    case ASM_MOVABS:
+      byte(c, 0x48 | (dst->reg >> 3));
+      byte(c, 0xb8 + (dst->reg & 7));
+      imm(c, src->val, 8);
+      return;
+    case ASM_MOVSX:
+      encode_rm(c, dst->size, src->size == 1 ? 0xfbe : 0xfbf, dst->reg, src, src->size == 1);
+      return;
+    case ASM_MOVSXD:
+      encode_rm(c, dst->size, 0x63, dst->reg, src, false);
+      return;
+    case ASM_MOVZX:
+      encode_rm(c, dst->size, src->size == 1 ? 0xfb6 : 0xfb7, dst->reg, src, src->size == 1);
+      return;
+    case ASM_LEA:
+      encode_rm(c, 8, 0x8d, dst->reg, src, false);
+      return;
+    case ASM_ADD:
+      encode_alu(c, inst, 0);
+      return;
+    case ASM_OR:
+      encode_alu(c, inst, 1);
+      return;
+    case ASM_AND:
+      encode_alu(c, inst, 4);
+      return;
+    case ASM_SUB:
+      encode_alu(c, inst, 5);
+      return;
+    case ASM_XOR:
+      encode_alu(c, inst, 6);
+      return;
+    case ASM_CMP:
+      encode_alu(c, inst, 7);
+      return;
+    case ASM_TEST:
+      encode_rm(c, dst->size, dst->size == 1 ? 0x84 : 0x85, src->reg, dst, dst->size == 1);
+      return;
+    case ASM_IMUL:
+      encode_rm(c, dst->size, 0xfaf, dst->reg, src, false);
+      return;
+    case ASM_NOT:
+      encode_rm(c, dst->size, 0xf7, 2, dst, false);
+      return;
+    case ASM_SHL:
+    case ASM_SAR: {
+      // シフト量はCL
+      int n = inst->op == ASM_SHL ? 4 : 7;
+      encode_rm(c, dst->size, 0xd3, n, dst, false);
+      return;
+    }
+    case ASM_CQO:
+      byte(c, 0x48);
+      byte(c, 0x99);
+      return;
+    case ASM_IDIV:
+      encode_rm(c, src->size, 0xf7, 7, src, false);
+      return;
+    case ASM_SETCC:
+      encode_rm(c, 1, 0xf90 + cc_codes[inst->cc], 0, dst, true);
+      return;
+    case ASM_CALL:
+      byte(c, 0xe8);
+      c->reloc_pos = c->len;
+      c->reloc_type = R_X86_64_PLT32;
+      c->sym = inst->sym;
+      imm(c, 0, 4);
+      return;
+    case ASM_PUSH:
+      encode_push_pop(c, 0x50, src->reg);
+      return;
+    case ASM_POP:
+      encode_push_pop(c, 0x58, dst->reg);
+      return;
+    case ASM_RET:
+      byte(c, 0xc3);
+      return;
+    default:
+      error("機械語にできない命令です");
+  }
+}
+
+// 飛び先までの距離dispのジャンプを書く。長さ(2なら短い形)はc->lenで決めてある
+static void encode_jump(Code *c, AsmInst *inst, int disp) {
+  int len = c->len;
+  c->len = 0;
+  if (len == 2) {
+    byte(c, inst->op == ASM_JMP ? 0xeb : 0x70 + cc_codes[inst->cc]);
+    imm(c, disp, 1);
+    return;
+  }
+  if (inst->op == ASM_JMP) {
+    byte(c, 0xe9);
+  } else {
+    byte(c, 0x0f);
+    byte(c, 0x80 + cc_codes[inst->cc]);
+  }
+  imm(c, disp, 4);
+}
+
+// 関数nameの命令列afを機械語にして、このスレッドの出力先に書く
+void encode_function(AsmFunc *af, char *name, bool is_static) {
+  int n = af->ninsts;
+  Code *codes = arena_alloc(af->arena, sizeof(Code) * n);
+  int *label_pos = arena_alloc(af->arena, sizeof(int) * af->nlabels);
+
+  for (int i = 0; i < n; i++) {
+    AsmInst *inst = af->insts[i];
+    Code *c = &codes[i];
+    c->reloc_pos = -1;
+    if (inst->op == ASM_JMP || inst->op == ASM_JCC)
+      c->len = 2;
+    else
+      encode_inst(c, inst);
+  }
+
+  // ジャンプの長さを決める
+  for (bool changed = true; changed;) {
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+      codes[i].offset = pos;
+      if (af->insts[i]->op == ASM_LABEL)
+        label_pos[af->insts[i]->label] = pos;
+      pos += codes[i].len;
+    }
+
+    changed = false;
+    for (int i = 0; i < n; i++) {
+      AsmInst *inst = af->insts[i];
+      Code *c = &codes[i];
+      if ((inst->op != ASM_JMP && inst->op != ASM_JCC) || c->len != 2)
+        continue;
+      if (is_imm8(label_pos[inst->label] - (c->offset + 2)))
+        continue;
+      c->len = inst->op == ASM_JMP ? 5 : 6;
+      changed = true;
+    }
+  }
+
+  emit_symbol(name, !is_static);
+  for (int i = 0; i < n; i++) {
+    AsmInst *inst = af->insts[i];
+    Code *c = &codes[i];
+    if (inst->op == ASM_JMP || inst->op == ASM_JCC)
+      encode_jump(c, inst, label_pos[inst->label] - (c->offset + c->len));
+
+    if (c->reloc_pos < 0) {
+      emitn((char *) c->buf, c->len);
+      continue;
+    }
+    // RIP相対の値は次の命令の先頭からの距離なので、再配置するところから命令の終わりまでの分を引く
+    emitn((char *) c->buf, c->reloc_pos);
+    emit_reloc(c->reloc_type, c->sym, c->reloc_pos - c->len);
+    emitn((char *) c->buf + c->reloc_pos, c->len - c->reloc_pos);
+  }
+}
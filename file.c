@@ -0,0 +1,90 @@
+//
+// ソースファイルの読み込み
+//
+// 通常のファイルはmmapでそのままメモリに割り当てて、コピーせずに使う
+// パイプ(test.shの`<(echo ...)`など)はmmapできないので、少しずつ読み込む
+//
+// どちらの場合も、返すバッファは必ず"\n\0"で終わる
+//
+
+#include "dcc.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ファイルをmmapする
+// ファイルの後ろに"\n\0"を置けるように、あらかじめ匿名ページで少し大きめに領域を確保し、
+// その先頭にファイルを重ねて割り当てる
+// ファイルの最後のページの余りと匿名ページはどちらも0で埋められているので、'\0'は書き込まなくてもよい
+// ファイルが'\n'で終わっていない場合だけ、末尾のページに'\n'を書き込む(そのページだけがコピーされる)
+static char *map_file(char *path, int fd, long size) {
+  if (size == 0) {
+    char *buf = calloc(1, 2);
+    buf[0] = '\n';
+    return buf;
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  long len = (size + 2 + page - 1) / page * page;
+
+  char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    error("%s: mmapに失敗しました: %s", path, strerror(errno));
+
+  if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    error("%s: mmapに失敗しました: %s", path, strerror(errno));
+
+  if (buf[size - 1] != '\n')
+    buf[size] = '\n';
+  return buf;
+}
+
+// パイプなどサイズの分からない入力を最後まで読み込む
+static char *read_stream(char *path, FILE *fp) {
+  long cap = 4096;
+  long size = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    // "\n\0"の分(2バイト)を残しておく
+    if (cap - size < 2 + 4096) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    long n = fread(buf + size, 1, cap - size - 2, fp);
+    size += n;
+    if (n == 0) {
+      if (ferror(fp))
+        error("%s: 読み込みに失敗しました: %s", path, strerror(errno));
+      break;
+    }
+  }
+
+  // ファイルが必ず"\n\0"で終わるようにする
+  if (size == 0 || buf[size - 1] != '\n')
+    buf[size++] = '\n';
+  buf[size] = '\0';
+  return buf;
+}
+
+// pathの内容を"\n\0"で終わるバッファとして返す
+char *read_file(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("%s を開けません", path);
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) {
+    char *buf = map_file(path, fileno(fp), st.st_size);
+    // mmapした領域はファイルを閉じても有効
+    fclose(fp);
+    return buf;
+  }
+
+  char *buf = read_stream(path, fp);
+  fclose(fp);
+  return buf;
+}
@@ -0,0 +1,1448 @@
+//
+// 中間表現(IR)
+//
+// 関数本体のASTを、基本ブロックに分けた3番地形式の命令列に変換する
+// 命令の結果(値)はそれぞれ一度だけ定義されるSSA形式で、合流点ではφ命令で値を選ぶ
+// 値はすべて64ビットの整数で、メモリの読み書きと符号拡張の命令だけがバイト数を持つ
+//
+// アドレスを取られないスカラー型のローカル変数は、メモリに置かずにSSAの値に昇格する
+// ただしローカル変数のアドレスを取る関数では、どの変数も昇格しない
+// SSA形式は Braun et al. "Simple and Efficient Construction of Static Single Assignment Form" の方法で、
+// ASTを変換しながら直接作る。ブロックの先行ブロックがすべて分かったら、そのブロックを封じる(seal)
+// 封じる前のブロックで変数を読んだ場合は、とりあえず中身の空のφ命令を置いておき、封じた時に埋める
+// 変換し終えたら、到達できないブロックと、同じ値しか選ばないφ命令を取り除く
+//
+// IRはコード生成スレッドで作るので、グローバル変数は使わずに、すべて関数の領域(fn->arena)に確保する
+//
+
+#include "dcc.h"
+
+// gotoで飛ぶ先のラベル
+typedef struct IrLabel IrLabel;
+struct IrLabel {
+  IrLabel *next;
+  char *name;
+  IrBlock *block;
+};
+
+// 関数1つ分のIRへの変換の状態
+typedef struct {
+  IrFunc *ir;
+  Arena *arena;
+  IrBlock *cur; // 命令を追加しているブロック。ジャンプの直後(到達できない位置)ではNULL
+  IrBlock *brk; // breakで飛ぶ先
+  IrBlock *cont; // continueで飛ぶ先
+  IrLabel *labels;
+  IrInst *undef; // 代入する前に読んだ変数の値(0)
+  int nvars; // SSAの値に昇格したローカル変数の個数
+  int nblocks; // 作ったブロックの個数
+  IrBlock **blocks; // 作ったブロック(blocks[id - 1])
+  int blocks_cap;
+} IrGen;
+
+static IrInst *gen_expr(IrGen *g, Node *node);
+
+static void gen_stmt(IrGen *g, Node *node);
+
+static IrInst *read_var(IrGen *g, int idx, IrBlock *block);
+
+// インターンされた "__builtin_va_start"
+static char *builtin_va_start;
+
+// IRへの変換の準備をする
+// gen_irはコード生成スレッドから呼ばれるので、名前のインターンはメインスレッドで済ませておく
+void init_ir(void) {
+  builtin_va_start = intern("__builtin_va_start", 18);
+}
+
+//
+// ブロックと命令
+//
+
+// 要素数capの配列arrを、要素数new_capに広げたものを返す
+static void *grow_array(Arena *arena, void *arr, int cap, int new_cap, int elem_size) {
+  void *p = arena_alloc(arena, (long) elem_size * new_cap);
+  if (cap)
+    memcpy(p, arr, (long) elem_size * cap);
+  return p;
+}
+
+static IrBlock *new_block(IrGen *g) {
+  IrBlock *b = arena_alloc(g->arena, sizeof(IrBlock));
+  if (g->nblocks == g->blocks_cap) {
+    int cap = g->blocks_cap ? g->blocks_cap * 2 : 16;
+    g->blocks = grow_array(g->arena, g->blocks, g->blocks_cap, cap, sizeof(IrBlock *));
+    g->blocks_cap = cap;
+  }
+  g->blocks[g->nblocks++] = b;
+  b->id = g->nblocks;
+  return b;
+}
+
+static void add_pred(IrGen *g, IrBlock *b, IrBlock *pred) {
+  if (b->npreds == b->preds_cap) {
+    int cap = b->preds_cap ? b->preds_cap * 2 : 2;
+    b->preds = grow_array(g->arena, b->preds, b->preds_cap, cap, sizeof(IrBlock *));
+    b->preds_cap = cap;
+  }
+  b->preds[b->npreds++] = pred;
+}
+
+// ブロックを関数の配置順の最後に加える
+static void place_block(IrGen *g, IrBlock *b) {
+  IrFunc *ir = g->ir;
+  if (ir->nblocks == ir->blocks_cap) {
+    int cap = ir->blocks_cap ? ir->blocks_cap * 2 : 16;
+    ir->blocks = grow_array(g->arena, ir->blocks, ir->blocks_cap, cap, sizeof(IrBlock *));
+    ir->blocks_cap = cap;
+  }
+  ir->blocks[ir->nblocks++] = b;
+  b->placed = true;
+}
+
+static IrInst *new_inst(IrGen *g, IrOp op, int nargs) {
+  IrInst *inst = arena_alloc(g->arena, sizeof(IrInst));
+  inst->op = op;
+  inst->nargs = nargs;
+  if (nargs)
+    inst->args = arena_alloc(g->arena, sizeof(IrInst *) * nargs);
+  return inst;
+}
+
+// 値を作る命令ならtrue
+bool ir_has_value(IrInst *inst) {
+  switch (inst->op) {
+    case IR_STORE:
+    case IR_VA_START:
+    case IR_JMP:
+    case IR_BR:
+    case IR_RET:
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool ir_is_terminator(IrInst *inst) {
+  return inst->op == IR_JMP || inst->op == IR_BR || inst->op == IR_RET;
+}
+
+// 命令を追加しているブロックを返す
+// ジャンプの直後なら、どこからも到達できない新しいブロックを作る
+static IrBlock *cur_block(IrGen *g) {
+  if (!g->cur) {
+    g->cur = new_block(g);
+    g->cur->sealed = true;
+    place_block(g, g->cur);
+  }
+  return g->cur;
+}
+
+// 命令を現在のブロックの最後に加える
+static IrInst *emit(IrGen *g, IrInst *inst) {
+  IrBlock *b = cur_block(g);
+  inst->block = b;
+  if (b->last)
+    b->last->next = inst;
+  else
+    b->insts = inst;
+  b->last = inst;
+
+  if (ir_has_value(inst))
+    inst->id = ++g->ir->nvals;
+  return inst;
+}
+
+static IrInst *ir_const(IrGen *g, long val) {
+  IrInst *inst = new_inst(g, IR_CONST, 0);
+  inst->val = val;
+  return emit(g, inst);
+}
+
+static IrInst *ir_binary(IrGen *g, IrOp op, IrInst *lhs, IrInst *rhs) {
+  IrInst *inst = new_inst(g, op, 2);
+  inst->args[0] = lhs;
+  inst->args[1] = rhs;
+  return emit(g, inst);
+}
+
+static IrInst *ir_unary(IrGen *g, IrOp op, IrInst *arg, int size) {
+  IrInst *inst = new_inst(g, op, 1);
+  inst->args[0] = arg;
+  inst->size = size;
+  return emit(g, inst);
+}
+
+static IrInst *ir_store(IrGen *g, IrInst *addr, IrInst *val, int size) {
+  IrInst *inst = new_inst(g, IR_STORE, 2);
+  inst->args[0] = addr;
+  inst->args[1] = val;
+  inst->size = size;
+  return emit(g, inst);
+}
+
+// 現在のブロックを終える
+static void terminate(IrGen *g, IrInst *inst) {
+  emit(g, inst);
+  g->cur = NULL;
+}
+
+static void ir_jmp(IrGen *g, IrBlock *to) {
+  IrInst *inst = new_inst(g, IR_JMP, 0);
+  terminate(g, inst);
+  IrBlock *b = inst->block;
+  b->succs[b->nsuccs++] = to;
+  add_pred(g, to, b);
+}
+
+static void ir_br(IrGen *g, IrInst *cond, IrBlock *then, IrBlock *els) {
+  IrInst *inst = new_inst(g, IR_BR, 1);
+  inst->args[0] = cond;
+  terminate(g, inst);
+  IrBlock *b = inst->block;
+  b->succs[b->nsuccs++] = then;
+  b->succs[b->nsuccs++] = els;
+  add_pred(g, then, b);
+  add_pred(g, els, b);
+}
+
+// ブロックbで命令の追加を続ける
+// 現在のブロックが終わっていなければ、bへのジャンプで終える
+static void enter_block(IrGen *g, IrBlock *b) {
+  if (g->cur)
+    ir_jmp(g, b);
+  g->cur = b;
+  place_block(g, b);
+}
+
+//
+// SSA形式の構築
+//
+
+static IrInst **block_defs(IrGen *g, IrBlock *b) {
+  if (!b->defs)
+    b->defs = arena_alloc(g->arena, sizeof(IrInst *) * g->nvars);
+  return b->defs;
+}
+
+static void write_var(IrGen *g, int idx, IrBlock *b, IrInst *val) {
+  block_defs(g, b)[idx] = val;
+}
+
+// ブロックbの先頭に、変数idxの値を選ぶφ命令を置く(引数はまだ空)
+static IrInst *new_phi(IrGen *g, int idx, IrBlock *b) {
+  IrInst *phi = new_inst(g, IR_PHI, 0);
+  phi->val = idx;
+  phi->block = b;
+  phi->id = ++g->ir->nvals;
+  phi->next = b->phis;
+  b->phis = phi;
+  return phi;
+}
+
+// φ命令の引数を、先行ブロックの終わりでの変数の値で埋める
+static void add_phi_operands(IrGen *g, IrInst *phi) {
+  IrBlock *b = phi->block;
+  phi->args = arena_alloc(g->arena, sizeof(IrInst *) * b->npreds);
+  phi->nargs = b->npreds;
+  for (int i = 0; i < b->npreds; i++)
+    phi->args[i] = read_var(g, phi->val, b->preds[i]);
+}
+
+// 代入する前に読んだ変数の値
+static IrInst *undef_value(IrGen *g) {
+  if (g->undef)
+    return g->undef;
+
+  // 入口のブロックの先頭(引数の直後)に置けば、どこで使ってもその前に定義される
+  IrBlock *entry = g->ir->blocks[0];
+  IrInst *inst = new_inst(g, IR_CONST, 0);
+  inst->block = entry;
+  inst->id = ++g->ir->nvals;
+
+  IrInst *prev = NULL;
+  for (IrInst *p = entry->insts; p && p->op == IR_PARAM; p = p->next)
+    prev = p;
+  if (prev) {
+    inst->next = prev->next;
+    prev->next = inst;
+  } else {
+    inst->next = entry->insts;
+    entry->insts = inst;
+  }
+  if (entry->last == prev)
+    entry->last = inst;
+  g->undef = inst;
+  return inst;
+}
+
+static IrInst *read_var(IrGen *g, int idx, IrBlock *b) {
+  IrInst *val = block_defs(g, b)[idx];
+  if (val)
+    return val;
+
+  if (!b->sealed) {
+    // 先行ブロックがまだ揃っていないので、封じる時に埋める
+    val = new_phi(g, idx, b);
+  } else if (b->npreds == 0) {
+    val = undef_value(g);
+  } else if (b->npreds == 1) {
+    val = read_var(g, idx, b->preds[0]);
+  } else {
+    // ループで自分自身に戻ってくる場合に備えて、先に定義しておく
+    val = new_phi(g, idx, b);
+    write_var(g, idx, b, val);
+    add_phi_operands(g, val);
+  }
+  write_var(g, idx, b, val);
+  return val;
+}
+
+// ブロックbの先行ブロックがすべて揃ったので、置いておいたφ命令を埋める
+static void seal_block(IrGen *g, IrBlock *b) {
+  for (IrInst *phi = b->phis; phi; phi = phi->next)
+    add_phi_operands(g, phi);
+  b->sealed = true;
+}
+
+// 置き換えられた値を、置き換え先までたどる
+static IrInst *resolve(IrInst *val) {
+  while (val->replace)
+    val = val->replace;
+  return val;
+}
+
+//
+// ASTからの変換
+//
+
+// SSAの値に昇格する変数ならtrue
+static bool is_promoted(Node *node) {
+  return node->kind == ND_VAR && node->var->is_local && node->var->ssa_idx > 0;
+}
+
+static int var_idx(Node *node) {
+  return node->var->ssa_idx - 1;
+}
+
+// アドレスを取られているローカル変数と、複合リテラルの変数に印(-1)をつける
+static void mark_address_taken(Node *node) {
+  for (; node; node = node_at(node->next)) {
+    NodeExt *ext = node_ext(node);
+    if (node->kind == ND_ADDR) {
+      Node *lhs = node_at(node->lhs);
+      if (lhs->kind == ND_VAR && lhs->var->is_local)
+        lhs->var->ssa_idx = -1;
+    }
+    if (node->kind == ND_VAR && ext->init)
+      node->var->ssa_idx = -1;
+
+    mark_address_taken(node_at(node->lhs));
+    mark_address_taken(node_at(node->rhs));
+    mark_address_taken(node_at(ext->cond));
+    mark_address_taken(node_at(ext->then));
+    mark_address_taken(node_at(ext->els));
+    mark_address_taken(node_at(ext->init));
+    mark_address_taken(node_at(ext->inc));
+    mark_address_taken(node_at(ext->body));
+    mark_address_taken(node_at(ext->args));
+  }
+}
+
+// スカラー型でアドレスを取られていないローカル変数に、SSAの値としての番号(1から)をつける
+// それ以外の変数の番号は0で、メモリに置く
+// どれかのローカル変数のアドレスを取る関数では、ポインタの演算で隣の変数に届くので(*(&x + 1)など)、
+// どの変数も昇格せずに、すべてメモリに置く
+static void number_promoted_vars(IrGen *g, Function *fn) {
+  for (VarList *vl = fn->locals; vl; vl = vl->next)
+    vl->var->ssa_idx = 0;
+
+  mark_address_taken(node_at(fn->node));
+
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    if (vl->var->ssa_idx == -1) {
+      for (VarList *vl2 = fn->locals; vl2; vl2 = vl2->next)
+        vl2->var->ssa_idx = 0;
+      return;
+    }
+  }
+
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    TypeKind kind = var->ty->kind;
+    if (var->ssa_idx == -1 || kind == TY_ARRAY || kind == TY_STRUCT || kind == TY_FUNC) {
+      var->ssa_idx = 0;
+      continue;
+    }
+    var->ssa_idx = ++g->nvars;
+  }
+}
+
+// 値を読み込まずにアドレスのまま扱う型ならtrue
+static bool is_aggregate(Type *ty) {
+  return ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC;
+}
+
+// 0以外の値を1にする
+static IrInst *to_bool(IrGen *g, IrInst *val) {
+  return ir_binary(g, IR_NE, val, ir_const(g, 0));
+}
+
+// 型tyの変数に入れた値を読み出した時の値に変換する
+static IrInst *normalize(IrGen *g, IrInst *val, Type *ty) {
+  if (ty->kind == TY_BOOL)
+    return to_bool(g, val);
+  if (ty->size < 8)
+    return ir_unary(g, IR_SEXT, val, ty->size);
+  return val;
+}
+
+// _Bool型の変数に書く場合、0以外の値は1にする
+static IrInst *to_bool_if(IrGen *g, IrInst *val, Type *ty) {
+  if (ty->kind == TY_BOOL)
+    return to_bool(g, val);
+  return val;
+}
+
+static IrInst *load(IrGen *g, IrInst *addr, Type *ty) {
+  if (is_aggregate(ty))
+    return addr;
+  return ir_unary(g, IR_LOAD, addr, ty->size);
+}
+
+// 左辺値のアドレスを返す
+static IrInst *gen_addr(IrGen *g, Node *node) {
+  switch (node->kind) {
+    case ND_VAR: {
+      // 複合リテラルの場合
+      int init = node_ext(node)->init;
+      if (init)
+        gen_stmt(g, node_at(init));
+
+      IrInst *inst = new_inst(g, node->var->is_local ? IR_LVAR : IR_GVAR, 0);
+      inst->var = node->var;
+      return emit(g, inst);
+    }
+    case ND_DEREF:
+      return gen_expr(g, node_at(node->lhs));
+    case ND_MEMBER: {
+      IrInst *addr = gen_addr(g, node_at(node->lhs));
+      Member *mem = node_ext(node)->member;
+      if (!mem->offset)
+        return addr;
+      return ir_binary(g, IR_ADD, addr, ir_const(g, mem->offset));
+    }
+    default:
+      error("ローカル変数ではありません");
+      return NULL;
+  }
+}
+
+// ptr ± num の num に掛ける数
+static IrInst *scale(IrGen *g, IrInst *val, int size) {
+  if (size == 1)
+    return val;
+  return ir_binary(g, IR_MUL, val, ir_const(g, size));
+}
+
+// 二項演算(複合代入を含む)の値を計算する
+static IrInst *gen_binary(IrGen *g, NodeKind kind, Type *ty, IrInst *lhs, IrInst *rhs) {
+  switch (kind) {
+    case ND_ADD:
+    case ND_ADD_EQ:
+      return ir_binary(g, IR_ADD, lhs, rhs);
+    case ND_PTR_ADD:
+    case ND_PTR_ADD_EQ:
+      return ir_binary(g, IR_ADD, lhs, scale(g, rhs, ty->ptr_to->size));
+    case ND_SUB:
+    case ND_SUB_EQ:
+      return ir_binary(g, IR_SUB, lhs, rhs);
+    case ND_PTR_SUB:
+    case ND_PTR_SUB_EQ:
+      return ir_binary(g, IR_SUB, lhs, scale(g, rhs, ty->ptr_to->size));
+    case ND_PTR_DIFF: {
+      IrInst *diff = ir_binary(g, IR_SUB, lhs, rhs);
+      if (ty->ptr_to->size == 1)
+        return diff;
+      return ir_binary(g, IR_DIV, diff, ir_const(g, ty->ptr_to->size));
+    }
+    case ND_MUL:
+    case ND_MUL_EQ:
+      return ir_binary(g, IR_MUL, lhs, rhs);
+    case ND_DIV:
+    case ND_DIV_EQ:
+      return ir_binary(g, IR_DIV, lhs, rhs);
+    case ND_EQ:
+      return ir_binary(g, IR_EQ, lhs, rhs);
+    case ND_NE:
+      return ir_binary(g, IR_NE, lhs, rhs);
+    case ND_LT:
+      return ir_binary(g, IR_LT, lhs, rhs);
+    case ND_LE:
+      return ir_binary(g, IR_LE, lhs, rhs);
+    case ND_BITAND:
+    case ND_BITAND_EQ:
+      return ir_binary(g, IR_AND, lhs, rhs);
+    case ND_BITOR:
+    case ND_BITOR_EQ:
+      return ir_binary(g, IR_OR, lhs, rhs);
+    case ND_BITXOR:
+    case ND_BITXOR_EQ:
+      return ir_binary(g, IR_XOR, lhs, rhs);
+    case ND_SHL:
+    case ND_SHL_EQ:
+      return ir_binary(g, IR_SHL, lhs, rhs);
+    case ND_SHR:
+    case ND_SHR_EQ:
+      return ir_binary(g, IR_SAR, lhs, rhs);
+    default:
+      error("不正な式です");
+      return NULL;
+  }
+}
+
+// 左辺値lhsの値を読み、kindの演算でrhsと計算した値を書き戻す
+// 読んだ値と書き戻した値を、それぞれ*oldval・*newvalに入れる
+static void gen_update(IrGen *g, NodeKind kind, Node *lhs, IrInst *rhs, IrInst **oldval, IrInst **newval) {
+  Type *ty = lhs->ty;
+
+  if (is_promoted(lhs)) {
+    *oldval = read_var(g, var_idx(lhs), cur_block(g));
+    *newval = normalize(g, gen_binary(g, kind, ty, *oldval, rhs), ty);
+    write_var(g, var_idx(lhs), cur_block(g), *newval);
+    return;
+  }
+
+  IrInst *addr = gen_addr(g, lhs);
+  *oldval = load(g, addr, ty);
+  *newval = to_bool_if(g, gen_binary(g, kind, ty, *oldval, rhs), ty);
+  ir_store(g, addr, *newval, ty->size);
+}
+
+// ++/-- の増分(ポインタなら指す先の大きさ)
+static IrInst *step(IrGen *g, Type *ty) {
+  return ir_const(g, ty->ptr_to ? ty->ptr_to->size : 1);
+}
+
+// 分岐の合流点endで、先行ブロックがbならval、そうでなければotherを選ぶ値を返す
+static IrInst *merge(IrGen *g, IrBlock *end, IrBlock *b, IrInst *val, IrInst *other) {
+  // どちらの分岐からも来ない場合
+  if (!end->npreds)
+    return undef_value(g);
+
+  IrInst *phi = new_phi(g, -1, end);
+  phi->args = arena_alloc(g->arena, sizeof(IrInst *) * end->npreds);
+  phi->nargs = end->npreds;
+  for (int i = 0; i < end->npreds; i++)
+    phi->args[i] = end->preds[i] == b ? val : other;
+  return phi;
+}
+
+// &&と||は、右辺を評価するかどうかで分岐して、0か1の値を計算する
+// is_orがtrueなら||、falseなら&&
+static IrInst *gen_logical(IrGen *g, Node *node, bool is_or) {
+  IrBlock *rhs_block = new_block(g);
+  IrBlock *end = new_block(g);
+
+  IrInst *lhs = gen_expr(g, node_at(node->lhs));
+  // 右辺を評価しない場合の値
+  IrInst *skip = ir_const(g, is_or ? 1 : 0);
+  if (is_or)
+    ir_br(g, lhs, end, rhs_block);
+  else
+    ir_br(g, lhs, rhs_block, end);
+  IrBlock *lhs_end = skip->block;
+  seal_block(g, rhs_block);
+
+  enter_block(g, rhs_block);
+  IrInst *rhs = to_bool(g, gen_expr(g, node_at(node->rhs)));
+  enter_block(g, end);
+  seal_block(g, end);
+  return merge(g, end, lhs_end, skip, rhs);
+}
+
+static IrInst *gen_ternary(IrGen *g, Node *node) {
+  NodeExt *ext = node_ext(node);
+  IrBlock *then = new_block(g);
+  IrBlock *els = new_block(g);
+  IrBlock *end = new_block(g);
+
+  ir_br(g, gen_expr(g, node_at(ext->cond)), then, els);
+  seal_block(g, then);
+  seal_block(g, els);
+
+  enter_block(g, then);
+  IrInst *then_val = gen_expr(g, node_at(ext->then));
+  IrBlock *then_end = g->cur;
+  if (g->cur)
+    ir_jmp(g, end);
+  enter_block(g, els);
+  IrInst *els_val = gen_expr(g, node_at(ext->els));
+  enter_block(g, end);
+  seal_block(g, end);
+  return merge(g, end, then_end, then_val, els_val);
+}
+
+static IrInst *gen_funcall(IrGen *g, Node *node) {
+  NodeExt *ext = node_ext(node);
+  int nargs = 0;
+  for (Node *arg = node_at(ext->args); arg; arg = node_at(arg->next))
+    nargs++;
+
+  IrInst *args[6];
+  int i = 0;
+  for (Node *arg = node_at(ext->args); arg; arg = node_at(arg->next)) {
+    if (i == 6)
+      error("引数が多すぎます");
+    args[i++] = gen_expr(g, arg);
+  }
+
+  if (ext->funcname == builtin_va_start) {
+    IrInst *inst = new_inst(g, IR_VA_START, 1);
+    inst->args[0] = args[0];
+    emit(g, inst);
+    return undef_value(g);
+  }
+
+  IrInst *inst = new_inst(g, IR_CALL, nargs);
+  inst->name = ext->funcname;
+  for (int j = 0; j < nargs; j++)
+    inst->args[j] = args[j];
+  emit(g, inst);
+
+  // _Boolを返す関数の場合、戻り値はRAXの下位8bitだけが有効
+  if (node->ty->kind == TY_BOOL)
+    return ir_binary(g, IR_AND, inst, ir_const(g, 255));
+  return inst;
+}
+
+static IrInst *gen_expr(IrGen *g, Node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+      return ir_const(g, node->val);
+    case ND_VAR:
+      if (is_promoted(node))
+        return read_var(g, var_idx(node), cur_block(g));
+      return load(g, gen_addr(g, node), node->ty);
+    case ND_MEMBER:
+      return load(g, gen_addr(g, node), node->ty);
+    case ND_DEREF:
+      return load(g, gen_expr(g, node_at(node->lhs)), node->ty);
+    case ND_ADDR:
+      return gen_addr(g, node_at(node->lhs));
+    case ND_ASSIGN: {
+      Node *lhs = node_at(node->lhs);
+      if (is_promoted(lhs)) {
+        IrInst *val = normalize(g, gen_expr(g, node_at(node->rhs)), node->ty);
+        write_var(g, var_idx(lhs), cur_block(g), val);
+        return val;
+      }
+      IrInst *addr = gen_addr(g, lhs);
+      IrInst *val = to_bool_if(g, gen_expr(g, node_at(node->rhs)), node->ty);
+      ir_store(g, addr, val, node->ty->size);
+      return val;
+    }
+    case ND_CAST: {
+      IrInst *val = gen_expr(g, node_at(node->lhs));
+      if (node->ty->kind == TY_BOOL)
+        return to_bool(g, val);
+      if (node->ty->size < 8)
+        return ir_unary(g, IR_SEXT, val, node->ty->size);
+      return val;
+    }
+    case ND_ADD_EQ:
+    case ND_PTR_ADD_EQ:
+    case ND_SUB_EQ:
+    case ND_PTR_SUB_EQ:
+    case ND_MUL_EQ:
+    case ND_DIV_EQ:
+    case ND_SHL_EQ:
+    case ND_SHR_EQ:
+    case ND_BITAND_EQ:
+    case ND_BITOR_EQ:
+    case ND_BITXOR_EQ: {
+      IrInst *oldval;
+      IrInst *newval;
+      Node *lhs = node_at(node->lhs);
+      // 右辺より先に左辺のアドレスを計算する
+      if (is_promoted(lhs)) {
+        IrInst *rhs = gen_expr(g, node_at(node->rhs));
+        gen_update(g, node->kind, lhs, rhs, &oldval, &newval);
+        return newval;
+      }
+      IrInst *addr = gen_addr(g, lhs);
+      oldval = load(g, addr, lhs->ty);
+      IrInst *rhs = gen_expr(g, node_at(node->rhs));
+      newval = to_bool_if(g, gen_binary(g, node->kind, node->ty, oldval, rhs), node->ty);
+      ir_store(g, addr, newval, node->ty->size);
+      return newval;
+    }
+    case ND_PRE_INC:
+    case ND_PRE_DEC:
+    case ND_POST_INC:
+    case ND_POST_DEC: {
+      IrInst *oldval;
+      IrInst *newval;
+      bool is_inc = node->kind == ND_PRE_INC || node->kind == ND_POST_INC;
+      gen_update(g, is_inc ? ND_ADD_EQ : ND_SUB_EQ, node_at(node->lhs), step(g, node->ty), &oldval, &newval);
+      if (node->kind == ND_PRE_INC || node->kind == ND_PRE_DEC)
+        return newval;
+      return oldval;
+    }
+    case ND_COMMA:
+      // 左辺は初期化のブロックのこともある
+      gen_stmt(g, node_at(node->lhs));
+      return gen_expr(g, node_at(node->rhs));
+    case ND_NOT: {
+      IrInst *val = gen_expr(g, node_at(node->lhs));
+      return ir_binary(g, IR_EQ, val, ir_const(g, 0));
+    }
+    case ND_BIT_NOT:
+      return ir_unary(g, IR_NOT, gen_expr(g, node_at(node->lhs)), 0);
+    case ND_LOGAND:
+      return gen_logical(g, node, false);
+    case ND_LOGOR:
+      return gen_logical(g, node, true);
+    case ND_TERNARY:
+      return gen_ternary(g, node);
+    case ND_FUNCALL:
+      return gen_funcall(g, node);
+    case ND_STMT_EXPR: {
+      // 最後の式の値がstatement expressionの値になる
+      Node *n = node_at(node_ext(node)->body);
+      for (; n->next; n = node_at(n->next))
+        gen_stmt(g, n);
+      return gen_expr(g, n);
+    }
+    default: {
+      IrInst *lhs = gen_expr(g, node_at(node->lhs));
+      IrInst *rhs = gen_expr(g, node_at(node->rhs));
+      return gen_binary(g, node->kind, node->ty, lhs, rhs);
+    }
+  }
+}
+
+static IrBlock *label_block(IrGen *g, char *name) {
+  for (IrLabel *l = g->labels; l; l = l->next)
+    if (l->name == name)
+      return l->block;
+
+  IrLabel *l = arena_alloc(g->arena, sizeof(IrLabel));
+  l->name = name;
+  l->block = new_block(g);
+  l->next = g->labels;
+  g->labels = l;
+  return l->block;
+}
+
+static void gen_stmt(IrGen *g, Node *node) {
+  NodeExt *ext = node_ext(node);
+  switch (node->kind) {
+    case ND_NULL:
+      return;
+    case ND_EXPR_STMT:
+      gen_expr(g, node_at(node->lhs));
+      return;
+    case ND_RETURN: {
+      // _Boolを返す関数では、戻り値を0か1にする
+      IrInst *val = NULL;
+      if (node->lhs) {
+        val = gen_expr(g, node_at(node->lhs));
+        val = to_bool_if(g, val, g->ir->fn->return_ty);
+      }
+      IrInst *inst = new_inst(g, IR_RET, val ? 1 : 0);
+      if (val)
+        inst->args[0] = val;
+      terminate(g, inst);
+      return;
+    }
+    case ND_IF: {
+      IrBlock *then = new_block(g);
+      IrBlock *els = ext->els ? new_block(g) : NULL;
+      IrBlock *end = new_block(g);
+
+      ir_br(g, gen_expr(g, node_at(ext->cond)), then, els ? els : end);
+      seal_block(g, then);
+      enter_block(g, then);
+      gen_stmt(g, node_at(ext->then));
+      if (els) {
+        if (g->cur)
+          ir_jmp(g, end);
+        seal_block(g, els);
+        enter_block(g, els);
+        gen_stmt(g, node_at(ext->els));
+      }
+      enter_block(g, end);
+      seal_block(g, end);
+      return;
+    }
+    case ND_WHILE:
+    case ND_FOR: {
+      IrBlock *brk = g->brk;
+      IrBlock *cont = g->cont;
+      IrBlock *head = new_block(g);
+      IrBlock *body = new_block(g);
+      IrBlock *inc = new_block(g);
+      IrBlock *end = new_block(g);
+      g->brk = end;
+      g->cont = inc;
+
+      if (ext->init)
+        gen_stmt(g, node_at(ext->init));
+      enter_block(g, head);
+      if (ext->cond)
+        ir_br(g, gen_expr(g, node_at(ext->cond)), body, end);
+      seal_block(g, body);
+      enter_block(g, body);
+      gen_stmt(g, node_at(ext->then));
+
+      enter_block(g, inc);
+      seal_block(g, inc);
+      if (ext->inc)
+        gen_stmt(g, node_at(ext->inc));
+      ir_jmp(g, head);
+      seal_block(g, head);
+
+      enter_block(g, end);
+      seal_block(g, end);
+      g->brk = brk;
+      g->cont = cont;
+      return;
+    }
+    case ND_DO: {
+      IrBlock *brk = g->brk;
+      IrBlock *cont = g->cont;
+      IrBlock *body = new_block(g);
+      IrBlock *cond = new_block(g);
+      IrBlock *end = new_block(g);
+      g->brk = end;
+      g->cont = cond;
+
+      enter_block(g, body);
+      gen_stmt(g, node_at(ext->then));
+      enter_block(g, cond);
+      seal_block(g, cond);
+      ir_br(g, gen_expr(g, node_at(ext->cond)), body, end);
+      seal_block(g, body);
+
+      enter_block(g, end);
+      seal_block(g, end);
+      g->brk = brk;
+      g->cont = cont;
+      return;
+    }
+    case ND_SWITCH: {
+      IrBlock *brk = g->brk;
+      IrBlock *end = new_block(g);
+      g->brk = end;
+
+      IrInst *val = gen_expr(g, node_at(ext->cond));
+      for (Node *n = node_at(ext->case_next); n; n = node_at(node_ext(n)->case_next)) {
+        IrBlock *b = new_block(g);
+        IrBlock *next = new_block(g);
+        node_ext(n)->case_label = b->id;
+        ir_br(g, ir_binary(g, IR_EQ, val, ir_const(g, n->val)), b, next);
+        seal_block(g, next);
+        enter_block(g, next);
+      }
+      if (ext->default_case) {
+        IrBlock *b = new_block(g);
+        node_ext(node_at(ext->default_case))->case_label = b->id;
+        ir_jmp(g, b);
+      } else {
+        ir_jmp(g, end);
+      }
+
+      gen_stmt(g, node_at(ext->then));
+
+      for (Node *n = node_at(ext->case_next); n; n = node_at(node_ext(n)->case_next))
+        seal_block(g, g->blocks[node_ext(n)->case_label - 1]);
+      if (ext->default_case)
+        seal_block(g, g->blocks[node_ext(node_at(ext->default_case))->case_label - 1]);
+      enter_block(g, end);
+      seal_block(g, end);
+      g->brk = brk;
+      return;
+    }
+    case ND_CASE:
+      enter_block(g, g->blocks[ext->case_label - 1]);
+      gen_stmt(g, node_at(node->lhs));
+      return;
+    case ND_BLOCK:
+      for (Node *n = node_at(ext->body); n; n = node_at(n->next))
+        gen_stmt(g, n);
+      return;
+    case ND_BREAK:
+      if (!g->brk)
+        error("break文が無効です");
+      ir_jmp(g, g->brk);
+      return;
+    case ND_CONTINUE:
+      if (!g->cont)
+        error("continue文が無効です");
+      ir_jmp(g, g->cont);
+      return;
+    case ND_GOTO:
+      ir_jmp(g, label_block(g, ext->label_name));
+      return;
+    case ND_LABEL:
+      enter_block(g, label_block(g, ext->label_name));
+      gen_stmt(g, node_at(node->lhs));
+      return;
+    default:
+      gen_expr(g, node);
+  }
+}
+
+//
+// 後始末
+//
+
+// 入口から到達できないブロックを取り除く
+static void remove_unreachable_blocks(IrGen *g) {
+  IrFunc *ir = g->ir;
+
+  // 入口から深さ優先でたどる
+  IrBlock **stack = arena_alloc(g->arena, sizeof(IrBlock *) * ir->nblocks);
+  int sp = 0;
+  stack[sp++] = ir->blocks[0];
+  ir->blocks[0]->reachable = true;
+  while (sp > 0) {
+    IrBlock *b = stack[--sp];
+    for (int i = 0; i < b->nsuccs; i++) {
+      if (!b->succs[i]->reachable) {
+        b->succs[i]->reachable = true;
+        stack[sp++] = b->succs[i];
+      }
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrBlock *b = ir->blocks[i];
+    if (!b->reachable)
+      continue;
+    ir->blocks[n++] = b;
+
+    // 到達できない先行ブロックと、そこから来た時のφ命令の引数を取り除く
+    int m = 0;
+    for (int j = 0; j < b->npreds; j++) {
+      if (!b->preds[j]->reachable)
+        continue;
+      for (IrInst *phi = b->phis; phi; phi = phi->next)
+        phi->args[m] = phi->args[j];
+      b->preds[m++] = b->preds[j];
+    }
+    b->npreds = m;
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      phi->nargs = m;
+  }
+  ir->nblocks = n;
+}
+
+// 自分自身か1つの値しか選ばないφ命令を、その値で置き換える
+// 置き換えると他のφ命令も同じように不要になることがあるので、変わらなくなるまで繰り返す
+static void remove_trivial_phis(IrGen *g) {
+  IrFunc *ir = g->ir;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < ir->nblocks; i++) {
+      for (IrInst *phi = ir->blocks[i]->phis; phi; phi = phi->next) {
+        if (phi->replace)
+          continue;
+
+        IrInst *same = NULL;
+        bool trivial = true;
+        for (int j = 0; j < phi->nargs; j++) {
+          IrInst *arg = resolve(phi->args[j]);
+          if (arg == phi || arg == same)
+            continue;
+          if (same) {
+            trivial = false;
+            break;
+          }
+          same = arg;
+        }
+        if (!trivial)
+          continue;
+
+        phi->replace = same ? same : undef_value(g);
+        changed = true;
+      }
+    }
+  }
+
+  // 命令の引数を置き換え先に書き換え、置き換えたφ命令を取り除く
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrBlock *b = ir->blocks[i];
+    IrInst head = {};
+    IrInst *cur = &head;
+    for (IrInst *phi = b->phis; phi; phi = phi->next) {
+      if (phi->replace)
+        continue;
+      cur->next = phi;
+      cur = phi;
+    }
+    cur->next = NULL;
+    b->phis = head.next;
+
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      for (int j = 0; j < phi->nargs; j++)
+        phi->args[j] = resolve(phi->args[j]);
+    for (IrInst *inst = b->insts; inst; inst = inst->next)
+      for (int j = 0; j < inst->nargs; j++)
+        inst->args[j] = resolve(inst->args[j]);
+  }
+}
+
+// ブロックと値に、配置順に1から番号をつけ直す
+static void renumber(IrFunc *ir) {
+  int nvals = 0;
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrBlock *b = ir->blocks[i];
+    b->id = i + 1;
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      phi->id = ++nvals;
+    for (IrInst *inst = b->insts; inst; inst = inst->next)
+      if (ir_has_value(inst))
+        inst->id = ++nvals;
+  }
+  ir->nvals = nvals;
+}
+
+// 関数fnの本体をIRに変換する
+// IRはfn->arenaに確保するので、関数と一緒に解放される
+IrFunc *gen_ir(Function *fn) {
+  IrGen ctx = {};
+  IrGen *g = &ctx;
+  g->arena = fn->arena;
+  g->ir = arena_alloc(g->arena, sizeof(IrFunc));
+  g->ir->fn = fn;
+  number_promoted_vars(g, fn);
+
+  IrBlock *entry = new_block(g);
+  entry->sealed = true;
+  g->cur = entry;
+  place_block(g, entry);
+
+  // 引数はレジスタで渡されるので、他の命令より先にすべて値にしておく
+  IrInst *params[6];
+  int nparams = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next) {
+    if (nparams == 6)
+      error("%s: 引数が多すぎます", fn->name);
+    IrInst *param = new_inst(g, IR_PARAM, 0);
+    param->val = nparams;
+    params[nparams++] = emit(g, param);
+  }
+
+  int i = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next) {
+    Var *var = vl->var;
+    IrInst *param = params[i++];
+    if (var->ssa_idx > 0) {
+      write_var(g, var->ssa_idx - 1, g->cur, normalize(g, param, var->ty));
+    } else {
+      IrInst *addr = new_inst(g, IR_LVAR, 0);
+      addr->var = var;
+      ir_store(g, emit(g, addr), param, var->ty->size);
+    }
+  }
+
+  for (Node *n = node_at(fn->node); n; n = node_at(n->next))
+    gen_stmt(g, n);
+
+  // 最後まで実行したら戻る
+  if (g->cur)
+    terminate(g, new_inst(g, IR_RET, 0));
+
+  for (IrLabel *l = g->labels; l; l = l->next) {
+    if (!l->block->placed)
+      error("%s: ラベル %s がありません", fn->name, l->name);
+    seal_block(g, l->block);
+  }
+
+  remove_unreachable_blocks(g);
+  remove_trivial_phis(g);
+  renumber(g->ir);
+  return g->ir;
+}
+
+// 分岐するブロックから、φ命令のある合流点へ向かう辺(クリティカルエッジ)に空のブロックを挟む
+// φ命令の値は先行ブロックの最後で移すので、分岐するブロックで移すともう一方の後続ブロックの値を壊しうる
+// 挟んだブロックは分岐するブロックの直後に置く
+void split_critical_edges(IrFunc *ir) {
+  Arena *arena = ir->fn->arena;
+  int cap = ir->nblocks * 3;
+  IrBlock **blocks = arena_alloc(arena, sizeof(IrBlock *) * cap);
+  int n = 0;
+
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrBlock *b = ir->blocks[i];
+    blocks[n++] = b;
+    if (b->nsuccs < 2)
+      continue;
+
+    for (int j = 0; j < b->nsuccs; j++) {
+      IrBlock *s = b->succs[j];
+      if (!s->phis)
+        continue;
+
+      IrBlock *mid = arena_alloc(arena, sizeof(IrBlock));
+      IrInst *jmp = arena_alloc(arena, sizeof(IrInst));
+      jmp->op = IR_JMP;
+      jmp->block = mid;
+      mid->insts = jmp;
+      mid->last = jmp;
+      mid->preds = arena_alloc(arena, sizeof(IrBlock *));
+      mid->preds[0] = b;
+      mid->npreds = 1;
+      mid->preds_cap = 1;
+      mid->succs[0] = s;
+      mid->nsuccs = 1;
+
+      // 同じブロックへの辺が2本ある場合は、1本ずつ置き換える
+      for (int k = 0; k < s->npreds; k++) {
+        if (s->preds[k] == b) {
+          s->preds[k] = mid;
+          break;
+        }
+      }
+      b->succs[j] = mid;
+      blocks[n++] = mid;
+    }
+  }
+
+  ir->blocks = blocks;
+  ir->nblocks = n;
+  ir->blocks_cap = cap;
+  for (int i = 0; i < n; i++)
+    ir->blocks[i]->id = i + 1;
+}
+
+//
+// 検査
+//
+// IRが次の条件を満たしているか調べ、満たしていなければエラーにする
+// - 各ブロックはちょうど1つの終端命令で終わり、後続ブロックは終端命令と一致する
+// - 先行ブロックと後続ブロックが対応している
+// - φ命令の引数の個数は先行ブロックの個数と同じ
+// - 値は一度だけ定義され、使う場所は定義に支配されている
+//   (φ命令の引数は、対応する先行ブロックの終わりが定義に支配されている)
+//
+
+typedef struct {
+  IrFunc *ir;
+  IrBlock **idom; // idom[ブロックの番号]は直接の支配ブロック
+  int *rpo; // rpo[ブロックの番号]は逆後順での順位
+  int *pos; // pos[値の番号]は、その値を定義した命令のブロック内での位置
+  IrInst **defs; // defs[値の番号]はその値を定義した命令
+} IrVerifier;
+
+static void verify_error(IrVerifier *v, IrBlock *b, char *msg) {
+  error("%s: IRが不正です: bb%d: %s", v->ir->fn->name, b->id, msg);
+}
+
+static void postorder(IrBlock *b, bool *visited, IrBlock **order, int *n) {
+  visited[b->id] = true;
+  for (int i = 0; i < b->nsuccs; i++)
+    if (!visited[b->succs[i]->id])
+      postorder(b->succs[i], visited, order, n);
+  order[(*n)++] = b;
+}
+
+static IrBlock *intersect(IrVerifier *v, IrBlock *a, IrBlock *b) {
+  while (a != b) {
+    while (v->rpo[a->id] > v->rpo[b->id])
+      a = v->idom[a->id];
+    while (v->rpo[b->id] > v->rpo[a->id])
+      b = v->idom[b->id];
+  }
+  return a;
+}
+
+// 支配木を作る (Cooper, Harvey, Kennedy "A Simple, Fast Dominance Algorithm")
+static void compute_dominators(IrVerifier *v) {
+  IrFunc *ir = v->ir;
+  int n = ir->nblocks;
+  bool *visited = calloc(n + 1, sizeof(bool));
+  IrBlock **order = calloc(n, sizeof(IrBlock *));
+  int norder = 0;
+  postorder(ir->blocks[0], visited, order, &norder);
+
+  v->idom = calloc(n + 1, sizeof(IrBlock *));
+  v->rpo = calloc(n + 1, sizeof(int));
+  for (int i = 0; i < norder; i++)
+    v->rpo[order[i]->id] = norder - i;
+
+  IrBlock *entry = ir->blocks[0];
+  v->idom[entry->id] = entry;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = norder - 1; i >= 0; i--) {
+      IrBlock *b = order[i];
+      if (b == entry)
+        continue;
+
+      IrBlock *idom = NULL;
+      for (int j = 0; j < b->npreds; j++) {
+        IrBlock *p = b->preds[j];
+        if (!v->idom[p->id])
+          continue;
+        idom = idom ? intersect(v, p, idom) : p;
+      }
+      if (v->idom[b->id] != idom) {
+        v->idom[b->id] = idom;
+        changed = true;
+      }
+    }
+  }
+  free(visited);
+  free(order);
+}
+
+// ブロックaがブロックbを支配していればtrue
+static bool dominates(IrVerifier *v, IrBlock *a, IrBlock *b) {
+  for (;;) {
+    if (a == b)
+      return true;
+    IrBlock *idom = v->idom[b->id];
+    if (idom == b)
+      return false;
+    b = idom;
+  }
+}
+
+// 値argが、ブロックbのpos番目の命令で使えるか調べる
+static void verify_use(IrVerifier *v, IrBlock *b, int pos, IrInst *arg) {
+  if (!arg || arg->id < 1 || arg->id > v->ir->nvals || v->defs[arg->id] != arg)
+    verify_error(v, b, "定義されていない値を使っています");
+  if (arg->block == b ? v->pos[arg->id] >= pos : !dominates(v, arg->block, b))
+    verify_error(v, b, "値の定義が使う場所を支配していません");
+}
+
+void verify_ir(IrFunc *ir) {
+  IrVerifier ctx = {};
+  IrVerifier *v = &ctx;
+  v->ir = ir;
+  int n = ir->nblocks;
+  v->pos = calloc(ir->nvals + 1, sizeof(int));
+  v->defs = calloc(ir->nvals + 1, sizeof(IrInst *));
+
+  // 形の検査と、値の定義の収集
+  for (int i = 0; i < n; i++) {
+    IrBlock *b = ir->blocks[i];
+    if (b->id != i + 1)
+      verify_error(v, b, "ブロックの番号が不正です");
+    if (i == 0 && b->npreds)
+      verify_error(v, b, "入口のブロックに先行ブロックがあります");
+    if (!b->last || !ir_is_terminator(b->last))
+      verify_error(v, b, "終端命令で終わっていません");
+
+    int pos = 0;
+    for (IrInst *phi = b->phis; phi; phi = phi->next) {
+      if (phi->op != IR_PHI)
+        verify_error(v, b, "φ命令以外の命令がφ命令の位置にあります");
+      if (phi->nargs != b->npreds)
+        verify_error(v, b, "φ命令の引数の個数が先行ブロックの個数と違います");
+      if (phi->id < 1 || phi->id > ir->nvals || v->defs[phi->id])
+        verify_error(v, b, "値が二度定義されています");
+      v->defs[phi->id] = phi;
+      v->pos[phi->id] = pos++;
+    }
+    for (IrInst *inst = b->insts; inst; inst = inst->next) {
+      if (inst->block != b)
+        verify_error(v, b, "命令の属するブロックが不正です");
+      if (inst->op == IR_PHI)
+        verify_error(v, b, "φ命令がブロックの途中にあります");
+      if (ir_is_terminator(inst) != (inst == b->last))
+        verify_error(v, b, "終端命令がブロックの途中にあります");
+      if (ir_has_value(inst)) {
+        if (inst->id < 1 || inst->id > ir->nvals || v->defs[inst->id])
+          verify_error(v, b, "値が二度定義されています");
+        v->defs[inst->id] = inst;
+        v->pos[inst->id] = pos;
+      }
+      pos++;
+    }
+
+    int nsuccs = b->last->op == IR_JMP ? 1 : b->last->op == IR_BR ? 2 : 0;
+    if (b->nsuccs != nsuccs)
+      verify_error(v, b, "後続ブロックの個数が終端命令と合いません");
+    for (int j = 0; j < b->nsuccs; j++) {
+      IrBlock *s = b->succs[j];
+      if (s->id < 1 || s->id > n || ir->blocks[s->id - 1] != s)
+        verify_error(v, b, "後続ブロックが関数にありません");
+      bool found = false;
+      for (int k = 0; k < s->npreds; k++)
+        if (s->preds[k] == b)
+          found = true;
+      if (!found)
+        verify_error(v, b, "後続ブロックの先行ブロックにありません");
+    }
+    for (int j = 0; j < b->npreds; j++) {
+      IrBlock *p = b->preds[j];
+      if (p->id < 1 || p->id > n || ir->blocks[p->id - 1] != p ||
+          (p->succs[0] != b && (p->nsuccs < 2 || p->succs[1] != b)))
+        verify_error(v, b, "先行ブロックの後続ブロックにありません");
+    }
+  }
+
+  // 値を使う場所が定義に支配されているかの検査
+  compute_dominators(v);
+  for (int i = 0; i < n; i++) {
+    IrBlock *b = ir->blocks[i];
+    if (!v->idom[b->id])
+      verify_error(v, b, "入口から到達できません");
+
+    for (IrInst *phi = b->phis; phi; phi = phi->next) {
+      for (int j = 0; j < phi->nargs; j++) {
+        // 先行ブロックの終わりで使うものとみなす
+        IrBlock *p = b->preds[j];
+        verify_use(v, p, INT_MAX, phi->args[j]);
+      }
+    }
+    int pos = 0;
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      pos++;
+    for (IrInst *inst = b->insts; inst; inst = inst->next) {
+      for (int j = 0; j < inst->nargs; j++)
+        verify_use(v, b, pos, inst->args[j]);
+      pos++;
+    }
+  }
+
+  free(v->idom);
+  free(v->rpo);
+  free(v->pos);
+  free(v->defs);
+}
+
+//
+// テキスト形式での出力
+//
+
+static char *op_name(IrOp op) {
+  switch (op) {
+    case IR_CONST:
+      return "const";
+    case IR_PARAM:
+      return "param";
+    case IR_LVAR:
+      return "lvar";
+    case IR_GVAR:
+      return "gvar";
+    case IR_LOAD:
+      return "load";
+    case IR_STORE:
+      return "store";
+    case IR_ADD:
+      return "add";
+    case IR_SUB:
+      return "sub";
+    case IR_MUL:
+      return "mul";
+    case IR_DIV:
+      return "div";
+    case IR_AND:
+      return "and";
+    case IR_OR:
+      return "or";
+    case IR_XOR:
+      return "xor";
+    case IR_SHL:
+      return "shl";
+    case IR_SAR:
+      return "sar";
+    case IR_EQ:
+      return "eq";
+    case IR_NE:
+      return "ne";
+    case IR_LT:
+      return "lt";
+    case IR_LE:
+      return "le";
+    case IR_NOT:
+      return "not";
+    case IR_SEXT:
+      return "sext";
+    case IR_CALL:
+      return "call";
+    case IR_VA_START:
+      return "va_start";
+    case IR_PHI:
+      return "phi";
+    case IR_JMP:
+      return "jmp";
+    case IR_BR:
+      return "br";
+    case IR_RET:
+      return "ret";
+  }
+  return "?";
+}
+
+static void dump_inst(IrInst *inst) {
+  emitf("  ");
+  if (ir_has_value(inst))
+    emitf("%%%d = ", inst->id);
+  emitf("%s", op_name(inst->op));
+  if (inst->size)
+    emitf(".i%d", inst->size * 8);
+
+  switch (inst->op) {
+    case IR_CONST:
+    case IR_PARAM:
+      emitf(" %ld", inst->val);
+      break;
+    case IR_LVAR:
+    case IR_GVAR:
+      emitf(" %s", inst->var->name);
+      break;
+    case IR_CALL:
+      emitf(" %s", inst->name);
+      break;
+    case IR_PHI:
+      for (int i = 0; i < inst->nargs; i++)
+        emitf("%s [%%%d, bb%d]", i ? "," : "", inst->args[i]->id, inst->block->preds[i]->id);
+      emitf("\n");
+      return;
+    default:
+      break;
+  }
+
+  for (int i = 0; i < inst->nargs; i++) {
+    if (inst->op == IR_CALL)
+      emitf("%s%%%d", i ? ", " : "(", inst->args[i]->id);
+    else
+      emitf("%s %%%d", i ? "," : "", inst->args[i]->id);
+  }
+  if (inst->op == IR_CALL)
+    emitf(inst->nargs ? ")" : "()");
+
+  IrBlock *b = inst->block;
+  for (int i = 0; i < b->nsuccs && inst == b->last; i++)
+    emitf("%s bb%d", i || inst->nargs ? "," : "", b->succs[i]->id);
+  emitf("\n");
+}
+
+void dump_ir(IrFunc *ir) {
+  emitf("function %s\n", ir->fn->name);
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrBlock *b = ir->blocks[i];
+    emitf("bb%d:", b->id);
+    if (b->npreds) {
+      emitf(" ; preds");
+      for (int j = 0; j < b->npreds; j++)
+        emitf(" bb%d", b->preds[j]->id);
+    }
+    emitf("\n");
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      dump_inst(phi);
+    for (IrInst *inst = b->insts; inst; inst = inst->next)
+      dump_inst(inst);
+  }
+  emitf("\n");
+}
@@ -4,47 +4,81 @@
 
 #include "dcc.h"
 
-char *read_file(char *path) {
-  FILE *fp = fopen(path, "r");
-  if (!fp)
-    error("%s を開けません", path);
-
-  int filemax = 10 * 1024 * 1024; // 10 MB
-  char *buf = malloc(filemax);
-  int size = fread(buf, 1, filemax - 2, fp); // "\n\0"の分(2バイト)を引く
-  if (!feof(fp))
-    error("%s: ファイルが大きすぎます");
-
-  // ファイルが必ず"\n\0"で終わるようにする
-  if (size == 0 || buf[size - 1] != '\n')
-    buf[size++] = '\n';
-  buf[size] = '\0';
-  return buf;
-}
+bool opt_dump_ir;
+bool opt_verify_ir;
+int opt_no_peephole;
+bool opt_emit_obj;
 
 int main(int argc, char **argv) {
-  if (argc != 2)
+  char *output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--dump-ir"))
+      opt_dump_ir = true;
+    else if (!strcmp(argv[i], "--verify-ir"))
+      opt_verify_ir = true;
+    else if (!strcmp(argv[i], "--no-peephole"))
+      opt_no_peephole = (1 << NUM_PEEP_RULES) - 1;
+    else if (!strncmp(argv[i], "--no-peephole=", 14)) {
+      int rule = find_peephole_rule(argv[i] + 14);
+      if (rule < 0)
+        error("覗き穴最適化の規則がありません: %s\n", argv[i] + 14);
+      opt_no_peephole = opt_no_peephole | (1 << rule);
+    }
+    else if (!strcmp(argv[i], "-c"))
+      opt_emit_obj = true;
+    else if (!strcmp(argv[i], "-o")) {
+      if (i + 1 == argc)
+        error("-o の後に出力ファイルがありません\n");
+      i++;
+      output = argv[i];
+    }
+    else if (argv[i][0] == '-' || filename)
+      error("引数が正しくありません: %s\n", argv[i]);
+    else
+      filename = argv[i];
+  }
+  if (!filename)
     error("引数の個数が正しくありません\n");
 
-  // トークナイズしてパースする
-  filename = argv[1];
-  user_input = read_file(argv[1]);
-  token = tokenize(user_input);
-  Program *prog = program();
-
-  // 関数ごとにローカル変数にオフセットを割り当てる
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    int offset = fn->has_varargs ? 56 : 0;
-    for (VarList *vl = fn->locals; vl; vl = vl->next) {
-      Var *var = vl->var;
-      offset = align_to(offset, var->ty->align);
-      offset += var->ty->size;
-      var->offset = offset;
-    }
-    // スタックサイズを8の倍数に整える
-    fn->stack_size = align_to(offset, 8);
+  if (opt_emit_obj && opt_dump_ir)
+    error("-c と --dump-ir は同時に指定できません\n");
+
+  // -oがなければ標準出力に書く(-cならソースファイルの名前の拡張子を.oに変えたファイル)
+  if (opt_emit_obj && !output)
+    output = object_file_name(filename);
+  open_output(output);
+
+  // トークナイズしてパースしながらコードを生成する
+  user_input = read_file(filename);
+  tokenize(user_input);
+  init_parser();
+  init_ir();
+
+  // 関数を1つパースするごとにそのコードを出力し、その関数のメモリを解放する
+  // メモリの使用量はファイル全体ではなく、最も大きい関数の大きさで抑えられる
+  // コード生成スレッドが使える場合は、次の関数のパースと並行してコードを出力する
+  // DCC_PARSE_PROCSが設定されていれば、関数本体のパースから複数のプロセスで行う
+  // --dump-irの場合は、関数ごとのIRだけを出力する
+  // -cの場合は、関数の機械語をためておいて最後にオブジェクトファイルにする
+  if (opt_emit_obj)
+    begin_object();
+  else if (!opt_dump_ir)
+    emit_header();
+  if (!compile_in_procs()) {
+    start_codegen();
+    for (Function *fn = next_function(); fn; fn = next_function())
+      send_function(fn);
+    finish_codegen();
   }
 
-  codegen(prog);
+  // グローバル変数(文字列リテラルを含む)は最後にまとめて出力する
+  Program *prog = finish_program();
+  if (opt_emit_obj)
+    write_object(prog);
+  else if (!opt_dump_ir)
+    emit_data(prog);
+  close_output();
+  print_arena_stats();
+  print_peephole_stats();
   return 0;
 }
@@ -0,0 +1,227 @@
+//
+// ノードプール
+//
+// ASTのノードは関数ごとのノードプールに格納し、32ビットの添字(ハンドル)で互いを参照する
+// ハンドル0は「ノードなし」を表す
+// パース中はノードをNODE_BLOCK個ずつのブロックに確保するので、ノードを追加してもポインタは変わらない
+//
+// 関数をパースし終えたら preorder_nodes() で、ノードをコード生成が訪れる順(前順)に
+// 1つの連続した配列へ詰め直す。コード生成はノードをメモリの前から順に読むことになる
+//
+// 制御構文の子や関数名など、一部の種類のノードだけが使う情報(NodeExt)はノードに入れず、
+// 同じプールの別の配列に同じようにブロックで確保して、ノードのextのハンドルで指す
+// ほとんどのノード(変数・数値・演算子など)はNodeExtを持たないので、ノード1つが小さくなる
+//
+
+#include "dcc.h"
+
+enum {
+  NODE_BLOCK_BITS = 6,
+  NODE_BLOCK = 1 << NODE_BLOCK_BITS,
+};
+
+struct NodePool {
+  Arena *arena;
+  Node **blocks; // blocks[i]はハンドル i * NODE_BLOCK から始まるブロック
+  int blocks_cap;
+  int len;       // 次に確保するノードのハンドル
+  NodeExt **ext_blocks; // NodeExtのブロック。ハンドルの付け方はノードと同じ
+  int ext_blocks_cap;
+  int ext_len;          // 次に確保するNodeExtのハンドル
+};
+
+// NodeExtを持たないノードのためのNodeExt。すべて0で、書き換えない
+static NodeExt empty_ext;
+
+// 現在のノードプール
+// パーサとコード生成スレッドはそれぞれ別のプールを使うので、スレッドごとに持つ
+static __thread NodePool *cur_pool;
+
+// arenaから確保する空のノードプールを作る
+NodePool *new_node_pool(Arena *arena) {
+  NodePool *pool = arena_alloc(arena, sizeof(NodePool));
+  pool->arena = arena;
+  pool->len = 1; // ハンドル0は使わない
+  pool->ext_len = 1;
+  return pool;
+}
+
+// 以降のノードの確保とハンドルの変換に使うノードプールを切り替える
+void set_node_pool(NodePool *pool) {
+  cur_pool = pool;
+}
+
+NodePool *get_node_pool(void) {
+  return cur_pool;
+}
+
+// ハンドルidのノードを返す。idが0ならNULLを返す
+Node *node_at(int id) {
+  if (!id)
+    return NULL;
+  return &cur_pool->blocks[id >> NODE_BLOCK_BITS][id & (NODE_BLOCK - 1)];
+}
+
+// ノードのハンドルを返す。nodeがNULLなら0を返す
+int node_id(Node *node) {
+  return node ? node->id : 0;
+}
+
+// ブロックへのポインタの配列blocks(大きさ*cap)を、nblocks個以上入るように伸ばして返す
+static void *grow_blocks(Arena *arena, void *blocks, int *cap, int nblocks) {
+  if (nblocks <= *cap)
+    return blocks;
+
+  int new_cap = *cap ? *cap : 16;
+  while (new_cap < nblocks)
+    new_cap *= 2;
+
+  void *new_blocks = arena_alloc(arena, sizeof(void *) * new_cap);
+  if (*cap)
+    memcpy(new_blocks, blocks, sizeof(void *) * *cap);
+  *cap = new_cap;
+  return new_blocks;
+}
+
+// 現在のノードプールに、0で埋めた新しいノードを確保する
+Node *alloc_node(void) {
+  NodePool *pool = cur_pool;
+  int id = pool->len++;
+  int b = id >> NODE_BLOCK_BITS;
+
+  if ((id & (NODE_BLOCK - 1)) == 0 || id == 1) {
+    pool->blocks = grow_blocks(pool->arena, pool->blocks, &pool->blocks_cap, b + 1);
+    pool->blocks[b] = arena_alloc(pool->arena, sizeof(Node) * NODE_BLOCK);
+  }
+
+  Node *node = &pool->blocks[b][id & (NODE_BLOCK - 1)];
+  node->id = id;
+  return node;
+}
+
+static NodeExt *ext_at(NodePool *pool, int ext) {
+  return &pool->ext_blocks[ext >> NODE_BLOCK_BITS][ext & (NODE_BLOCK - 1)];
+}
+
+// ノードのNodeExtを返す。持っていなければ、すべて0のNodeExtを返す
+// 返したものには書き込まないこと(書く時はalloc_node_ext()を使う)
+NodeExt *node_ext(Node *node) {
+  if (!node->ext)
+    return &empty_ext;
+  return ext_at(cur_pool, node->ext);
+}
+
+// ノードのNodeExtを返す。まだ持っていなければ、現在のノードプールに0で埋めて確保する
+// ノードと同じくブロックに確保するので、NodeExtを追加してもポインタは変わらない
+NodeExt *alloc_node_ext(Node *node) {
+  if (node->ext)
+    return ext_at(cur_pool, node->ext);
+
+  NodePool *pool = cur_pool;
+  int ext = pool->ext_len++;
+  int b = ext >> NODE_BLOCK_BITS;
+
+  if ((ext & (NODE_BLOCK - 1)) == 0 || ext == 1) {
+    pool->ext_blocks = grow_blocks(pool->arena, pool->ext_blocks, &pool->ext_blocks_cap, b + 1);
+    pool->ext_blocks[b] = arena_alloc(pool->arena, sizeof(NodeExt) * NODE_BLOCK);
+  }
+
+  node->ext = ext;
+  return ext_at(pool, ext);
+}
+
+//
+// 前順への並べ直し
+//
+
+// map[古いハンドル] = 新しいハンドル
+// order[新しいハンドル] = 古いハンドル
+static int *map;
+static int *order;
+static int norder;
+static int next_ext; // 並べ直した後のNodeExtの個数+1
+
+// idから始まる連結リスト(nextでつながったノード)を順に訪れる
+static void visit(int id) {
+  for (; id && !map[id]; id = node_at(id)->next) {
+    map[id] = norder;
+    order[norder++] = id;
+
+    // コード生成が子ノードを訪れる順
+    Node *node = node_at(id);
+    NodeExt *ext = node_ext(node);
+    if (node->ext)
+      next_ext++;
+    visit(ext->init);
+    visit(ext->cond);
+    visit(ext->then);
+    visit(ext->els);
+    visit(ext->inc);
+    visit(node->lhs);
+    visit(node->rhs);
+    visit(ext->body);
+    visit(ext->args);
+    visit(ext->case_next);
+    visit(ext->default_case);
+  }
+}
+
+// headから始まる関数本体のノードを、コード生成が訪れる順に並べ直した新しいノードプールをarenaに作る
+// *headは新しいプールでのハンドルに書き換え、現在のノードプールも新しいプールに切り替える
+// 元のノードプールは使わなくなるので、確保した領域ごと解放してよい
+NodePool *preorder_nodes(int *head, Arena *arena) {
+  NodePool *old = cur_pool;
+  map = calloc(old->len, sizeof(int));
+  order = calloc(old->len, sizeof(int));
+  norder = 1;
+  next_ext = 1;
+  visit(*head);
+
+  // ノードとNodeExtをそれぞれ1つの連続した配列に確保し、ブロックはその配列の中を指す
+  // NodeExtもノードと同じ順に並べる
+  NodePool *pool = new_node_pool(arena);
+  int nblocks = (norder + NODE_BLOCK - 1) >> NODE_BLOCK_BITS;
+  pool->blocks = grow_blocks(arena, pool->blocks, &pool->blocks_cap, nblocks);
+  Node *nodes = arena_alloc(arena, sizeof(Node) * norder);
+  for (int i = 0; i < nblocks; i++)
+    pool->blocks[i] = nodes + (i << NODE_BLOCK_BITS);
+  pool->len = norder;
+
+  int ext_nblocks = (next_ext + NODE_BLOCK - 1) >> NODE_BLOCK_BITS;
+  pool->ext_blocks = grow_blocks(arena, pool->ext_blocks, &pool->ext_blocks_cap, ext_nblocks);
+  NodeExt *exts = arena_alloc(arena, sizeof(NodeExt) * next_ext);
+  for (int i = 0; i < ext_nblocks; i++)
+    pool->ext_blocks[i] = exts + (i << NODE_BLOCK_BITS);
+  pool->ext_len = next_ext;
+
+  int nexts = 1;
+  for (int i = 1; i < norder; i++) {
+    Node *node = &nodes[i];
+    *node = *node_at(order[i]);
+    node->id = i;
+    node->next = map[node->next];
+    node->lhs = map[node->lhs];
+    node->rhs = map[node->rhs];
+    if (!node->ext)
+      continue;
+
+    NodeExt *ext = &exts[nexts];
+    *ext = *ext_at(old, node->ext);
+    node->ext = nexts++;
+    ext->cond = map[ext->cond];
+    ext->then = map[ext->then];
+    ext->els = map[ext->els];
+    ext->init = map[ext->init];
+    ext->inc = map[ext->inc];
+    ext->body = map[ext->body];
+    ext->args = map[ext->args];
+    ext->case_next = map[ext->case_next];
+    ext->default_case = map[ext->default_case];
+  }
+
+  *head = map[*head];
+  free(map);
+  free(order);
+  cur_pool = pool;
+  return pool;
+}
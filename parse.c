@@ -10,9 +10,42 @@ static VarScope *var_scope;
 static TagScope *tag_scope;
 static int scope_depth;
 
+Arena *tu_arena;
+Arena *fn_arena;
+Arena *scope_arena;
+
 // switch文をパーズしている時に、パーズ中のNode(ND_SWITCH)を指す
 static Node *current_switch = NULL;
 
+// インターンされた "__builtin_va_start"
+static char *builtin_va_start;
+
+// trueなら、function()は関数本体をパースせずに読み飛ばし、その位置だけを記録する
+static bool skim_bodies;
+
+// trueなら、parse_body()はエラーを見つけるためだけに本体をパースし、コード生成のための並べ直しをしない
+static bool check_only;
+
+// 本体のパースを後回しにしたstatic関数のうち、参照されてパースを待っているもの
+// 参照された順にパースする
+typedef struct LazyFunction LazyFunction;
+struct LazyFunction {
+  LazyFunction *next;
+  Function *fn;
+  ScopeEntry *ent; // skipped_headのリストの時、関数の名前のエントリ
+};
+
+static LazyFunction *lazy_head;
+static LazyFunction *lazy_tail;
+
+// 本体を読み飛ばしたstatic関数すべて(ソースの順)
+// 参照された関数はパースしてコードを生成した後に解放されるので、fnではなく名前のエントリで見分ける
+static LazyFunction *skipped_head;
+static LazyFunction *skipped_tail;
+
+// new_label()で作るラベルの接頭辞
+static char *data_label_prefix = ".L.data.";
+
 typedef enum {
   TYPEDEF = 1 << 0,
   STATIC = 1 << 1,
@@ -20,9 +53,23 @@ typedef enum {
 } StorageClass;
 
 // 非終端記号を表す関数のプロトタイプ宣言
-Program *program();
+void init_parser();
+
+void skip_body();
+
+void parse_body(Function *fn);
+
+void use_function(char *name);
+
+void use_functions_in(Function *fn);
+
+void free_lazy_functions();
+
+Function *next_function();
+
+Program *finish_program();
 
-Function *function();
+Function *function(Type *ty, char *name, StorageClass sclass);
 
 Node *declaration();
 
@@ -86,88 +133,224 @@ Node *unary();
 
 Node *postfix();
 
-Node *compound_literal();
+Node *compound_literal(Type *ty);
 
 Node *primary();
 
-void global_var();
+void global_var(Type *ty, char *name, StorageClass sclass);
 
 bool peek_end();
 
 void expect_end();
 
+//
+// 名前からスコープを引くハッシュ表
+//
+// var_scope/tag_scope は宣言順の連結リストで、スコープを抜ける時に外す宣言を知るために使う
+// 名前の検索はこの表で行うので、宣言の総数によらず1回で引ける
+//
+
+// オープンアドレス法のハッシュ表。エントリは一度作ったら消さない
+static ScopeEntry **scope_table;
+static int scope_table_cap;
+static int scope_table_used;
+
+// 名前はインターンされているので、ポインタの値からハッシュ値を作る
+// インターンした文字列は続けて確保されるのでポインタの値も連続しやすい
+// そのまま使うと連続した位置に固まってしまうので、hash_long()で混ぜてばらす
+// 表の大きさ-1でマスクしてから使い、探す時も1つ進めるたびにマスクする
+int name_hash(char *name) {
+  return hash_long((long) name >> 3);
+}
+
+void grow_scope_table() {
+  ScopeEntry **old = scope_table;
+  int old_cap = scope_table_cap;
+
+  if (old_cap)
+    scope_table_cap = old_cap * 2;
+  else
+    scope_table_cap = 1024;
+  scope_table = calloc(scope_table_cap, sizeof(ScopeEntry *));
+
+  for (int i = 0; i < old_cap; i++) {
+    if (!old[i])
+      continue;
+    int h = name_hash(old[i]->name) & (scope_table_cap - 1);
+    while (scope_table[h])
+      h = (h + 1) & (scope_table_cap - 1);
+    scope_table[h] = old[i];
+  }
+  free(old);
+}
+
+// 名前nameのエントリを返す
+// 見つからなかった場合、createがtrueなら新しく作り、falseならNULLを返す
+ScopeEntry *get_scope_entry(char *name, bool create) {
+  if (scope_table_used * 2 >= scope_table_cap)
+    grow_scope_table();
+
+  for (int h = name_hash(name) & (scope_table_cap - 1);; h = (h + 1) & (scope_table_cap - 1)) {
+    ScopeEntry **ent = &scope_table[h];
+    if (!*ent) {
+      if (!create)
+        return NULL;
+      *ent = arena_alloc(tu_arena, sizeof(ScopeEntry));
+      (*ent)->name = name;
+      scope_table_used++;
+      return *ent;
+    }
+    if ((*ent)->name == name)
+      return *ent;
+  }
+}
+
 // ブロックスコープの開始
 Scope *enter_scope() {
-  Scope *sc = calloc(1, sizeof(Scope));
+  long mark = arena_mark(scope_arena);
+  Scope *sc = arena_alloc(scope_arena, sizeof(Scope));
+  sc->mark = mark;
   sc->var_scope = var_scope;
   sc->tag_scope = tag_scope;
   scope_depth++;
   return sc;
 }
 
+// 連結リストvar_scope/tag_scopeの先頭からvars/tagsの手前までの宣言を外し、外側の宣言に戻す
+void pop_scopes(VarScope *vars, TagScope *tags) {
+  for (; var_scope != vars; var_scope = var_scope->next)
+    get_scope_entry(var_scope->name, true)->var = var_scope->shadow;
+  for (; tag_scope != tags; tag_scope = tag_scope->next)
+    get_scope_entry(tag_scope->name, true)->tag = tag_scope->shadow;
+}
+
 // ブロックスコープの終了
 void leave_scope(Scope *sc) {
-  var_scope = sc->var_scope;
-  tag_scope = sc->tag_scope;
+  // このスコープで宣言された名前を、外側の宣言に戻す
+  pop_scopes(sc->var_scope, sc->tag_scope);
+
   scope_depth--;
+  // スコープの中で確保したVarScope/TagScopeと、sc自体をまとめて解放する
+  arena_release(scope_arena, sc->mark);
+}
+
+// トップレベルのスコープを、連結リストvar_scope上の位置varsまでの宣言が見える状態にする
+// varsが今の先頭より前なら、その後の宣言を外す(pop_scopes()と同じ)
+// 後なら、間の宣言を付け直す。同じ名前が複数あれば一番新しいものが見えるように、
+// 一度すべて空にしてから、新しい方から空のところだけを埋める
+// どちらが前かは、両方から同時にnextをたどって先に相手に着いた方で決める。どちらでも距離の2倍で済む
+void set_global_vars(VarScope *vars) {
+  VarScope *cur = var_scope;
+  VarScope *target = vars;
+  while (cur != vars && target != var_scope) {
+    if (cur)
+      cur = cur->next;
+    if (target)
+      target = target->next;
+  }
+  if (cur == vars) {
+    pop_scopes(vars, tag_scope);
+    return;
+  }
+
+  for (VarScope *sc = vars; sc != var_scope; sc = sc->next)
+    get_scope_entry(sc->name, true)->var = NULL;
+  for (VarScope *sc = vars; sc != var_scope; sc = sc->next) {
+    ScopeEntry *ent = get_scope_entry(sc->name, true);
+    if (!ent->var)
+      ent->var = sc;
+  }
+  var_scope = vars;
+}
+
+// set_global_vars()のタグ版
+void set_global_tags(TagScope *tags) {
+  TagScope *cur = tag_scope;
+  TagScope *target = tags;
+  while (cur != tags && target != tag_scope) {
+    if (cur)
+      cur = cur->next;
+    if (target)
+      target = target->next;
+  }
+  if (cur == tags) {
+    pop_scopes(var_scope, tags);
+    return;
+  }
+
+  for (TagScope *sc = tags; sc != tag_scope; sc = sc->next)
+    get_scope_entry(sc->name, true)->tag = NULL;
+  for (TagScope *sc = tags; sc != tag_scope; sc = sc->next) {
+    ScopeEntry *ent = get_scope_entry(sc->name, true);
+    if (!ent->tag)
+      ent->tag = sc;
+  }
+  tag_scope = tags;
+}
+
+// トップレベルのスコープを、関数本体を読み飛ばした時点など、前に記録した状態にする
+// スコープはトップレベルの宣言の連結リスト上の位置で表すので、前にも後ろにも動かせる
+void set_global_scope(VarScope *vars, TagScope *tags) {
+  set_global_vars(vars);
+  set_global_tags(tags);
 }
 
 Node *new_node(NodeKind kind, Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = kind;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_num(int val) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_NUM;
   node->val = val;
   return node;
 }
 
 Node *new_node_unary(NodeKind kind, Node *expr) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = kind;
-  node->lhs = expr;
+  node->lhs = node_id(expr);
   return node;
 }
 
 Node *new_node_var(Var *var) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_VAR;
   node->var = var;
   return node;
 }
 
 Node *new_node_return(Node *expr) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_RETURN;
-  node->lhs = expr;
+  node->lhs = node_id(expr);
   return node;
 }
 
 Node *new_node_if() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_IF;
   return node;
 }
 
 Node *new_node_while() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_WHILE;
   return node;
 }
 
 Node *new_node_for() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_FOR;
   return node;
 }
 
 Node *new_node_block() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_BLOCK;
   return node;
 }
@@ -181,7 +364,7 @@ Node *new_node_add(Node *lhs, Node *rhs) {
     return new_node(ND_PTR_ADD, lhs, rhs);
   if (is_integer(lhs->ty) && rhs->ty->ptr_to) // num + ptr
     return new_node(ND_PTR_ADD, rhs, lhs);
-  error_at(token->str, "`+` の左辺値と右辺値のどちらか、もしくは両方が不適です");
+  error_at(cur_token()->str, "`+` の左辺値と右辺値のどちらか、もしくは両方が不適です");
 }
 
 Node *new_node_sub(Node *lhs, Node *rhs) {
@@ -193,66 +376,66 @@ Node *new_node_sub(Node *lhs, Node *rhs) {
     return new_node(ND_PTR_SUB, lhs, rhs);
   if (lhs->ty->ptr_to && rhs->ty->ptr_to) // ptr - ptr
     return new_node(ND_PTR_DIFF, lhs, rhs);
-  error_at(token->str, "`-` の左辺値と右辺値のどちらか、もしくは両方が不適です");
+  error_at(cur_token()->str, "`-` の左辺値と右辺値のどちらか、もしくは両方が不適です");
 }
 
 Node *new_node_null() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_NULL;
   return node;
 }
 
 Node *new_node_stmt_expr() {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_STMT_EXPR;
   return node;
 }
 
 Node *new_node_comma(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_COMMA;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_logor(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_LOGOR;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_logand(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_LOGAND;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_bitor(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_BITOR;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_bitxor(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_BITXOR;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
 Node *new_node_bitand(Node *lhs, Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_BITAND;
-  node->lhs = lhs;
-  node->rhs = rhs;
+  node->lhs = node_id(lhs);
+  node->rhs = node_id(rhs);
   return node;
 }
 
@@ -260,44 +443,49 @@ Node *new_node_bitand(Node *lhs, Node *rhs) {
 // 文字列をグローバル変数として扱うために、普通のグローバル変数とは名前が被らない一意なラベルを用いる
 char *new_label() {
   static int cnt = 0;
-  char buf[20];
-  sprintf(buf, ".L.data.%d", cnt++);
-  return strndup(buf, 20);
+  char *buf = arena_alloc(tu_arena, 40);
+  sprintf(buf, "%s%d", data_label_prefix, cnt++);
+  return buf;
+}
+
+// new_label()で作るラベルの接頭辞を変える
+// 関数本体を別々のプロセスでパースする時に、プロセスごとにラベルが被らないようにする
+void set_data_label_prefix(char *prefix) {
+  data_label_prefix = prefix;
 }
 
 // funcargs = "(" (assign ("," assign)*)? ")"
 Node *funcargs() {
-  if (consume(")"))
+  if (consume(TK_RPAREN))
     return NULL;
 
   // 連結リストで引数を管理
   Node *head = assign();
   Node *cur = head;
-  while (consume(",")) {
-    cur->next = assign();
-    cur = cur->next;
+  while (consume(TK_COMMA)) {
+    cur->next = node_id(assign());
+    cur = node_at(cur->next);
   }
-  expect(")");
+  expect(TK_RPAREN);
   return head;
 }
 
 Node *new_node_fun_call(char *funcname) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node();
   node->kind = ND_FUNCALL;
-  node->funcname = funcname;
-  node->args = funcargs();
+  NodeExt *ext = alloc_node_ext(node);
+  ext->funcname = funcname;
+  ext->args = node_id(funcargs());
   return node;
 }
 
 // 変数を名前で検索する
 // 見つからなかった場合はNULLを返す
 VarScope *find_var(Token *tok) {
-  for (VarScope *sc = var_scope; sc; sc = sc->next) {
-    if (strlen(sc->name) == tok->len && !strncmp(tok->str, sc->name, tok->len)) {
-      return sc;
-    }
-  }
-  return NULL;
+  ScopeEntry *ent = get_scope_entry(tok->ident, false);
+  if (!ent)
+    return NULL;
+  return ent->var;
 }
 
 // typedefを検索する
@@ -314,25 +502,33 @@ Type *find_typedef(Token *tok) {
 // 構造体/enumタグを名前で検索する
 // 見つからなかった場合はNULLを返す
 TagScope *find_tag(Token *tok) {
-  for (TagScope *sc = tag_scope; sc; sc = sc->next)
-    if (strlen(sc->name) == tok->len && !strncmp(tok->str, sc->name, tok->len))
-      return sc;
-  return NULL;
+  ScopeEntry *ent = get_scope_entry(tok->ident, false);
+  if (!ent)
+    return NULL;
+  return ent->tag;
 }
 
 // var_scopeの先頭に変数/typedef/enumを追加
 VarScope *push_var_scope(char *name) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
+  VarScope *sc = arena_alloc(scope_arena, sizeof(VarScope));
   sc->name = name;
   sc->next = var_scope;
   sc->depth = scope_depth;
   var_scope = sc;
+
+  ScopeEntry *ent = get_scope_entry(name, true);
+  sc->shadow = ent->var;
+  ent->var = sc;
   return sc;
 }
 
 // 新しいローカル変数 or グローバル変数 を追加する
 Var *new_var(char *name, Type *ty, bool is_local) {
-  Var *var = calloc(1, sizeof(Var));
+  Var *var;
+  if (is_local)
+    var = arena_alloc(fn_arena, sizeof(Var));
+  else
+    var = arena_alloc(tu_arena, sizeof(Var));
   var->name = name;
   var->ty = ty;
   var->is_local = is_local;
@@ -345,7 +541,7 @@ Var *new_lvar(char *name, Type *ty) {
   Var *lvar = new_var(name, ty, true);
   push_var_scope(name)->var = lvar;
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(fn_arena, sizeof(VarList));
   vl->var = lvar;
   vl->next = locals;
   locals = vl;
@@ -360,7 +556,7 @@ Var *new_gvar(char *name, Type *ty, bool is_static, bool emit) {
   push_var_scope(name)->var = gvar;
 
   if (emit) {
-    VarList *vl = calloc(1, sizeof(VarList));
+    VarList *vl = arena_alloc(tu_arena, sizeof(VarList));
     vl->var = gvar;
     vl->next = globals;
     globals = vl;
@@ -370,36 +566,40 @@ Var *new_gvar(char *name, Type *ty, bool is_static, bool emit) {
 
 //  新しい構造体タグ/enumタグを連結リスト(tag_scope)の先頭に追加する
 void push_tag_scope(Token *tag, Type *ty) {
-  TagScope *sc = calloc(1, sizeof(TagScope));
+  TagScope *sc = arena_alloc(scope_arena, sizeof(TagScope));
   sc->next = tag_scope;
-  sc->name = strndup(tag->str, tag->len);
+  sc->name = tag->ident;
   sc->depth = scope_depth;
   sc->ty = ty;
   tag_scope = sc;
+
+  ScopeEntry *ent = get_scope_entry(sc->name, true);
+  sc->shadow = ent->tag;
+  ent->tag = sc;
 }
 
 // 配列宣言時の型のsuffix(配列の要素数)を読み取る
 // type-suffix = ("[" const-expr? "]" type-suffix)?
 Type *type_suffix(Type *ty) {
-  if (!consume("["))
+  if (!consume(TK_LBRACKET))
     return ty;
 
   int size = 0;
   bool is_incomplete = true;
 
-  if (!consume("]")) {
+  if (!consume(TK_RBRACKET)) {
     size = const_expr();
     is_incomplete = false;
-    expect("]");
+    expect(TK_RBRACKET);
   }
 
   ty = type_suffix(ty);
   if (ty->is_incomplete)
-    error_at(token->str, "不完全な型です");
+    error_at(cur_token()->str, "不完全な型です");
 
-  ty = array_of(ty, size);
-  ty->is_incomplete = is_incomplete;
-  return ty;
+  if (is_incomplete)
+    return incomplete_array_of(ty);
+  return array_of(ty, size);
 }
 
 // type-name = basetype abstract-declarator
@@ -422,30 +622,30 @@ VarList *read_func_param() {
   if (ty->kind == TY_ARRAY)
     ty = pointer_to(ty->ptr_to);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(fn_arena, sizeof(VarList));
   vl->var = new_lvar(name, ty);
   return vl;
 }
 
 void read_func_params(Function *fn) {
-  if (consume(")"))
+  if (consume(TK_RPAREN))
     return;
 
-  Token *tok = token;
-  if (consume("void") && consume(")"))
+  if (peek(TK_VOID) && token_at(token_pos + 1)->kind == TK_RPAREN) {
+    token_pos += 2;
     return;
-  token = tok;
+  }
 
   fn->params = read_func_param();
   VarList *cur = fn->params;
 
-  while (!consume(")")) {
-    expect(",");
+  while (!consume(TK_RPAREN)) {
+    expect(TK_COMMA);
 
     // 可変長引数
-    if (consume("...")) {
+    if (consume(TK_ELLIPSIS)) {
       fn->has_varargs = true;
-      expect(")");
+      expect(TK_RPAREN);
       return;
     }
 
@@ -454,64 +654,162 @@ void read_func_params(Function *fn) {
   }
 }
 
-bool is_typename() {
-  return peek("char") || peek("int") || peek("short") || peek("long") || peek("enum") || peek("static") ||
-         peek("struct") || peek("void") || peek("_Bool") || peek("typedef") || peek("extern") || find_typedef(token);
+// トークンtokが型名の始まりならtrueを返す
+bool is_typename_token(Token *tok) {
+  switch (tok->kind) {
+    case TK_CHAR:
+    case TK_INT:
+    case TK_SHORT:
+    case TK_LONG:
+    case TK_ENUM:
+    case TK_STATIC:
+    case TK_STRUCT:
+    case TK_VOID:
+    case TK_BOOL:
+    case TK_TYPEDEF:
+    case TK_EXTERN:
+      return true;
+    case TK_IDENT:
+      return find_typedef(tok);
+    default:
+      return false;
+  }
 }
 
-// program() が function() かどうか判定する
-bool is_function() {
-  Token *tok = token;
-  bool is_func = false;
-
-  // tokenを先読みして判定
-  // basetype declarator ( ... ならfunc
-  StorageClass sclass;
-  Type *ty = basetype(&sclass);
-  // 型名だけの宣言の場合もある(トップレベルにおいてのみ許可される)
-  if (!consume(";")) {
-    char *name = NULL;
-    declarator(ty, &name);
-    is_func = name && consume("(");
-  }
-  token = tok;
+bool is_typename() {
+  return is_typename_token(cur_token());
+}
 
-  return is_func;
+// 現在のトークンが "(" で、その次が型名の始まりならtrueを返す
+bool peek_paren_typename() {
+  return peek(TK_LPAREN) && is_typename_token(token_at(token_pos + 1));
 }
 
 Node *read_expr_stmt() {
   return new_node_unary(ND_EXPR_STMT, expr());
 }
 
-// program = (global-var | function)*
-Program *program() {
+// パーサを初期化する
+void init_parser() {
   locals = NULL;
   globals = NULL;
+  tu_arena = new_arena("unit");
+  fn_arena = tu_arena;
+  scope_arena = new_arena("scope");
+  set_node_pool(new_node_pool(tu_arena));
+  builtin_va_start = intern("__builtin_va_start", 18);
+}
+
+// program = (global-var | function)*
+// 次の関数定義までをパースして、その関数を返す。入力の終わりに達したらNULLを返す
+// 関数を1つずつ返すので、呼び出し側はパースし終えた関数から順にコードを生成して解放できる
+//
+// 参照されたstatic関数は、参照した関数の後に返す。どこからも参照されないstatic関数は、入力の最後でパースだけしてコードは生成しない
+Function *next_function() {
+  for (;;) {
+    if (lazy_head) {
+      Function *fn = lazy_head->fn;
+      lazy_head = lazy_head->next;
+      if (skim_bodies) {
+        use_functions_in(fn);
+      } else {
+        VarScope *vars = var_scope;
+        TagScope *tags = tag_scope;
+        parse_body(fn);
+        set_global_scope(vars, tags);
+      }
+      return fn;
+    }
+    if (at_eof())
+      break;
 
-  Function head = {};
-  Function *cur = &head;
+    // 前の宣言までのトークンはもう参照しないので回収する
+    // 本体を読み飛ばしている間は、後でパースする本体のトークンを残しておく
+    if (!skim_bodies)
+      release_tokens(token_pos);
 
-  while (!at_eof()) {
-    if (is_function()) {
-      Function *fn = function();
-      if (!fn) // 関数のプロトタイプ宣言
-        continue;
-      cur->next = fn;
-      cur = cur->next;
+    // 宣言子まで読んでから、"("が続けば関数、そうでなければグローバル変数とする
+    StorageClass sclass;
+    Type *ty = basetype(&sclass);
+    // 型名だけの宣言の場合もある(トップレベルにおいてのみ許可される)
+    if (consume(TK_SEMICOLON))
+      continue;
+
+    char *name = NULL;
+    ty = declarator(ty, &name);
+    if (consume(TK_LPAREN)) {
+      Function *fn = function(ty, name, sclass);
+      if (fn) // 関数のプロトタイプ宣言でなければ返す
+        return fn;
     } else {
-      global_var();
+      global_var(ty, name, sclass);
     }
   }
+  free_lazy_functions();
+  return NULL;
+}
 
-  Program *prog = calloc(1, sizeof(Program));
-  prog->globals = globals;
-  prog->fns = head.next;
+// 関数nameが参照されたことを記録する
+// 本体のパースを後回しにしているstatic関数なら、パースを待つ関数に加える
+void use_function(char *name) {
+  ScopeEntry *ent = get_scope_entry(name, true);
+  ent->fn_used = true;
+  if (!ent->lazy_fn)
+    return;
+
+  LazyFunction *lf = arena_alloc(tu_arena, sizeof(LazyFunction));
+  lf->fn = ent->lazy_fn;
+  ent->lazy_fn = NULL;
+  if (lazy_head)
+    lazy_tail->next = lf;
+  else
+    lazy_head = lf;
+  lazy_tail = lf;
+}
+
+// 読み飛ばした関数本体に現れる識別子を、すべて関数の参照とみなして記録する
+// 本体をパースしないと本当に関数を参照しているかは分からないので、多めに見積もる
+void use_functions_in(Function *fn) {
+  for (int pos = fn->body_pos; pos < fn->body_end; pos++) {
+    Token *tok = token_at(pos);
+    if (tok->kind == TK_IDENT)
+      use_function(tok->ident);
+  }
+}
+
+// 最後まで参照されなかったstatic関数の本体を、エラーを見つけるためにパースだけして解放する
+// 最初に報告するエラーが毎回同じになるように、ソースの順にパースする
+// 先にすべてエントリから外しておくので、この本体から参照された関数がパースを待つ関数に加わることもない
+// この間に作られたグローバル変数(文字列リテラルなど)は、コードを生成しない関数のものなので出力しない
+void free_lazy_functions() {
+  for (LazyFunction *lf = skipped_head; lf; lf = lf->next) {
+    if (lf->ent->lazy_fn)
+      lf->ent->lazy_fn = NULL;
+    else
+      lf->fn = NULL;
+  }
 
+  VarList *vl = globals;
+  check_only = true;
+  for (LazyFunction *lf = skipped_head; lf; lf = lf->next) {
+    if (!lf->fn)
+      continue;
+    parse_body(lf->fn);
+    free_arena(lf->fn->arena);
+  }
+  check_only = false;
+  globals = vl;
+}
+
+// 入力の終わりまでパースした後に、プログラム全体に含まれるグローバル変数を返す
+Program *finish_program() {
+  Program *prog = arena_alloc(tu_arena, sizeof(Program));
+  prog->globals = globals;
   return prog;
 }
 
 Initializer *gvar_init_label(Initializer *cur, char *label, long addend) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_alloc(tu_arena, sizeof(Initializer));
   init->label = label;
   init->addend = addend;
   cur->next = init;
@@ -519,7 +817,7 @@ Initializer *gvar_init_label(Initializer *cur, char *label, long addend) {
 }
 
 Initializer *gvar_init_val(Initializer *cur, int size, int val) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_alloc(tu_arena, sizeof(Initializer));
   init->size = size;
   init->val = val;
   cur->next = init;
@@ -553,10 +851,10 @@ Initializer *emit_global_struct_padding(Initializer *cur, Type *parent, Member *
 //　　　　　　　　　　　| "{" (gvar-initializer2 ("," gvar-initializer2)* ","?)?) "}"
 // グローバル変数としては数値リテラルや文字列リテラルのような定数か、他のグローバル変数のアドレス( + 加数)のみが代入可能
 Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
-  if (ty->kind == TY_ARRAY && ty->ptr_to->kind == TY_CHAR && token->kind == TK_STR) {
+  if (ty->kind == TY_ARRAY && ty->ptr_to->kind == TY_CHAR && cur_token()->kind == TK_STR) {
     // 文字列のグローバル変数の初期化
-    Token *tok = token;
-    token = token->next;
+    Token *tok = cur_token();
+    token_pos++;
     if (ty->is_incomplete) {
       ty->size = tok->cont_len;
       ty->array_len = tok->cont_len;
@@ -581,15 +879,15 @@ Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
     // 配列のグローバル変数の初期化
 
     // `{}`付きかどうか
-    bool open = consume("{");
+    bool open = consume(TK_LBRACE);
     int i = 0;
     int limit = ty->is_incomplete ? INT_MAX : ty->array_len;
 
-    if (!peek("}")) {
+    if (!peek(TK_RBRACE)) {
       do {
         cur = gvar_initializer2(cur, ty->ptr_to);
         i++;
-      } while (i < limit && !peek_end() && consume(","));
+      } while (i < limit && !peek_end() && consume(TK_COMMA));
     }
 
     if (open)
@@ -607,15 +905,15 @@ Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
   }
 
   if (ty->kind == TY_STRUCT) {
-    bool open = consume("{");
+    bool open = consume(TK_LBRACE);
     Member *mem = ty->members;
 
-    if (!peek("}")) {
+    if (!peek(TK_RBRACE)) {
       do {
         cur = gvar_initializer2(cur, mem->ty);
         cur = emit_global_struct_padding(cur, ty, mem);
         mem = mem->next;
-      } while (mem && !peek_end() && consume(","));
+      } while (mem && !peek_end() && consume(TK_COMMA));
     }
 
     if (open)
@@ -628,7 +926,7 @@ Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
     return cur;
   }
 
-  bool open = consume("{");
+  bool open = consume(TK_LBRACE);
   // 右辺値
   Node *expr = conditional();
   if (open)
@@ -653,18 +951,12 @@ Initializer *gvar_initializer(Type *ty) {
 }
 
 // global-var = basetype declarator type-suffix ("=" gvar-initializer)? ";"
-void global_var() {
-  StorageClass sclass;
-  Type *ty = basetype(&sclass);
-  if (consume(";"))
-    return;
-
-  char *name = NULL;
-  ty = declarator(ty, &name);
+// basetype declarator は読んだ後で、その型がty、名前がname
+void global_var(Type *ty, char *name, StorageClass sclass) {
   ty = type_suffix(ty);
 
   if (sclass == TYPEDEF) {
-    expect(";");
+    expect(TK_SEMICOLON);
     push_var_scope(name)->type_def = ty;
     return;
   }
@@ -674,70 +966,192 @@ void global_var() {
 
   if (sclass == EXTERN) {
     var->is_extern = true;
-    expect(";");
+    expect(TK_SEMICOLON);
     return;
   }
 
-  if (consume("=")) {
+  if (consume(TK_ASSIGN)) {
     var->initializer = gvar_initializer(ty);
-    expect(";");
+    expect(TK_SEMICOLON);
     return;
   }
 
-  expect(";");
+  expect(TK_SEMICOLON);
 }
 
 // function = basetype declarator "(" params? ")" ("{" stmt* "}" | ";")
 // params = param ("," param)* | "void"
 // param = basetype declarator
-Function *function() {
+// basetype declarator "(" は読んだ後で、戻り値の型がty、名前がname
+Function *function(Type *ty, char *name, StorageClass sclass) {
   locals = NULL;
 
-  StorageClass sclass;
-  Type *ty = basetype(&sclass);
-  char *name = NULL;
-  ty = declarator(ty, &name);
-
   // 関数の名前と戻り値の型をスコープに追加する
   new_gvar(name, func_type(ty), false, false);
 
-  Function *fn = calloc(1, sizeof(Function));
+  // 関数自体と関数本体のNode・ローカル変数は、関数ごとの領域に確保する
+  // コードを生成したら領域ごと解放する
+  Arena *arena = new_arena("function");
+  Function *fn = arena_alloc(arena, sizeof(Function));
+  fn->arena = arena;
   fn->name = name;
+  fn->return_ty = ty;
   fn->is_static = (sclass == STATIC);
-
-  expect("(");
+  fn_arena = fn->arena;
 
   Scope *sc = enter_scope();
   read_func_params(fn);
+  leave_scope(sc);
+  fn->locals = locals;
+  fn_arena = tu_arena;
 
-  if (consume(";")) {
-    leave_scope(sc);
+  if (consume(TK_SEMICOLON)) {
+    free_arena(fn->arena);
     return NULL;
   }
 
-  expect("{");
+  fn->body_pos = token_pos;
+  fn->var_scope = var_scope;
+  fn->tag_scope = tag_scope;
+
+  // まだ参照されていないstatic関数は本体を読み飛ばしておき、参照された時にパースする
+  // 参照された時にuse_function()がパースを待つ関数に加える
+  ScopeEntry *ent = get_scope_entry(name, true);
+  if (fn->is_static && !ent->fn_used) {
+    skip_body();
+    fn->body_end = token_pos;
+    // 本体を読み飛ばしている間はトークンを回収しないので、コピーしなくてよい
+    if (!skim_bodies)
+      fn->tokens = save_tokens(fn->body_pos, fn->body_end, fn->arena);
+    ent->lazy_fn = fn;
+
+    LazyFunction *lf = arena_alloc(tu_arena, sizeof(LazyFunction));
+    lf->fn = fn;
+    lf->ent = ent;
+    if (skipped_head)
+      skipped_tail->next = lf;
+    else
+      skipped_head = lf;
+    skipped_tail = lf;
+    return NULL;
+  }
+
+  if (skim_bodies) {
+    // 本体は後でparse_body()でパースする。ここでは対応する"}"まで読み飛ばす
+    skip_body();
+    fn->body_end = token_pos;
+    use_functions_in(fn);
+    return fn;
+  }
+
+  parse_body(fn);
+  token_pos = fn->body_end;
+  return fn;
+}
+
+// "{"から対応する"}"までのトークンを読み飛ばす
+void skip_body() {
+  Token *start = cur_token();
+  int depth = 0;
+  do {
+    switch (cur_token()->kind) {
+      case TK_LBRACE:
+        depth++;
+        break;
+      case TK_RBRACE:
+        depth--;
+        break;
+      case TK_EOF:
+        error_at(start->str, "'}'がありません");
+    }
+    token_pos++;
+  } while (depth > 0);
+}
+
+// 関数本体("{" stmt* "}")をfn->body_posからパースする
+// 読み飛ばしておいた本体を後でパースする場合も、本体から見えるのは本体より前のトップレベルの宣言だけにする
+// トップレベルのスコープはその状態のまま戻さないので、続けてトップレベルをパースする時は呼び出し側で戻す
+void parse_body(Function *fn) {
+  set_global_scope(fn->var_scope, fn->tag_scope);
+
+  int pos = token_pos;
+  token_pos = fn->body_pos;
+  if (fn->tokens)
+    read_saved_tokens(fn->tokens, fn->body_pos, fn->body_end - fn->body_pos);
+  locals = fn->locals;
+  fn_arena = fn->arena;
+
+  // パース中のNodeは作業用の領域に確保し、パースし終えたら前順に並べ直してfn->arenaにコピーする
+  NodePool *tu_nodes = get_node_pool();
+  Arena *scratch = new_arena("parse");
+  set_node_pool(new_node_pool(scratch));
+
+  // 引数をスコープに戻す
+  Scope *sc = enter_scope();
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    push_var_scope(vl->var->name)->var = vl->var;
+
+  expect(TK_LBRACE);
 
   // stmtを連結リストで管理
   Node head = {};
   Node *cur = &head;
 
-  while (!consume("}")) {
-    cur->next = stmt();
-    cur = cur->next;
+  while (!consume(TK_RBRACE)) {
+    cur->next = node_id(stmt());
+    cur = node_at(cur->next);
   }
   // スコープを戻す
   leave_scope(sc);
 
   fn->node = head.next;
+  if (!check_only)
+    fn->nodes = preorder_nodes(&fn->node, fn->arena);
   fn->locals = locals;
-  return fn;
+  fn_arena = tu_arena;
+  free_arena(scratch);
+  set_node_pool(tu_nodes);
+
+  fn->body_end = token_pos;
+  token_pos = pos;
+  if (fn->tokens)
+    read_saved_tokens(NULL, 0, 0);
+}
+
+// trueにすると、以降のfunction()は関数本体を読み飛ばしてその位置だけを記録する
+// 本体はparse_body()でパースする
+void skim_function_bodies(bool skim) {
+  skim_bodies = skim;
+}
+
+// メンバの多い構造体に、メンバを名前で引くハッシュ表を作る
+// メンバが少なければ連結リストをたどる方が速いので作らない
+void build_member_table(Type *ty) {
+  int n = 0;
+  for (Member *mem = ty->members; mem; mem = mem->next)
+    n++;
+  if (n < 8)
+    return;
+
+  int cap = 16;
+  while (cap < n * 2)
+    cap = cap * 2;
+  ty->member_table = arena_alloc(tu_arena, sizeof(Member *) * cap);
+  ty->member_table_cap = cap;
+
+  for (Member *mem = ty->members; mem; mem = mem->next) {
+    int h = name_hash(mem->name) & (cap - 1);
+    while (ty->member_table[h])
+      h = (h + 1) & (cap - 1);
+    ty->member_table[h] = mem;
+  }
 }
 
 // struct-decl = "struct" ident? ("{" struct-member "}")?
 Type *struct_decl() {
-  expect("struct");
+  expect(TK_STRUCT);
   Token *tag = consume_ident(); // 構造体タグ
-  if (tag && !peek("{")) { // 構造体タグを用いた宣言のとき
+  if (tag && !peek(TK_LBRACE)) { // 構造体タグを用いた宣言のとき
     TagScope *sc = find_tag(tag);
 
     if (!sc) {
@@ -751,7 +1165,7 @@ Type *struct_decl() {
   }
 
   // `struct *foo` は無名の不完全構造体へのポインタになる
-  if (!consume("{"))
+  if (!consume(TK_LBRACE))
     return struct_type();
 
   Type *ty;
@@ -776,7 +1190,7 @@ Type *struct_decl() {
   Member head = {};
   Member *cur = &head;
 
-  while (!consume("}")) {
+  while (!consume(TK_RBRACE)) {
     cur->next = struct_member();
     cur = cur->next;
   }
@@ -797,6 +1211,7 @@ Type *struct_decl() {
   ty->size = align_to(offset, ty->align);
 
   ty->is_incomplete = false;
+  build_member_table(ty);
 
   return ty;
 }
@@ -806,9 +1221,9 @@ Member *struct_member() {
   Type *ty = basetype(NULL);
   char *name = NULL;
   ty = declarator(ty, &name);
-  expect(";");
+  expect(TK_SEMICOLON);
 
-  Member *mem = calloc(1, sizeof(Member));
+  Member *mem = arena_alloc(tu_arena, sizeof(Member));
   mem->name = name;
   mem->ty = ty;
   return mem;
@@ -817,37 +1232,33 @@ Member *struct_member() {
 // リストの最後ならtrue、そうでないならfalseを返す
 // ケツカンマありの場合にも対応
 static bool consume_end(void) {
-  Token *tok = token;
-  if (consume("}") || (consume(",") && consume("}")))
-    return true;
-  token = tok;
-  return false;
+  if (!peek_end())
+    return false;
+  token_pos += peek(TK_COMMA) ? 2 : 1;
+  return true;
 }
 
 bool peek_end() {
-  Token *tok = token;
-  bool ret = consume("}") || (consume(",") && consume("}"));
-  token = tok;
-  return ret;
+  return peek(TK_RBRACE) || (peek(TK_COMMA) && token_at(token_pos + 1)->kind == TK_RBRACE);
 }
 
 void expect_end() {
   if (!consume_end())
-    error_at(token->str, "リストの最後ではありません");
+    error_at(cur_token()->str, "リストの最後ではありません");
 }
 
 // enum-specifier = "enum" ident
 //                | "enum" ident? "{" enum-list? "}"
 // enum-list = ident ("=" const-expr)? ("," ident ("=" const-expr)?)* ","?
 Type *enum_specifier() {
-  expect("enum");
+  expect(TK_ENUM);
   Type *ty = enum_type();
 
   Token *tag = consume_ident();
 
   // すでに宣言済みのenumを指定する場合
   // ex.) enum Foo bar;
-  if (tag && !peek("{")) {
+  if (tag && !peek(TK_LBRACE)) {
     TagScope *sc = find_tag(tag);
     if (!sc)
       error_at(tag->str, "enumが宣言されていません");
@@ -858,11 +1269,11 @@ Type *enum_specifier() {
 
   // 新しいenumを宣言する場合
   // ex.) enum Foo { A, B, C };
-  expect("{");
+  expect(TK_LBRACE);
   int cnt = 0;
   for (;;) {
     char *name = expect_ident();
-    if (consume("="))
+    if (consume(TK_ASSIGN))
       cnt = const_expr();
 
     VarScope *sc = push_var_scope(name);
@@ -874,7 +1285,7 @@ Type *enum_specifier() {
 
     if (consume_end())
       break;
-    expect(",");
+    expect(TK_COMMA);
   }
 
   if (tag) {
@@ -888,7 +1299,7 @@ Type *enum_specifier() {
 // "typedef" / "static" (ストレージクラス指定子)はbasetypeのどこにでも現れうる
 Type *basetype(StorageClass *sclass) {
   if (!is_typename())
-    error_at(token->str, "型名ではありません");
+    error_at(cur_token()->str, "型名ではありません");
 
   enum {
     VOID = 1 << 0,
@@ -909,35 +1320,38 @@ Type *basetype(StorageClass *sclass) {
     *sclass = 0;
 
   while (is_typename()) {
-    if (peek("typedef") || peek("static") || peek("extern")) {
+    TokenKind kind = cur_token()->kind;
+
+    if (kind == TK_TYPEDEF || kind == TK_STATIC || kind == TK_EXTERN) {
       if (!sclass)
-        error_at(token->str, "ストレージクラス指定子はここでは使えません");
+        error_at(cur_token()->str, "ストレージクラス指定子はここでは使えません");
 
-      if (consume("typedef"))
+      token_pos++;
+      if (kind == TK_TYPEDEF)
         *sclass |= TYPEDEF;
-      else if (consume("static"))
+      else if (kind == TK_STATIC)
         *sclass |= STATIC;
-      else if (consume("extern"))
+      else
         *sclass |= EXTERN;
 
       if (*sclass & (*sclass - 1))
-        error_at(token->str, "typedef,static,externは一緒に使えません");
+        error_at(cur_token()->str, "typedef,static,externは一緒に使えません");
       continue;
     }
 
     // ユーザーが定義した型を探す
-    if (!peek("void") && !peek("_Bool") && !peek("char") && !peek("short") && !peek("int") && !peek("long")) {
+    if (kind == TK_STRUCT || kind == TK_ENUM || kind == TK_IDENT) {
       if (counter)
         break; // ユーザーが定義した型は他の型と組み合わせることができない
 
-      if (peek("struct")) {
+      if (kind == TK_STRUCT) {
         ty = struct_decl();
-      } else if (peek("enum")) {
+      } else if (kind == TK_ENUM) {
         ty = enum_specifier();
       } else {
-        ty = find_typedef(token);
+        ty = find_typedef(cur_token());
         assert(ty);
-        token = token->next;
+        token_pos++;
       }
 
       counter |= OTHER;
@@ -945,18 +1359,27 @@ Type *basetype(StorageClass *sclass) {
     }
 
     // ビルトインの型を探す
-    if (consume("char"))
-      counter += CHAR;
-    else if (consume("int"))
-      counter += INT;
-    else if (consume("short"))
-      counter += SHORT;
-    else if (consume("long"))
-      counter += LONG;
-    else if (consume("void"))
-      counter += VOID;
-    else if (consume("_Bool"))
-      counter += BOOL;
+    token_pos++;
+    switch (kind) {
+      case TK_CHAR:
+        counter += CHAR;
+        break;
+      case TK_INT:
+        counter += INT;
+        break;
+      case TK_SHORT:
+        counter += SHORT;
+        break;
+      case TK_LONG:
+        counter += LONG;
+        break;
+      case TK_VOID:
+        counter += VOID;
+        break;
+      case TK_BOOL:
+        counter += BOOL;
+        break;
+    }
 
     switch (counter) {
       case VOID:
@@ -982,7 +1405,7 @@ Type *basetype(StorageClass *sclass) {
         ty = long_type;
         break;
       default:
-        error_at(token->str, "無効な型です");
+        error_at(cur_token()->str, "無効な型です");
     }
   }
 
@@ -990,23 +1413,36 @@ Type *basetype(StorageClass *sclass) {
       ty;
 }
 
+// 型tyの中のplaceholderをrealに置き換えた型を返す
+// 派生型は共有しているので、placeholderを書き換えるのではなく型を作り直す
+Type *replace_placeholder(Type *ty, Type *placeholder, Type *real) {
+  if (ty == placeholder)
+    return real;
+
+  Type *base = replace_placeholder(ty->ptr_to, placeholder, real);
+  if (ty->kind == TY_PTR)
+    return pointer_to(base);
+  if (ty->is_incomplete)
+    return incomplete_array_of(base);
+  return array_of(base, ty->array_len);
+}
+
 // declarator = "*"* ("(" declarator ")" | ident) type-suffix
 // ex.) int *x[3];
 //      int (*x)[3];
 // http://enakai00.hatenablog.com/entry/20110808/1312783316
 Type *declarator(Type *ty, char **name) {
-  while (consume("*"))
+  while (consume(TK_STAR))
     ty = pointer_to(ty);
 
-  if (consume("(")) {
+  if (consume(TK_LPAREN)) {
     // 例えば、int (*x)[3] をパースするとき
     // *new_ty は placeholderへのポインタ型になり、*nameは "x" になる
-    // memcpy で placeholder をint型に更新している
-    Type *placeholder = calloc(1, sizeof(Type));
+    // 最後に placeholder を int[3] に置き換えた型を作り直す
+    Type *placeholder = arena_alloc(tu_arena, sizeof(Type));
     Type *new_ty = declarator(placeholder, name);
-    expect(")");
-    memcpy(placeholder, type_suffix(ty), sizeof(Type));
-    return new_ty;
+    expect(TK_RPAREN);
+    return replace_placeholder(new_ty, placeholder, type_suffix(ty));
   }
 
   *name = expect_ident();
@@ -1016,15 +1452,14 @@ Type *declarator(Type *ty, char **name) {
 // abstract-declarator = "*"* ("(" abstarct-declarator ")")? type-suffix
 // 例えば、`sizeof(int **);`をparseする時に現れる
 Type *abstract_declarator(Type *ty) {
-  while (consume("*"))
+  while (consume(TK_STAR))
     ty = pointer_to(ty);
 
-  if (consume("(")) {
-    Type *placeholder = calloc(1, sizeof(Type));
+  if (consume(TK_LPAREN)) {
+    Type *placeholder = arena_alloc(tu_arena, sizeof(Type));
     Type *new_ty = abstract_declarator(placeholder);
-    expect(")");
-    memcpy(placeholder, type_suffix(ty), sizeof(Type));
-    return new_ty;
+    expect(TK_RPAREN);
+    return replace_placeholder(new_ty, placeholder, type_suffix(ty));
   }
 
   return type_suffix(ty);
@@ -1054,172 +1489,181 @@ Node *stmt(void) {
 //      | declaration
 //      | ";"
 Node *stmt2() {
-  if (consume("return")) {
-    if (consume(";"))
-      return new_node(ND_RETURN, NULL, NULL);
-
-    Node *node = new_node_return(expr());
-    expect(";");
-    return node;
-  }
-
-  if (consume("if")) {
-    Node *node = new_node_if();
-
-    expect("(");
-    node->cond = expr();
-    expect(")");
-    node->then = stmt();
-
-    if (consume("else"))
-      node->els = stmt();
-
-    return node;
-  }
+  switch (cur_token()->kind) {
+    case TK_RETURN: {
+      token_pos++;
+      if (consume(TK_SEMICOLON))
+        return new_node(ND_RETURN, NULL, NULL);
+
+      Node *node = new_node_return(expr());
+      expect(TK_SEMICOLON);
+      return node;
+    }
+    case TK_IF: {
+      token_pos++;
+      Node *node = new_node_if();
+      NodeExt *ext = alloc_node_ext(node);
 
-  if (consume("while")) {
-    Node *node = new_node_while();
+      expect(TK_LPAREN);
+      ext->cond = node_id(expr());
+      expect(TK_RPAREN);
+      ext->then = node_id(stmt());
 
-    expect("(");
-    node->cond = expr();
-    expect(")");
-    node->then = stmt();
-    return node;
-  }
+      if (consume(TK_ELSE))
+        ext->els = node_id(stmt());
 
-  if (consume("for")) {
-    Node *node = new_node_for();
+      return node;
+    }
+    case TK_WHILE: {
+      token_pos++;
+      Node *node = new_node_while();
+      NodeExt *ext = alloc_node_ext(node);
+
+      expect(TK_LPAREN);
+      ext->cond = node_id(expr());
+      expect(TK_RPAREN);
+      ext->then = node_id(stmt());
+      return node;
+    }
+    case TK_FOR: {
+      token_pos++;
+      Node *node = new_node_for();
+      NodeExt *ext = alloc_node_ext(node);
+
+      expect(TK_LPAREN);
+      Scope *sc = enter_scope();
+
+      if (!consume(TK_SEMICOLON)) {
+        if (is_typename())
+          ext->init = node_id(declaration());
+        else {
+          ext->init = node_id(read_expr_stmt());
+          expect(TK_SEMICOLON);
+        }
+      }
 
-    expect("(");
-    Scope *sc = enter_scope();
+      if (!consume(TK_SEMICOLON)) {
+        ext->cond = node_id(expr());
+        expect(TK_SEMICOLON);
+      }
 
-    if (!consume(";")) {
-      if (is_typename())
-        node->init = declaration();
-      else {
-        node->init = read_expr_stmt();
-        expect(";");
+      if (!consume(TK_RPAREN)) {
+        ext->inc = node_id(read_expr_stmt());
+        expect(TK_RPAREN);
       }
-    }
 
-    if (!consume(";")) {
-      node->cond = expr();
-      expect(";");
+      ext->then = node_id(stmt());
+      leave_scope(sc);
+      return node;
     }
-
-    if (!consume(")")) {
-      node->inc = read_expr_stmt();
-      expect(")");
+    case TK_DO: {
+      token_pos++;
+      Node *node = new_node(ND_DO, NULL, NULL);
+      NodeExt *ext = alloc_node_ext(node);
+      ext->then = node_id(stmt());
+      expect(TK_WHILE);
+      expect(TK_LPAREN);
+      ext->cond = node_id(expr());
+      expect(TK_RPAREN);
+      expect(TK_SEMICOLON);
+      return node;
     }
+    case TK_LBRACE: {
+      token_pos++;
+      Node *node = new_node_block();
+
+      // ブロックに含まれるstmtを連結リストで管理
+      Node head = {};
+      Node *cur = &head;
+
+      Scope *sc = enter_scope();
+      while (!consume(TK_RBRACE)) {
+        cur->next = node_id(stmt());
+        cur = node_at(cur->next);
+      }
+      leave_scope(sc);
 
-    node->then = stmt();
-    leave_scope(sc);
-    return node;
-  }
-
-  if (consume("do")) {
-    Node *node = new_node(ND_DO, NULL, NULL);
-    node->then = stmt();
-    expect("while");
-    expect("(");
-    node->cond = expr();
-    expect(")");
-    expect(";");
-    return node;
-  }
-
-  if (consume("{")) {
-    Node *node = new_node_block();
-
-    // ブロックに含まれるstmtを連結リストで管理
-    Node head = {};
-    Node *cur = &head;
-
-    Scope *sc = enter_scope();
-    while (!consume("}")) {
-      cur->next = stmt();
-      cur = cur->next;
+      alloc_node_ext(node)->body = head.next;
+      return node;
     }
-    leave_scope(sc);
-
-    node->body = head.next;
-    return node;
-  }
-
-  if (consume("break")) {
-    expect(";");
-    return new_node(ND_BREAK, NULL, NULL);
-  }
-
-  if (consume("continue")) {
-    expect(";");
-    return new_node(ND_CONTINUE, NULL, NULL);
-  }
-
-  if (consume("goto")) {
-    Node *node = new_node(ND_GOTO, NULL, NULL);
-    node->label_name = expect_ident();
-    expect(";");
-    return node;
-  }
-
-  if (consume("switch")) {
-    Node *node = new_node(ND_SWITCH, NULL, NULL);
-    expect("(");
-    node->cond = expr();
-    expect(")");
-
-    Node *sw = current_switch;
-    current_switch = node;
-    node->then = stmt();
-    // switch文内のパースが終わったらcurrent_switchを戻す
-    current_switch = sw;
-    return node;
-  }
-
-  if (consume("case")) {
-    if (!current_switch)
-      error_at(token->str, "switch文が見つかりません");
-
-    int val = const_expr();
-    expect(":");
-
-    Node *node = new_node_unary(ND_CASE, stmt());
-    node->val = val;
-    node->case_next = current_switch->case_next;
-    current_switch->case_next = node;
-    return node;
+    case TK_BREAK:
+      token_pos++;
+      expect(TK_SEMICOLON);
+      return new_node(ND_BREAK, NULL, NULL);
+    case TK_CONTINUE:
+      token_pos++;
+      expect(TK_SEMICOLON);
+      return new_node(ND_CONTINUE, NULL, NULL);
+    case TK_GOTO: {
+      token_pos++;
+      Node *node = new_node(ND_GOTO, NULL, NULL);
+      alloc_node_ext(node)->label_name = expect_ident();
+      expect(TK_SEMICOLON);
+      return node;
+    }
+    case TK_SWITCH: {
+      token_pos++;
+      Node *node = new_node(ND_SWITCH, NULL, NULL);
+      NodeExt *ext = alloc_node_ext(node);
+      expect(TK_LPAREN);
+      ext->cond = node_id(expr());
+      expect(TK_RPAREN);
+
+      Node *sw = current_switch;
+      current_switch = node;
+      ext->then = node_id(stmt());
+      // switch文内のパースが終わったらcurrent_switchを戻す
+      current_switch = sw;
+      return node;
+    }
+    case TK_CASE: {
+      token_pos++;
+      if (!current_switch)
+        error_at(cur_token()->str, "switch文が見つかりません");
+
+      int val = const_expr();
+      expect(TK_COLON);
+
+      Node *node = new_node_unary(ND_CASE, stmt());
+      node->val = val;
+      NodeExt *sw_ext = alloc_node_ext(current_switch);
+      alloc_node_ext(node)->case_next = sw_ext->case_next;
+      sw_ext->case_next = node->id;
+      return node;
+    }
+    case TK_DEFAULT: {
+      token_pos++;
+      if (!current_switch)
+        error_at(cur_token()->str, "switch文が見つかりません");
+      expect(TK_COLON);
+
+      Node *node = new_node_unary(ND_CASE, stmt());
+      // コード生成がcase_labelを書き込むので、defaultのcaseにもNodeExtを確保しておく
+      alloc_node_ext(node);
+      alloc_node_ext(current_switch)->default_case = node->id;
+      return node;
+    }
+    case TK_SEMICOLON:
+      token_pos++;
+      return new_node_null();
+    default:
+      break;
   }
 
-  if (consume("default")) {
-    if (!current_switch)
-      error_at(token->str, "switch文が見つかりません");
-    expect(":");
-
-    Node *node = new_node_unary(ND_CASE, stmt());
-    current_switch->default_case = node;
+  // 識別子の次のトークンが":"ならラベル
+  Token *tok = peek(TK_IDENT);
+  if (tok && token_at(token_pos + 1)->kind == TK_COLON) {
+    token_pos += 2;
+    Node *node = new_node_unary(ND_LABEL, stmt());
+    alloc_node_ext(node)->label_name = tok->ident;
     return node;
   }
 
-  if (consume(";"))
-    return new_node_null();
-
-  Token *tok;
-  if ((tok = consume_ident())) {
-    if (consume(":")) {
-      Node *node = new_node_unary(ND_LABEL, stmt());
-      node->label_name = strndup(tok->str, tok->len);
-      return node;
-    }
-    // ラベル付きstatementじゃなかったらtokenを戻す
-    token = tok;
-  }
-
   if (is_typename())
     return declaration();
 
   Node *node = read_expr_stmt();
-  expect(";");
+  expect(TK_SEMICOLON);
   return node;
 }
 
@@ -1241,7 +1685,7 @@ Node *new_node_desg2(Var *var, Designator *desg) {
 
   if (desg->mem) {
     node = new_node_unary(ND_MEMBER, node);
-    node->member = desg->mem;
+    alloc_node_ext(node)->member = desg->mem;
     return node;
   }
 
@@ -1267,17 +1711,17 @@ Node *lvar_init_zero(Node *cur, Var *var, Type *ty, Designator *desg) {
     return cur;
   }
 
-  cur->next = new_node_desg(var, desg, new_node_num(0));
-  return cur->next;
+  cur->next = node_id(new_node_desg(var, desg, new_node_num(0)));
+  return node_at(cur->next);
 }
 
 // lvar-initializer2 = assign
 //                   | "{" (lvar-initializer2 ("," lvar-initializer2)* ","?)? "}"
 Node *lvar_initializer2(Node *cur, Var *var, Type *ty, Designator *desg) {
-  if (ty->kind == TY_ARRAY && ty->ptr_to->kind == TY_CHAR && token->kind == TK_STR) {
+  if (ty->kind == TY_ARRAY && ty->ptr_to->kind == TY_CHAR && cur_token()->kind == TK_STR) {
 // 例えば char x[4]="foo" は char x[4] = {'f', 'o', 'o', '\0'} に変換する
-    Token *tok = token;
-    token = token->next;
+    Token *tok = cur_token();
+    token_pos++;
 
 //  左辺が不完全型の場合は、型の大きさは右辺値によって決まる
     if (ty->is_incomplete) {
@@ -1290,8 +1734,8 @@ Node *lvar_initializer2(Node *cur, Var *var, Type *ty, Designator *desg) {
     for (int i = 0; i < len; i++) {
       Designator desg2 = {desg, i};
       Node *rhs = new_node_num(tok->contents[i]);
-      cur->next = new_node_desg(var, &desg2, rhs);
-      cur = cur->next;
+      cur->next = node_id(new_node_desg(var, &desg2, rhs));
+      cur = node_at(cur->next);
     }
 
 //  明示的に初期化されていない要素を0で埋める
@@ -1316,15 +1760,15 @@ Node *lvar_initializer2(Node *cur, Var *var, Type *ty, Designator *desg) {
 //
 // 配列の初期化について、詳しくはここ↓
 // https://drive.google.com/file/d/1LIn5ikBwvs4RjMD65ilLeKhHB7BaHPMg/view?usp=sharing
-    bool open = consume("{");
+    bool open = consume(TK_LBRACE);
     int i = 0;
     int limit = ty->is_incomplete ? INT_MAX : ty->array_len;
 
-    if (!peek("}")) {
+    if (!peek(TK_RBRACE)) {
       do {
         Designator desg2 = {desg, i++};
         cur = lvar_initializer2(cur, var, ty->ptr_to, &desg2);
-      } while (i < limit && !peek_end() && consume(","));
+      } while (i < limit && !peek_end() && consume(TK_COMMA));
     }
 
     if (open)
@@ -1352,15 +1796,15 @@ Node *lvar_initializer2(Node *cur, Var *var, Type *ty, Designator *desg) {
 //   x.a = 1;
 //   x.b = 2;
 // }
-    bool open = consume("{");
+    bool open = consume(TK_LBRACE);
     Member *mem = ty->members;
 
-    if (!peek("}")) {
+    if (!peek(TK_RBRACE)) {
       do {
         Designator desg2 = {desg, 0, mem};
         cur = lvar_initializer2(cur, var, mem->ty, &desg2);
         mem = mem->next;
-      } while (mem && !peek_end() && consume(","));
+      } while (mem && !peek_end() && consume(TK_COMMA));
     }
 
     if (open)
@@ -1375,11 +1819,11 @@ Node *lvar_initializer2(Node *cur, Var *var, Type *ty, Designator *desg) {
     return cur;
   }
 
-  bool open = consume("{");
-  cur->next = new_node_desg(var, desg, assign());
+  bool open = consume(TK_LBRACE);
+  cur->next = node_id(new_node_desg(var, desg, assign()));
   if (open)
     expect_end();
-  return cur->next;
+  return node_at(cur->next);
 }
 
 // lvar-initializer = lvar-initializer2
@@ -1387,7 +1831,7 @@ Node *lvar_initializer(Var *lvar) {
   Node head = {};
   lvar_initializer2(&head, lvar, lvar->ty, NULL);
   Node *node = new_node(ND_BLOCK, NULL, NULL);
-  node->body = head.next;
+  alloc_node_ext(node)->body = head.next;
   return node;
 }
 
@@ -1396,7 +1840,7 @@ Node *declaration() {
   StorageClass sclass;
   Type *ty = basetype(&sclass);
 
-  if (consume(";"))
+  if (consume(TK_SEMICOLON))
     return new_node_null();
 
   char *name = NULL;
@@ -1404,7 +1848,7 @@ Node *declaration() {
   ty = type_suffix(ty);
 
   if (sclass == TYPEDEF) {
-    expect(";");
+    expect(TK_SEMICOLON);
     push_var_scope(name)->type_def = ty;
     return new_node_null();
   }
@@ -1414,23 +1858,23 @@ Node *declaration() {
     Var *var = new_gvar(new_label(), ty, true, true);
     push_var_scope(name)->var = var;
 
-    if (consume("="))
+    if (consume(TK_ASSIGN))
       var->initializer = gvar_initializer(ty);
     else if (ty->is_incomplete)
-      error_at(token->str, "不完全な型です");
-    consume(";");
+      error_at(cur_token()->str, "不完全な型です");
+    consume(TK_SEMICOLON);
 
     return new_node_null();
   }
 
   Var *lvar = new_lvar(name, ty);
 
-  if (consume(";"))
+  if (consume(TK_SEMICOLON))
     return new_node_null();
 
-  expect("=");
+  expect(TK_ASSIGN);
   Node *node = lvar_initializer(lvar);
-  expect(";");
+  expect(TK_SEMICOLON);
   return node;
 }
 
@@ -1439,7 +1883,7 @@ Node *declaration() {
 Node *expr() {
   Node *node = assign();
 
-  while (consume(",")) {
+  while (consume(TK_COMMA)) {
     node = new_node_unary(ND_EXPR_STMT, node);
     node = new_node_comma(node, assign());
   }
@@ -1452,16 +1896,16 @@ Node *expr() {
 Node *assign() {
   Node *node = conditional();
 
-  if (consume("="))
+  if (consume(TK_ASSIGN))
     return new_node(ND_ASSIGN, node, assign());
 
-  if (consume("*="))
+  if (consume(TK_MUL_ASSIGN))
     return new_node(ND_MUL_EQ, node, assign());
 
-  if (consume("/="))
+  if (consume(TK_DIV_ASSIGN))
     return new_node(ND_DIV_EQ, node, assign());
 
-  if (consume("+=")) {
+  if (consume(TK_ADD_ASSIGN)) {
     add_type(node);
     if (node->ty->ptr_to)
       return new_node(ND_PTR_ADD_EQ, node, assign());
@@ -1469,7 +1913,7 @@ Node *assign() {
       return new_node(ND_ADD_EQ, node, assign());
   }
 
-  if (consume("-=")) {
+  if (consume(TK_SUB_ASSIGN)) {
     add_type(node);
     if (node->ty->ptr_to)
       return new_node(ND_PTR_SUB_EQ, node, assign());
@@ -1477,23 +1921,23 @@ Node *assign() {
       return new_node(ND_SUB_EQ, node, assign());
   }
 
-  if (consume("&=")) {
+  if (consume(TK_AND_ASSIGN)) {
     return new_node(ND_BITAND_EQ, node, assign());
   }
 
-  if (consume("|=")) {
+  if (consume(TK_OR_ASSIGN)) {
     return new_node(ND_BITOR_EQ, node, assign());
   }
 
-  if (consume("^=")) {
+  if (consume(TK_XOR_ASSIGN)) {
     return new_node(ND_BITXOR_EQ, node, assign());
   }
 
-  if (consume("<<=")) {
+  if (consume(TK_SHL_ASSIGN)) {
     return new_node(ND_SHL_EQ, node, assign());
   }
 
-  if (consume(">>=")) {
+  if (consume(TK_SHR_ASSIGN)) {
     return new_node(ND_SHR_EQ, node, assign());
   }
 
@@ -1503,14 +1947,15 @@ Node *assign() {
 // conditional = logor ("?" expr ":" conditional)?
 Node *conditional() {
   Node *node = logor();
-  if (!consume("?"))
+  if (!consume(TK_QUESTION))
     return node;
 
   Node *ternary = new_node(ND_TERNARY, NULL, NULL);
-  ternary->cond = node;
-  ternary->then = expr();
-  expect(":");
-  ternary->els = conditional();
+  NodeExt *ext = alloc_node_ext(ternary);
+  ext->cond = node_id(node);
+  ext->then = node_id(expr());
+  expect(TK_COLON);
+  ext->els = node_id(conditional());
   return ternary;
 }
 
@@ -1526,63 +1971,65 @@ long eval(Node *node) {
 long eval2(Node *node, Var **var) {
   switch (node->kind) {
     case ND_ADD:
-      return eval(node->lhs) + eval(node->rhs);
+      return eval(node_at(node->lhs)) + eval(node_at(node->rhs));
     case ND_PTR_ADD:
-      return eval2(node->lhs, var) + eval(node->rhs);
+      return eval2(node_at(node->lhs), var) + eval(node_at(node->rhs));
     case ND_SUB:
-      return eval(node->lhs) - eval(node->rhs);
+      return eval(node_at(node->lhs)) - eval(node_at(node->rhs));
     case ND_PTR_SUB:
-      return eval2(node->lhs, var) - eval(node->rhs);
+      return eval2(node_at(node->lhs), var) - eval(node_at(node->rhs));
     case ND_PTR_DIFF:
-      return eval2(node->lhs, var) - eval2(node->lhs, var);
+      return eval2(node_at(node->lhs), var) - eval2(node_at(node->lhs), var);
     case ND_MUL:
-      return eval(node->lhs) * eval(node->rhs);
+      return eval(node_at(node->lhs)) * eval(node_at(node->rhs));
     case ND_DIV:
-      return eval(node->lhs) / eval(node->rhs);
+      return eval(node_at(node->lhs)) / eval(node_at(node->rhs));
     case ND_BITAND:
-      return eval(node->lhs) & eval(node->rhs);
+      return eval(node_at(node->lhs)) & eval(node_at(node->rhs));
     case ND_BITOR:
-      return eval(node->lhs) | eval(node->rhs);
+      return eval(node_at(node->lhs)) | eval(node_at(node->rhs));
     case ND_BITXOR:
-      return eval(node->lhs) ^ eval(node->rhs);
+      return eval(node_at(node->lhs)) ^ eval(node_at(node->rhs));
     case ND_SHL:
-      return eval(node->lhs) << eval(node->rhs);
+      return eval(node_at(node->lhs)) << eval(node_at(node->rhs));
     case ND_SHR:
-      return eval(node->lhs) >> eval(node->rhs);
+      return eval(node_at(node->lhs)) >> eval(node_at(node->rhs));
     case ND_EQ:
-      return eval(node->lhs) == eval(node->rhs);
+      return eval(node_at(node->lhs)) == eval(node_at(node->rhs));
     case ND_NE:
-      return eval(node->lhs) != eval(node->rhs);
+      return eval(node_at(node->lhs)) != eval(node_at(node->rhs));
     case ND_LT:
-      return eval(node->lhs) < eval(node->rhs);
+      return eval(node_at(node->lhs)) < eval(node_at(node->rhs));
     case ND_LE:
-      return eval(node->lhs) <= eval(node->rhs);
-    case ND_TERNARY:
-      return eval(node->cond) ? eval(node->then) : eval(node->els);
+      return eval(node_at(node->lhs)) <= eval(node_at(node->rhs));
+    case ND_TERNARY: {
+      NodeExt *ext = node_ext(node);
+      return eval(node_at(ext->cond)) ? eval(node_at(ext->then)) : eval(node_at(ext->els));
+    }
     case ND_COMMA:
-      return eval(node->rhs);
+      return eval(node_at(node->rhs));
     case ND_NOT:
-      return !eval(node->lhs);
+      return !eval(node_at(node->lhs));
     case ND_BIT_NOT:
-      return ~eval(node->lhs);
+      return ~eval(node_at(node->lhs));
     case ND_LOGAND:
-      return eval(node->lhs) && eval(node->rhs);
+      return eval(node_at(node->lhs)) && eval(node_at(node->rhs));
     case ND_LOGOR:
-      return eval(node->lhs) || eval(node->rhs);
+      return eval(node_at(node->lhs)) || eval(node_at(node->rhs));
     case ND_NUM:
       return node->val;
     case ND_ADDR:
-      if (!var || *var || node->lhs->kind != ND_VAR || node->lhs->var->is_local)
-        error_at(token->str, "無効な初期化式です");
-      *var = node->lhs->var;
+      if (!var || *var || node_at(node->lhs)->kind != ND_VAR || node_at(node->lhs)->var->is_local)
+        error_at(cur_token()->str, "無効な初期化式です");
+      *var = node_at(node->lhs)->var;
       return 0;
     case ND_VAR:
       if (!var || *var || node->var->ty->kind != TY_ARRAY)
-        error_at(token->str, "無効な初期化式です");
+        error_at(cur_token()->str, "無効な初期化式です");
       *var = node->var;
       return 0;
     default:
-      error_at(token->str, "定数式ではありません");
+      error_at(cur_token()->str, "定数式ではありません");
   }
 }
 
@@ -1593,7 +2040,7 @@ long const_expr() {
 // logor = logand ("||" logand)*
 Node *logor() {
   Node *node = logand();
-  while (consume("||"))
+  while (consume(TK_LOGOR))
     node = new_node_logor(node, logand());
   return node;
 }
@@ -1601,7 +2048,7 @@ Node *logor() {
 // logand = bitor ("&&" bitor)*
 Node *logand() {
   Node *node = bitor();
-  while (consume("&&"))
+  while (consume(TK_LOGAND))
     node = new_node_logand(node, bitor());
 
   return node;
@@ -1610,7 +2057,7 @@ Node *logand() {
 // bitor = bitxor ("|" bitxor)*
 Node *bitor() {
   Node *node = bitxor();
-  while (consume("|"))
+  while (consume(TK_PIPE))
     node = new_node_bitor(node, bitxor());
 
   return node;
@@ -1619,7 +2066,7 @@ Node *bitor() {
 // bitxor = bitand ("^" bitand)*
 Node *bitxor() {
   Node *node = bitand();
-  while (consume("^"))
+  while (consume(TK_HAT))
     node = new_node_bitxor(node, bitxor());
 
   return node;
@@ -1628,7 +2075,7 @@ Node *bitxor() {
 // bitand = equality ("&" equality)*
 Node *bitand() {
   Node *node = equality();
-  while (consume("&"))
+  while (consume(TK_AMP))
     node = new_node_bitand(node, equality());
 
   return node;
@@ -1639,9 +2086,9 @@ Node *equality() {
   Node *node = relational();
 
   for (;;) {
-    if (consume("=="))
+    if (consume(TK_EQ))
       node = new_node(ND_EQ, node, relational());
-    else if (consume("!="))
+    else if (consume(TK_NE))
       node = new_node(ND_NE, node, relational());
     else
       return node;
@@ -1653,13 +2100,13 @@ Node *relational() {
   Node *node = shift();
 
   for (;;) {
-    if (consume("<"))
+    if (consume(TK_LT))
       node = new_node(ND_LT, node, shift());
-    else if (consume("<="))
+    else if (consume(TK_LE))
       node = new_node(ND_LE, node, shift());
-    else if (consume(">"))
+    else if (consume(TK_GT))
       node = new_node(ND_LT, shift(), node);
-    else if (consume(">="))
+    else if (consume(TK_GE))
       node = new_node(ND_LE, shift(), node);
     else
       return node;
@@ -1670,9 +2117,9 @@ Node *relational() {
 Node *shift() {
   Node *node = add();
   for (;;) {
-    if (consume("<<"))
+    if (consume(TK_SHL))
       node = new_node(ND_SHL, node, add());
-    else if (consume(">>"))
+    else if (consume(TK_SHR))
       node = new_node(ND_SHR, node, add());
     else
       return node;
@@ -1684,9 +2131,9 @@ Node *add() {
   Node *node = mul();
 
   for (;;) {
-    if (consume("+"))
+    if (consume(TK_PLUS))
       node = new_node_add(node, mul());
-    else if (consume("-"))
+    else if (consume(TK_MINUS))
       node = new_node_sub(node, mul());
     else
       return node;
@@ -1698,37 +2145,32 @@ Node *mul() {
   Node *node = cast();
 
   for (;;) {
-    if (consume("*"))
+    if (consume(TK_STAR))
       node = new_node(ND_MUL, node, cast());
-    else if (consume("/"))
+    else if (consume(TK_SLASH))
       node = new_node(ND_DIV, node, cast());
     else
       return node;
   }
 }
 
-// "(" type-name ")" cast | unary
+// cast = "(" type-name ")" (compound-literal | cast) | unary
+// "("の次が型名でなければ、括弧で囲まれた式 ex) 2 * ( 4 - 1 )
 Node *cast() {
-  Token *tok = token;
-  if (consume("(")) {
-    if (is_typename()) {
-      Type *ty = type_name();
-      expect(")");
+  if (!peek_paren_typename())
+    return unary();
 
-      if (!consume("{")) { // 複合リテラルではないか確認
-        Node *node = new_node_unary(ND_CAST, cast());
-        add_type(node->lhs);
-        node->ty = ty;
-        return node;
-      }
-    }
+  token_pos++;
+  Type *ty = type_name();
+  expect(TK_RPAREN);
 
-    // 型キャストの`(`じゃなかったらtokenを元に戻す
-    // ex) 2 * ( 4 - 1 )
-    token = tok;
-  }
+  if (peek(TK_LBRACE))
+    return compound_literal(ty);
 
-  return unary();
+  Node *node = new_node_unary(ND_CAST, cast());
+  add_type(node_at(node->lhs));
+  node->ty = ty;
+  return node;
 }
 
 // unary = ("+" | "-" | "*" | "&" | "!" | "~")? cast
@@ -1736,28 +2178,37 @@ Node *cast() {
 //       | postfix
 Node *unary() {
   Token *t;
-  if (consume("++"))
+  if (consume(TK_INC))
     return new_node_unary(ND_PRE_INC, unary());
-  if (consume("--"))
+  if (consume(TK_DEC))
     return new_node_unary(ND_PRE_DEC, unary());
-  if (consume("+"))
+  if (consume(TK_PLUS))
     return cast();
-  if (consume("-"))
+  if (consume(TK_MINUS))
     return new_node(ND_SUB, new_node_num(0), cast());
-  if (consume("*"))
+  if (consume(TK_STAR))
     return new_node_unary(ND_DEREF, cast());
-  if (consume("&"))
+  if (consume(TK_AMP))
     return new_node_unary(ND_ADDR, cast());
-  if (consume("!"))
+  if (consume(TK_NOT))
     return new_node_unary(ND_NOT, cast());
-  if (consume("~"))
+  if (consume(TK_TILDE))
     return new_node_unary(ND_BIT_NOT, cast());
   return postfix();
 }
 
 Member *find_member(Type *ty, char *name) {
+  if (ty->member_table) {
+    int cap = ty->member_table_cap;
+    for (int h = name_hash(name) & (cap - 1);; h = (h + 1) & (cap - 1)) {
+      Member *mem = ty->member_table[h];
+      if (!mem || mem->name == name)
+        return mem;
+    }
+  }
+
   for (Member *mem = ty->members; mem; mem = mem->next)
-    if (!(strcmp(mem->name, name)))
+    if (mem->name == name)
       return mem;
 
   return NULL;
@@ -1766,54 +2217,60 @@ Member *find_member(Type *ty, char *name) {
 Node *struct_ref(Node *lhs) {
   add_type(lhs);
   if (lhs->ty->kind != TY_STRUCT)
-    error_at(token->str, "構造体ではありません");
+    error_at(cur_token()->str, "構造体ではありません");
 
-  Token *tok = token;
+  Token *tok = cur_token();
   Member *mem = find_member(lhs->ty, expect_ident());
   if (!mem)
     error_at(tok->str, "このメンバは定義されていません");
 
   Node *node = new_node_unary(ND_MEMBER, lhs);
-  node->member = mem;
+  alloc_node_ext(node)->member = mem;
   return node;
 }
 
-// postfix = compound-literal
+// postfix = "(" type-name ")" compound-literal
 //         | primary ("[" expr "]" | "." ident | "->" ident | "++" | "--")*
 Node *postfix() {
-  Node *node = compound_literal();
-  if (node)
-    return node;
+  if (peek_paren_typename()) {
+    token_pos++;
+    Type *ty = type_name();
+    expect(TK_RPAREN);
+    // キャストはcast()で読むので、ここでは複合リテラルしか来ない
+    if (!peek(TK_LBRACE))
+      expect(TK_LBRACE);
+    return compound_literal(ty);
+  }
 
-  node = primary();
+  Node *node = primary();
 
   for (;;) {
-    if (consume("[")) {
+    if (consume(TK_LBRACKET)) {
       // x[y] は *(x+y) と同じ意味
       Node *exp = new_node_add(node, expr());
-      expect("]");
+      expect(TK_RBRACKET);
       node = new_node_unary(ND_DEREF, exp);
       continue;
     }
 
-    if (consume(".")) {
+    if (consume(TK_DOT)) {
       node = struct_ref(node);
       continue;
     }
 
-    if (consume("->")) {
+    if (consume(TK_ARROW)) {
       // x->y は (*x).y の糖衣構文
       node = new_node_unary(ND_DEREF, node);
       node = struct_ref(node);
       continue;
     }
 
-    if (consume("++")) {
+    if (consume(TK_INC)) {
       node = new_node_unary(ND_POST_INC, node);
       continue;
     }
 
-    if (consume("--")) {
+    if (consume(TK_DEC)) {
       node = new_node_unary(ND_POST_DEC, node);
       continue;
     }
@@ -1822,26 +2279,9 @@ Node *postfix() {
   }
 }
 
-// compound-literal = "(" type-name ")" "{" (gvar-initializer | lvar-initializer) "}"
-Node *compound_literal() {
-  Token *tok = token;
-
-  if (!consume("(") || !is_typename()) {
-    token = tok;
-    // postfix() 内で、まずcompound-literalでパーズしてみて、パーズできなかったらprimaryでパーズするという処理になっているので
-    // ここではerrorをraiseしない
-    // (errorをraiseするとexitしてしまいprimaryのパーズまで到達しない)
-    return NULL;
-  }
-
-  Type *ty = type_name();
-  expect(")");
-
-  if (!peek("{")) {
-    token = tok;
-    return NULL;
-  }
-
+// compound-literal = "{" (gvar-initializer | lvar-initializer) "}"
+// "(" type-name ")" は呼び出し側で読んだ後で、その型がty
+Node *compound_literal(Type *ty) {
   if (scope_depth == 0) {
     // 適当な名前でグローバル変数を追加
     Var *var = new_gvar(new_label(), ty, true, true);
@@ -1851,7 +2291,7 @@ Node *compound_literal() {
 
   Var *var = new_lvar(new_label(), ty);
   Node *node = new_node_var(var);
-  node->init = lvar_initializer(var);
+  alloc_node_ext(node)->init = node_id(lvar_initializer(var));
   return node;
 }
 
@@ -1860,19 +2300,24 @@ Node *stmt_expr_tail() {
   Scope *sc = enter_scope();
 
   Node *node = new_node_stmt_expr();
-  node->body = stmt();
-  Node *cur = node->body;
+  Node *cur = stmt();
+  alloc_node_ext(node)->body = node_id(cur);
 
-  while (!consume("}")) {
-    cur->next = stmt();
-    cur = cur->next;
+  while (!consume(TK_RBRACE)) {
+    cur->next = node_id(stmt());
+    cur = node_at(cur->next);
   }
   leave_scope(sc);
-  expect(")");
+  expect(TK_RPAREN);
 
   if (cur->kind != ND_EXPR_STMT)
     error("voidを返すstatement expressionはサポートされていません");
-  memcpy(cur, cur->lhs, sizeof(Node));
+  // 最後の式文を、その式自体で置き換える(ハンドルは置き換える前のものを使う)
+  int id = cur->id;
+  int next = cur->next;
+  memcpy(cur, node_at(cur->lhs), sizeof(Node));
+  cur->id = id;
+  cur->next = next;
 
   return node;
 }
@@ -1888,48 +2333,46 @@ Node *stmt_expr_tail() {
 Node *primary() {
   Token *tok;
 
-  if (consume("(")) {
-    if (consume("{"))
+  if (consume(TK_LPAREN)) {
+    if (consume(TK_LBRACE))
       return stmt_expr_tail();
 
     Node *node = expr();
-    expect(")");
+    expect(TK_RPAREN);
     return node;
   }
 
-  tok = token;
-  if (consume("sizeof")) {
-    if (consume("(")) {
-      if (is_typename()) {
-        Type *ty = type_name();
-        expect(")");
-        return new_node_num(ty->size);
-      }
-      token = tok->next;
+  if (consume(TK_SIZEOF)) {
+    if (peek_paren_typename()) {
+      token_pos++;
+      Type *ty = type_name();
+      expect(TK_RPAREN);
+      return new_node_num(ty->size);
     }
     Node *node = unary();
     add_type(node);
     return new_node_num(node->ty->size);
   }
 
-  if (consume("_Alignof")) {
-    expect("(");
+  if (consume(TK_ALIGNOF)) {
+    expect(TK_LPAREN);
     Type *ty = type_name();
-    expect(")");
+    expect(TK_RPAREN);
     return new_node_num(ty->align);
   }
 
   if ((tok = consume_ident())) {
-    if (consume("(")) {
-      Node *node = new_node_fun_call(strndup(tok->str, tok->len));
+    if (consume(TK_LPAREN)) {
+      Node *node = new_node_fun_call(tok->ident);
       add_type(node);
+      use_function(tok->ident);
 
       VarScope *sc = find_var(tok);
       if (sc) {
         if (!sc->var || sc->var->ty->kind != TY_FUNC)
           error_at(tok->str, "関数ではありません");
         node->ty = sc->var->ty->return_ty;
-      } else if (!strcmp(node->funcname, "__builtin_va_start")) {
+      } else if (node_ext(node)->funcname == builtin_va_start) {
         node->ty = void_type;
       } else {
         warn_at(tok->str, "関数の暗黙的な宣言が使われました");
@@ -1940,17 +2383,21 @@ Node *primary() {
 
     VarScope *sc = find_var(tok);
     if (sc) {
-      if (sc->var)
+      if (sc->var) {
+        // 関数のアドレスを取る場合
+        if (sc->var->ty->kind == TY_FUNC)
+          use_function(tok->ident);
         return new_node_var(sc->var);
+      }
       if (sc->enum_ty)
         return new_node_num(sc->enum_val);
     }
     error_at(tok->str, "変数が定義されていません");
   }
 
-  tok = token;
+  tok = cur_token();
   if (tok->kind == TK_STR) {
-    token = token->next;
+    token_pos++;
 
     Type *ty = array_of(char_type, tok->cont_len);
     Var *var = new_gvar(new_label(), ty, true, true);
@@ -0,0 +1,464 @@
+//
+// 覗き穴最適化
+//
+// コード生成が作った関数1つ分の命令列を、規則の表にある形に当てはめて書き換える
+// 規則の多くはレジスタがその後で使われない(死んでいる)ことを条件にするので、
+// まず命令列の上でレジスタとフラグの生存解析をしてから、命令列を前から1回なめて規則を当てはめる
+// 書き換えると生存情報が変わるので、書き換えた範囲はその回にはもう見ず、書き換えがなくなるまで繰り返す
+//
+// 規則ごとに当てはまった回数を数えておき、環境変数 DCC_PEEPHOLE_STATS が設定されていれば終了時に表示する
+// --no-peephole で最適化をしない。--no-peephole=規則 でその規則だけを使わない
+//
+
+#include "dcc.h"
+
+enum {
+  FLAGS = 16, // 生存解析でフラグレジスタを表す番号
+};
+
+static char *rule_names[] = {
+    "self-mov",   // mov r, r を消す
+    "dead-def",   // 結果が使われない命令を消す
+    "cmp-branch", // setcc/movzx/cmp r, 0/je を比較の結果で分岐するjccにまとめる
+    "copy-prop",  // mov a, b の後でaを使う命令がbを直接使うようにして、movを消す
+    "zero-idiom", // mov r, 0 を xor r, r にする
+    "test-zero",  // cmp r, 0 を test r, r にする
+};
+
+// 生存解析の結果
+// 1回なめる間は、書き換えた範囲より後ろの命令については正しい
+typedef struct {
+  AsmFunc *af;
+  int *use; // use[i]はi番目の命令が読むレジスタの集合(1 << 番号 の和)
+  int *def; // def[i]はi番目の命令が書くレジスタの集合
+  int *live_out; // live_out[i]はi番目の命令の直後で生きているレジスタの集合
+} Peephole;
+
+char *peephole_rule_name(int rule) {
+  return rule_names[rule];
+}
+
+// 名前がnameの規則。なければ-1
+int find_peephole_rule(char *name) {
+  for (int i = 0; i < NUM_PEEP_RULES; i++)
+    if (!strcmp(rule_names[i], name))
+      return i;
+  return -1;
+}
+
+static int bit(int reg) {
+  return 1 << reg;
+}
+
+// オペランドの値を求めるのに読むレジスタ
+static int operand_regs(Operand *opd) {
+  if (opd->kind == OPD_REG || opd->kind == OPD_MEM)
+    return bit(opd->reg);
+  return 0;
+}
+
+static bool is_reg(Operand *opd, int size) {
+  return opd->kind == OPD_REG && opd->size == size;
+}
+
+static bool is_imm(Operand *opd, long val) {
+  return opd->kind == OPD_IMM && opd->val == val;
+}
+
+// 呼び出された関数が壊してよいレジスタ
+static int caller_saved(void) {
+  return bit(REG_RAX) | bit(REG_RCX) | bit(REG_RDX) | bit(REG_RSI) | bit(REG_RDI) |
+         bit(REG_R8) | bit(REG_R9) | bit(REG_R10) | bit(REG_R11) | bit(FLAGS);
+}
+
+// 命令instが読むレジスタ(*use)と書くレジスタ(*def)
+// レジスタの一部だけを書く命令は、残りの部分を読むものとみなす
+static void uses_defs(AsmInst *inst, int *use, int *def) {
+  Operand *dst = &inst->dst;
+  Operand *src = &inst->src;
+  int u = 0;
+  int d = 0;
+
+  switch (inst->op) {
+    case ASM_MOV:
+    case ASM_MOVABS:
+    case ASM_MOVSX:
+    case ASM_MOVSXD:
+    case ASM_MOVZX:
+    case ASM_LEA:
+      u = operand_regs(src);
+      if (dst->kind == OPD_REG) {
+        d = bit(dst->reg);
+        if (dst->size < 4)
+          u = u | d;
+      } else {
+        u = u | operand_regs(dst);
+      }
+      break;
+    case ASM_ADD:
+    case ASM_SUB:
+    case ASM_IMUL:
+    case ASM_AND:
+    case ASM_OR:
+    case ASM_XOR:
+    case ASM_SHL:
+    case ASM_SAR:
+      u = operand_regs(dst) | operand_regs(src);
+      if (dst->kind == OPD_REG)
+        d = bit(dst->reg);
+      d = d | bit(FLAGS);
+      // xor r, r は元の値によらず0にする
+      if (inst->op == ASM_XOR && src->kind == OPD_REG && src->reg == dst->reg)
+        u = 0;
+      break;
+    case ASM_NOT:
+      u = operand_regs(dst);
+      if (dst->kind == OPD_REG)
+        d = bit(dst->reg);
+      break;
+    case ASM_CQO:
+      u = bit(REG_RAX);
+      d = bit(REG_RDX);
+      break;
+    case ASM_IDIV:
+      u = bit(REG_RAX) | bit(REG_RDX) | operand_regs(src);
+      d = bit(REG_RAX) | bit(REG_RDX) | bit(FLAGS);
+      break;
+    case ASM_CMP:
+    case ASM_TEST:
+      u = operand_regs(dst) | operand_regs(src);
+      d = bit(FLAGS);
+      break;
+    case ASM_SETCC:
+      u = bit(FLAGS) | bit(dst->reg);
+      d = bit(dst->reg);
+      break;
+    case ASM_JCC:
+      u = bit(FLAGS);
+      break;
+    case ASM_CALL:
+      // 引数のレジスタと、ベクタレジスタで渡す引数の個数を入れたALを読む
+      u = bit(REG_RDI) | bit(REG_RSI) | bit(REG_RDX) | bit(REG_RCX) | bit(REG_R8) | bit(REG_R9) |
+          bit(REG_RAX);
+      d = caller_saved();
+      break;
+    case ASM_PUSH:
+      u = operand_regs(src);
+      break;
+    case ASM_POP:
+      d = bit(dst->reg);
+      break;
+    case ASM_RET:
+      // 戻り値と、呼び出し元のために保存しておくレジスタ
+      u = bit(REG_RAX) | bit(REG_RBX) | bit(REG_R12) | bit(REG_R13) | bit(REG_R14) | bit(REG_R15);
+      break;
+    default:
+      break;
+  }
+
+  *use = u;
+  *def = d;
+}
+
+// 次の(消されていない)命令の位置。なければninsts
+static int next_inst(AsmFunc *af, int i) {
+  i++;
+  while (i < af->ninsts && !af->insts[i])
+    i++;
+  return i;
+}
+
+// レジスタとフラグの生存解析
+// 命令ごとの生存情報を、後ろから変化がなくなるまで伝える
+static void compute_liveness(Peephole *p) {
+  AsmFunc *af = p->af;
+  int n = af->ninsts;
+  int *live_in = arena_alloc(af->arena, sizeof(int) * (n + 1));
+  int *label_pos = arena_alloc(af->arena, sizeof(int) * (af->nlabels + 1));
+  int *use = arena_alloc(af->arena, sizeof(int) * (n + 1));
+  int *def = arena_alloc(af->arena, sizeof(int) * (n + 1));
+  p->use = use;
+  p->def = def;
+  p->live_out = arena_alloc(af->arena, sizeof(int) * (n + 1));
+
+  for (int i = 0; i < n; i++) {
+    AsmInst *inst = af->insts[i];
+    uses_defs(inst, &use[i], &def[i]);
+    if (inst->op == ASM_LABEL)
+      label_pos[inst->label] = i;
+  }
+
+  // 消した命令は詰めてあるので、次の命令はi+1番目
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = n - 1; i >= 0; i--) {
+      AsmInst *inst = af->insts[i];
+      int out = 0;
+      if (inst->op != ASM_JMP && inst->op != ASM_RET && i + 1 < n)
+        out = live_in[i + 1];
+      if (inst->op == ASM_JMP || inst->op == ASM_JCC)
+        out = out | live_in[label_pos[inst->label]];
+      p->live_out[i] = out;
+
+      int in = use[i] | (out & ~def[i]);
+      if (in != live_in[i]) {
+        live_in[i] = in;
+        changed = true;
+      }
+    }
+  }
+}
+
+// i番目の命令の後でregsがすべて死んでいればtrue
+// RSPとRBPはスタックフレームを指しているので、常に生きているものとする
+static bool is_dead(Peephole *p, int i, int regs) {
+  if (regs & (bit(REG_RSP) | bit(REG_RBP)))
+    return false;
+  return (p->live_out[i] & regs) == 0;
+}
+
+// 規則が当てはまれば命令列を書き換え、書き換えた範囲の最後の命令の位置を返す。当てはまらなければ-1
+// 消す命令はNULLにしておく
+
+// mov r, r
+static int self_mov(Peephole *p, int i) {
+  AsmInst *inst = p->af->insts[i];
+  if (inst->op != ASM_MOV || !is_reg(&inst->dst, 8) || !is_reg(&inst->src, 8) ||
+      inst->dst.reg != inst->src.reg)
+    return -1;
+  p->af->insts[i] = NULL;
+  return i;
+}
+
+// 結果のレジスタもフラグも使われない命令
+// 書き込み先がメモリの命令と、関数呼び出し・除算は消さない
+static int dead_def(Peephole *p, int i) {
+  AsmInst *inst = p->af->insts[i];
+  switch (inst->op) {
+    case ASM_MOV:
+    case ASM_MOVABS:
+    case ASM_MOVSX:
+    case ASM_MOVSXD:
+    case ASM_MOVZX:
+    case ASM_LEA:
+    case ASM_ADD:
+    case ASM_SUB:
+    case ASM_IMUL:
+    case ASM_AND:
+    case ASM_OR:
+    case ASM_XOR:
+    case ASM_NOT:
+    case ASM_SHL:
+    case ASM_SAR:
+    case ASM_SETCC:
+      if (inst->dst.kind != OPD_REG)
+        return -1;
+      break;
+    case ASM_CQO:
+      break;
+    default:
+      return -1;
+  }
+
+  if (!is_dead(p, i, p->def[i]))
+    return -1;
+  p->af->insts[i] = NULL;
+  return i;
+}
+
+// setcc r8; movzx r, r8; (フラグとrに触れない命令...); cmp r, 0; je/jne L
+// rが後で使われなければ、元の比較の結果で直接分岐する
+static int cmp_branch(Peephole *p, int i) {
+  AsmFunc *af = p->af;
+  AsmInst *set = af->insts[i];
+  if (set->op != ASM_SETCC)
+    return -1;
+  int reg = set->dst.reg;
+
+  int j = next_inst(af, i);
+  if (j == af->ninsts)
+    return -1;
+  AsmInst *ext = af->insts[j];
+  if (ext->op != ASM_MOVZX || !is_reg(&ext->dst, 8) || ext->dst.reg != reg ||
+      !is_reg(&ext->src, 1) || ext->src.reg != reg)
+    return -1;
+
+  int k = next_inst(af, j);
+  for (; k < af->ninsts; k = next_inst(af, k)) {
+    AsmInst *inst = af->insts[k];
+    if (inst->op == ASM_CMP || inst->op == ASM_TEST)
+      break;
+    if (inst->op != ASM_MOV && inst->op != ASM_MOVABS && inst->op != ASM_LEA)
+      return -1;
+    if ((p->use[k] | p->def[k]) & (bit(reg) | bit(FLAGS)))
+      return -1;
+  }
+  if (k == af->ninsts)
+    return -1;
+
+  AsmInst *cmp = af->insts[k];
+  if (!is_reg(&cmp->dst, 8) || cmp->dst.reg != reg)
+    return -1;
+  if (cmp->op == ASM_CMP && !is_imm(&cmp->src, 0))
+    return -1;
+  if (cmp->op == ASM_TEST && (!is_reg(&cmp->src, 8) || cmp->src.reg != reg))
+    return -1;
+
+  int l = next_inst(af, k);
+  if (l == af->ninsts)
+    return -1;
+  AsmInst *jcc = af->insts[l];
+  if (jcc->op != ASM_JCC || (jcc->cc != CC_E && jcc->cc != CC_NE))
+    return -1;
+  if (!is_dead(p, l, bit(reg) | bit(FLAGS)))
+    return -1;
+
+  // jneなら比較が成り立つ時、jeなら成り立たない時に分岐する
+  jcc->cc = jcc->cc == CC_NE ? set->cc : set->cc ^ 1;
+  af->insts[i] = NULL;
+  af->insts[j] = NULL;
+  af->insts[k] = NULL;
+  return l;
+}
+
+// 2つ目のオペランドに即値を取れる命令
+static bool takes_imm(AsmOp op) {
+  return op == ASM_MOV || op == ASM_ADD || op == ASM_SUB || op == ASM_AND || op == ASM_OR ||
+         op == ASM_XOR || op == ASM_CMP;
+}
+
+// mov a, b (bはレジスタか即値) の後、ジャンプやラベルを挟まずにaを初めて使う命令が
+// aを2つ目のオペランドとしてだけ使い、その後でaが使われなければ、aの代わりにbを使わせる
+static int copy_prop(Peephole *p, int i) {
+  AsmFunc *af = p->af;
+  AsmInst *mov = af->insts[i];
+  if (mov->op != ASM_MOV || !is_reg(&mov->dst, 8))
+    return -1;
+  if (!is_reg(&mov->src, 8) && mov->src.kind != OPD_IMM)
+    return -1;
+  int a = bit(mov->dst.reg);
+  int b = operand_regs(&mov->src);
+
+  for (int k = next_inst(af, i); k < af->ninsts; k = next_inst(af, k)) {
+    AsmInst *inst = af->insts[k];
+    if (inst->op == ASM_LABEL || inst->op == ASM_JMP || inst->op == ASM_JCC ||
+        inst->op == ASM_CALL || inst->op == ASM_RET)
+      return -1;
+
+    if (!((p->use[k] | p->def[k]) & a)) {
+      // 途中でbが書き換えられると、bの値が変わってしまう
+      if (p->def[k] & b)
+        return -1;
+      continue;
+    }
+
+    if (!is_reg(&inst->src, 8) || inst->src.reg != mov->dst.reg)
+      return -1;
+    if (operand_regs(&inst->dst) & a)
+      return -1;
+    if (inst->op != ASM_MOV && inst->op != ASM_ADD && inst->op != ASM_SUB &&
+        inst->op != ASM_IMUL && inst->op != ASM_AND && inst->op != ASM_OR &&
+        inst->op != ASM_XOR && inst->op != ASM_CMP)
+      return -1;
+    if (mov->src.kind == OPD_IMM && !takes_imm(inst->op))
+      return -1;
+    if (!is_dead(p, k, a))
+      return -1;
+
+    inst->src.kind = mov->src.kind;
+    inst->src.reg = mov->src.reg;
+    inst->src.val = mov->src.val;
+    af->insts[i] = NULL;
+    return k;
+  }
+  return -1;
+}
+
+// mov r, 0 (フラグが使われない場合)
+// xor r32, r32 は上位32ビットも0にし、命令も短い
+static int zero_idiom(Peephole *p, int i) {
+  AsmInst *inst = p->af->insts[i];
+  if (inst->op != ASM_MOV || inst->dst.kind != OPD_REG || inst->dst.size < 4 ||
+      !is_imm(&inst->src, 0))
+    return -1;
+  if (!is_dead(p, i, bit(FLAGS)))
+    return -1;
+
+  inst->op = ASM_XOR;
+  inst->dst.size = 4;
+  inst->src.kind = OPD_REG;
+  inst->src.reg = inst->dst.reg;
+  inst->src.size = 4;
+  return i;
+}
+
+// cmp r, 0
+// test r, r はフラグを同じように設定し、即値がない分だけ短い
+static int test_zero(Peephole *p, int i) {
+  AsmInst *inst = p->af->insts[i];
+  if (inst->op != ASM_CMP || !is_reg(&inst->dst, 8) || !is_imm(&inst->src, 0))
+    return -1;
+
+  inst->op = ASM_TEST;
+  inst->src.kind = OPD_REG;
+  inst->src.reg = inst->dst.reg;
+  inst->src.size = 8;
+  return i;
+}
+
+static int apply_rule(Peephole *p, int rule, int i) {
+  switch (rule) {
+    case PEEP_SELF_MOV:
+      return self_mov(p, i);
+    case PEEP_DEAD_DEF:
+      return dead_def(p, i);
+    case PEEP_CMP_BRANCH:
+      return cmp_branch(p, i);
+    case PEEP_COPY_PROP:
+      return copy_prop(p, i);
+    case PEEP_ZERO_IDIOM:
+      return zero_idiom(p, i);
+    case PEEP_TEST_ZERO:
+      return test_zero(p, i);
+    default:
+      return -1;
+  }
+}
+
+// 関数の命令列afに覗き穴最適化をかける
+// hits[規則]に、その規則が当てはまった回数を足す
+void peephole(AsmFunc *af, long *hits) {
+  Peephole ctx = {};
+  Peephole *p = &ctx;
+  p->af = af;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    compute_liveness(p);
+
+    for (int i = 0; i < af->ninsts; i++) {
+      if (!af->insts[i])
+        continue;
+      for (int rule = 0; rule < NUM_PEEP_RULES; rule++) {
+        if (opt_no_peephole & (1 << rule))
+          continue;
+        int last = apply_rule(p, rule, i);
+        if (last < 0)
+          continue;
+        hits[rule]++;
+        changed = true;
+        i = last;
+        break;
+      }
+    }
+
+    // 消した命令を詰める
+    int n = 0;
+    for (int i = 0; i < af->ninsts; i++)
+      if (af->insts[i])
+        af->insts[n++] = af->insts[i];
+    af->ninsts = n;
+  }
+}
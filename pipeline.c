@@ -0,0 +1,174 @@
+//
+// 関数ごとの並列コード生成
+//
+// 関数のコード生成はその関数のASTだけで完結し、他の関数には依存しない
+// そこでパーサ(メインスレッド)はパースし終えた関数をキューに入れ、
+// コード生成スレッドたちがキューから取り出して、関数ごとのバッファにアセンブリを書き出す
+// バッファはメインスレッドがソースコードの順に標準出力へ書き出すので、
+// 出力はスレッドを使わない場合とバイト単位で同じになる
+//
+// キューは固定長のリングバッファ
+// 関数には通し番号をつけ、番号seqの関数は枠 seq % QUEUE_SIZE に入れる
+// 枠は 空(SLOT_EMPTY) → 関数が入った(SLOT_READY) → 出力がバッファにある(SLOT_DONE) → 空 と巡る
+// 枠の状態と番号は1つのロックで守り、待つ時は条件変数で眠る
+// コード生成と出力の書き出しはロックを離してから行うので、ロックを持つのは状態を変える間だけ
+//
+// スレッド数は環境変数 DCC_CODEGEN_THREADS で指定できる(0ならスレッドを使わない)
+// 指定しなければ、パーサの分を除いたCPUの数だけ使う
+//
+
+#include "dcc.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+enum {
+  QUEUE_SIZE = 64, // 2のべき乗
+  CODEGEN_THREADS_MAX = 64,
+};
+
+enum {
+  SLOT_EMPTY,
+  SLOT_READY,
+  SLOT_DONE,
+};
+
+typedef struct {
+  int state;
+  long seq;      // 入っている関数の通し番号
+  Function *fn;
+  Output *out;   // 生成したアセンブリ
+  pthread_cond_t ready; // 関数が入った、または入力が終わった
+} Slot;
+
+static Slot slots[QUEUE_SIZE];
+
+// 以下の変数と枠のstate・seqはlockを持って読み書きする
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; // どれかの枠がSLOT_DONEになった
+static long queue_tail;  // 次に入れる関数の番号
+static long write_pos;   // 次に書き出す関数の番号
+static long claim_pos;   // 次にコード生成スレッドが受け持つ関数の番号
+static bool input_done;  // パーサがすべての関数を入れ終えたか
+
+static pthread_t threads[CODEGEN_THREADS_MAX];
+static int nthreads;
+
+// 次の番号の関数を受け持ち、それが入るのを待つ。入力が終わってもう来ない場合はNULLを返す
+static Slot *claim_function(void) {
+  pthread_mutex_lock(&lock);
+  long seq = claim_pos++;
+  Slot *slot = &slots[seq & (QUEUE_SIZE - 1)];
+  while (slot->state != SLOT_READY || slot->seq != seq) {
+    if (input_done && seq >= queue_tail) {
+      slot = NULL;
+      break;
+    }
+    pthread_cond_wait(&slot->ready, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return slot;
+}
+
+static void *codegen_main(void *arg) {
+  for (Slot *slot = claim_function(); slot; slot = claim_function()) {
+    slot->out = new_output();
+    set_output(slot->out);
+    emit_function(slot->fn);
+    set_output(NULL);
+
+    pthread_mutex_lock(&lock);
+    slot->state = SLOT_DONE;
+    pthread_cond_signal(&done);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+// 次に書き出す関数のコード生成が終わっていれば、その出力を書き出してtrueを返す
+// lockを持って呼ぶ。書き出す間はlockを離す
+static bool write_next(void) {
+  Slot *slot = &slots[write_pos & (QUEUE_SIZE - 1)];
+  if (write_pos == queue_tail || slot->state != SLOT_DONE)
+    return false;
+
+  // SLOT_DONEの枠を空にするのはパーサだけなので、lockを離してもこの枠は変わらない
+  pthread_mutex_unlock(&lock);
+  append_output(slot->out);
+  free_output(slot->out);
+  pthread_mutex_lock(&lock);
+
+  slot->state = SLOT_EMPTY;
+  write_pos++;
+  return true;
+}
+
+static int codegen_threads(void) {
+  char *s = getenv("DCC_CODEGEN_THREADS");
+  long n = s ? atoi(s) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n < 0)
+    return 0;
+  return n < CODEGEN_THREADS_MAX ? n : CODEGEN_THREADS_MAX;
+}
+
+// 使えるならコード生成スレッドを起動する
+void start_codegen(void) {
+  int n = codegen_threads();
+  if (!n)
+    return;
+
+  for (int i = 0; i < QUEUE_SIZE; i++)
+    pthread_cond_init(&slots[i].ready, NULL);
+  for (int i = 0; i < n; i++) {
+    if (pthread_create(&threads[i], NULL, codegen_main, NULL))
+      error("スレッドを作成できません");
+    nthreads++;
+  }
+}
+
+// パースし終えた関数のコードを生成する
+// コード生成スレッドがあればキューに入れるだけで戻る。なければその場で出力する
+void send_function(Function *fn) {
+  if (!nthreads) {
+    emit_function(fn);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+
+  // 枠が空くまで、終わった分を書き出しながら待つ
+  Slot *slot = &slots[queue_tail & (QUEUE_SIZE - 1)];
+  while (slot->state != SLOT_EMPTY)
+    if (!write_next())
+      pthread_cond_wait(&done, &lock);
+
+  slot->seq = queue_tail++;
+  slot->fn = fn;
+  slot->state = SLOT_READY;
+  // 同じ枠で後の番号を待っているスレッドもいるかもしれないので、全員起こす
+  pthread_cond_broadcast(&slot->ready);
+
+  while (write_next())
+    ;
+  pthread_mutex_unlock(&lock);
+}
+
+// キューに入れた関数のコードをすべて書き出し終えるまで待つ
+void finish_codegen(void) {
+  if (!nthreads)
+    return;
+
+  pthread_mutex_lock(&lock);
+  input_done = true;
+  for (int i = 0; i < QUEUE_SIZE; i++)
+    pthread_cond_broadcast(&slots[i].ready);
+
+  while (write_pos < queue_tail)
+    if (!write_next())
+      pthread_cond_wait(&done, &lock);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  nthreads = 0;
+}
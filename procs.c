@@ -0,0 +1,150 @@
+//
+// 関数本体の並列パース
+//
+// トップレベルの宣言は前から順にパースしなければならないが、関数本体はそれより前の宣言にしか依存しない
+// そこで、まず関数本体を読み飛ばしながらトップレベルを最後までパースし(skim)、
+// 各関数本体のトークンの範囲と、その本体から見えるトップレベルのスコープの位置を記録しておく
+// その後、関数を連続した範囲に分けて複数のプロセスに割り当て、
+// 各プロセスが担当する関数本体をパースしてコードを生成する
+//
+// パーサの状態(スコープ・ローカル変数・アリーナなど)はグローバル変数にあり、
+// セルフホストするdccにはスレッドローカル変数もないので、ワーカーにはスレッドではなくプロセスを使う
+// forkした時点のトップレベルのスコープには入力の最後までの宣言が入っているので、
+// 各プロセスはparse_body()でそれを関数ごとに記録した位置まで戻してから本体をパースする
+// ローカルなスコープはプロセスごとに別々に持つ
+//
+// 各プロセスは出力を一時ファイルに書き出し、親プロセスがそれを関数の順に繋げる
+// 関数本体の中で作られたグローバル変数(文字列リテラル・staticなローカル変数)は、
+// ラベルが被らないようにプロセスごとの接頭辞をつけ、そのプロセスの出力の最後に書き出す
+//
+// プロセス数は環境変数 DCC_PARSE_PROCS で指定する(指定しないか1以下なら使わない)
+//
+
+#include "dcc.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum {
+  PARSE_PROCS_MAX = 64,
+};
+
+static int parse_procs(void) {
+  char *s = getenv("DCC_PARSE_PROCS");
+  int n = s ? atoi(s) : 1;
+  return n < PARSE_PROCS_MAX ? n : PARSE_PROCS_MAX;
+}
+
+// 子プロセスで、関数fns[0..n)の本体をパースしてコードを生成し、oに書き出す
+// markより後に追加されたグローバル変数もoに書き出す
+static void compile_range(Function **fns, int n, VarList *mark, Output *o, int idx) {
+  char *prefix = malloc(32);
+  sprintf(prefix, ".L.data.%d.", idx);
+  set_data_label_prefix(prefix);
+  set_output(o);
+
+  for (int i = 0; i < n; i++) {
+    parse_body(fns[i]);
+    emit_function(fns[i]);
+  }
+
+  Program prog = {};
+  VarList head = {};
+  VarList *cur = &head;
+  for (VarList *vl = finish_program()->globals; vl != mark; vl = vl->next) {
+    cur->next = calloc(1, sizeof(VarList));
+    cur = cur->next;
+    cur->var = vl->var;
+  }
+  if (!head.next || opt_dump_ir)
+    return;
+
+  // 次のプロセスの出力は関数のコードから始まるので、.textに戻しておく
+  prog.globals = head.next;
+  emit_data(&prog);
+  emits(".text\n");
+}
+
+// DCC_PARSE_PROCSが2以上なら、関数本体のパースとコード生成を複数のプロセスで行ってtrueを返す
+// そうでなければ何もせずにfalseを返す
+bool compile_in_procs(void) {
+  // 機械語のシンボルと再配置は一時ファイルを通して受け渡せないので、-cの時は使わない
+  int nprocs = parse_procs();
+  if (nprocs < 2 || opt_emit_obj)
+    return false;
+
+  // 関数本体を読み飛ばしながら入力の最後までパースする
+  skim_function_bodies(true);
+  int cap = 16;
+  int nfns = 0;
+  Function **fns = malloc(sizeof(Function *) * cap);
+  long total = 0;
+  for (Function *fn = next_function(); fn; fn = next_function()) {
+    if (nfns == cap) {
+      cap *= 2;
+      fns = realloc(fns, sizeof(Function *) * cap);
+    }
+    fns[nfns++] = fn;
+    total += fn->body_end - fn->body_pos;
+  }
+  skim_function_bodies(false);
+
+  VarList *mark = finish_program()->globals;
+
+  // 本体のトークン数がほぼ等しくなるように、関数を連続した範囲に分ける
+  FILE *out[PARSE_PROCS_MAX];
+  pid_t pids[PARSE_PROCS_MAX];
+  int n = 0;
+  int begin = 0;
+  long done = 0;
+  flush_output(NULL);
+
+  while (begin < nfns) {
+    int end = begin;
+    long limit = total * (n + 1) / nprocs;
+    while (end < nfns && (end == begin || done < limit)) {
+      done += fns[end]->body_end - fns[end]->body_pos;
+      end++;
+    }
+
+    out[n] = tmpfile();
+    if (!out[n])
+      error("一時ファイルを作れません");
+
+    pid_t pid = fork();
+    if (pid < 0)
+      error("プロセスを作成できません");
+    if (pid == 0) {
+      Output *o = new_file_output(fileno(out[n]));
+      compile_range(fns + begin, end - begin, mark, o, n);
+      flush_output(o);
+      print_peephole_stats();
+      _exit(0);
+    }
+
+    pids[n++] = pid;
+    begin = end;
+  }
+
+  // すべてのプロセスが成功したら、出力を関数の順に繋げる
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    int status;
+    if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+      ok = false;
+  }
+  if (!ok)
+    exit(1);
+
+  char buf[65536];
+  for (int i = 0; i < n; i++) {
+    rewind(out[i]);
+    for (long len; (len = fread(buf, 1, sizeof(buf), out[i])) > 0;)
+      emitn(buf, len);
+    fclose(out[i]);
+  }
+  for (int i = 0; i < nfns; i++)
+    free_arena(fns[i]->arena);
+  free(fns);
+  return true;
+}
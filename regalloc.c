@@ -0,0 +1,303 @@
+//
+// レジスタ割り当て
+//
+// Poletto & Sarkar "Linear Scan Register Allocation" の方法で、IRの値をレジスタに割り当てる
+// ブロックを配置順に並べて命令に位置をつけ、値が生きている範囲(生存区間)を位置の1つの区間で近似する
+// 区間を始まる順に見ていき、空いているレジスタを割り当てる
+// 空いていなければ、最も遠くまで生きる値をスタックに置く(スピルする)
+//
+// RAXとR11はコード生成の作業用に残し、残りの12個のレジスタを割り当てる
+// 関数呼び出しをまたいで生きる値には、呼び出された関数が保存するレジスタ(RBX, R12〜R15)だけを使う
+// 同じように、除算(RDXを壊す)とシフト(CLを使う)をまたいで生きる値には、RDX・RCXを使わない
+//
+// 割り当ての結果はIRと同じく関数の領域(fn->arena)に確保する
+//
+
+#include "dcc.h"
+
+enum {
+  NUM_ALLOC_REGS = 12,
+};
+
+// 割り当てる順
+// 呼び出し元が保存するレジスタを先に使い、プロローグとエピローグでの退避を減らす
+// 引数のレジスタを引数の順に並べておくと、引数の値がそのまま同じレジスタに割り当たりやすい
+static int alloc_order[] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9, REG_R10,
+                            REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+
+// 生存区間を計算するための状態
+typedef struct {
+  IrFunc *ir;
+  Arena *arena;
+  int nwords; // 値の集合(ビット集合)の語数
+  long **live_in; // live_in[ブロックの番号]は、ブロックの入口で生きている値の集合
+  long **live_out; // live_out[ブロックの番号]は、ブロックの出口で生きている値の集合
+  int *bstart; // bstart[ブロックの番号]はブロックの先頭(φ命令)の位置
+  int *bend; // bend[ブロックの番号]はブロックの終端命令の位置
+  int npos; // 位置の個数
+  int *start; // start[値の番号]は生存区間の始まりの位置
+  int *end; // end[値の番号]は生存区間の終わりの位置
+  int *ncalls; // ncalls[p]は位置pより前にある関数呼び出しの個数
+  int *ndivs; // 除算の個数
+  int *nshifts; // シフトの個数
+} Liveness;
+
+// ビット集合の1語には下位32ビットだけを使う
+// longの最上位ビットを立てる(1 << 63)と符号付きの値があふれるので、その手前までにする
+static bool has_bit(long *set, int i) {
+  return (set[i >> 5] >> (i & 31)) & 1;
+}
+
+static void set_bit(long *set, int i) {
+  set[i >> 5] = set[i >> 5] | ((long) 1 << (i & 31));
+}
+
+static long *new_set(Liveness *lv) {
+  return arena_alloc(lv->arena, sizeof(long) * lv->nwords);
+}
+
+// ブロックの入口と出口で生きている値を、後ろ向きのデータフロー解析で求める
+// φ命令の引数は、対応する先行ブロックの出口で使うものとみなす
+static void compute_live_sets(Liveness *lv) {
+  IrFunc *ir = lv->ir;
+  int n = ir->nblocks;
+  long **gen = arena_alloc(lv->arena, sizeof(long *) * (n + 1)); // ブロックの中で定義する前に使う値
+  long **kill = arena_alloc(lv->arena, sizeof(long *) * (n + 1)); // ブロックの中で定義する値
+  long **phi_uses = arena_alloc(lv->arena, sizeof(long *) * (n + 1)); // 後続ブロックのφ命令が使う値
+  lv->live_in = arena_alloc(lv->arena, sizeof(long *) * (n + 1));
+  lv->live_out = arena_alloc(lv->arena, sizeof(long *) * (n + 1));
+
+  for (int i = 0; i < n; i++) {
+    IrBlock *b = ir->blocks[i];
+    gen[b->id] = new_set(lv);
+    kill[b->id] = new_set(lv);
+    phi_uses[b->id] = new_set(lv);
+    lv->live_in[b->id] = new_set(lv);
+    lv->live_out[b->id] = new_set(lv);
+
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      set_bit(kill[b->id], phi->id);
+    for (IrInst *inst = b->insts; inst; inst = inst->next) {
+      for (int j = 0; j < inst->nargs; j++)
+        if (!has_bit(kill[b->id], inst->args[j]->id))
+          set_bit(gen[b->id], inst->args[j]->id);
+      if (ir_has_value(inst))
+        set_bit(kill[b->id], inst->id);
+    }
+
+    for (int j = 0; j < b->nsuccs; j++) {
+      IrBlock *s = b->succs[j];
+      for (int k = 0; k < s->npreds; k++)
+        if (s->preds[k] == b)
+          for (IrInst *phi = s->phis; phi; phi = phi->next)
+            set_bit(phi_uses[b->id], phi->args[k]->id);
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = n - 1; i >= 0; i--) {
+      IrBlock *b = ir->blocks[i];
+      long *in = lv->live_in[b->id];
+      long *out = lv->live_out[b->id];
+      for (int w = 0; w < lv->nwords; w++) {
+        long x = phi_uses[b->id][w];
+        for (int j = 0; j < b->nsuccs; j++)
+          x = x | lv->live_in[b->succs[j]->id][w];
+        out[w] = x;
+
+        long y = gen[b->id][w] | (x & ~kill[b->id][w]);
+        if (y != in[w]) {
+          in[w] = y;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+static void extend(Liveness *lv, int id, int pos) {
+  if (pos < lv->start[id])
+    lv->start[id] = pos;
+  if (lv->end[id] < pos)
+    lv->end[id] = pos;
+}
+
+// 集合setに含まれる値の生存区間を、位置posを含むように広げる
+static void extend_set(Liveness *lv, long *set, int pos) {
+  for (int w = 0; w < lv->nwords; w++) {
+    long x = set[w];
+    if (!x)
+      continue;
+    for (int i = 0; i < 32; i++)
+      if ((x >> i) & 1)
+        extend(lv, w * 32 + i, pos);
+  }
+}
+
+// 命令に位置をつけて、値ごとの生存区間と、関数呼び出しなどの位置を求める
+static void compute_intervals(Liveness *lv) {
+  IrFunc *ir = lv->ir;
+  int n = ir->nblocks;
+
+  lv->npos = 0;
+  for (int i = 0; i < n; i++) {
+    lv->npos++;
+    for (IrInst *inst = ir->blocks[i]->insts; inst; inst = inst->next)
+      lv->npos++;
+  }
+
+  lv->bstart = arena_alloc(lv->arena, sizeof(int) * (n + 1));
+  lv->bend = arena_alloc(lv->arena, sizeof(int) * (n + 1));
+  lv->start = arena_alloc(lv->arena, sizeof(int) * (ir->nvals + 1));
+  lv->end = arena_alloc(lv->arena, sizeof(int) * (ir->nvals + 1));
+  lv->ncalls = arena_alloc(lv->arena, sizeof(int) * (lv->npos + 1));
+  lv->ndivs = arena_alloc(lv->arena, sizeof(int) * (lv->npos + 1));
+  lv->nshifts = arena_alloc(lv->arena, sizeof(int) * (lv->npos + 1));
+
+  // 定義の位置
+  int pos = 0;
+  for (int i = 0; i < n; i++) {
+    IrBlock *b = ir->blocks[i];
+    lv->bstart[b->id] = pos;
+    for (IrInst *phi = b->phis; phi; phi = phi->next)
+      lv->start[phi->id] = lv->end[phi->id] = pos;
+
+    for (IrInst *inst = b->insts; inst; inst = inst->next) {
+      pos++;
+      if (ir_has_value(inst))
+        lv->start[inst->id] = lv->end[inst->id] = pos;
+
+      // まず位置pos+1に印をつけ、後でその前までの個数に足し合わせる
+      if (inst->op == IR_CALL)
+        lv->ncalls[pos + 1] = 1;
+      if (inst->op == IR_DIV)
+        lv->ndivs[pos + 1] = 1;
+      if (inst->op == IR_SHL || inst->op == IR_SAR)
+        lv->nshifts[pos + 1] = 1;
+    }
+    lv->bend[b->id] = pos;
+    pos++;
+  }
+  for (int p = 1; p <= lv->npos; p++) {
+    lv->ncalls[p] += lv->ncalls[p - 1];
+    lv->ndivs[p] += lv->ndivs[p - 1];
+    lv->nshifts[p] += lv->nshifts[p - 1];
+  }
+
+  // 使う位置と、ブロックの入口・出口で生きている範囲
+  for (int i = 0; i < n; i++) {
+    IrBlock *b = ir->blocks[i];
+    pos = lv->bstart[b->id];
+    extend_set(lv, lv->live_in[b->id], pos);
+    for (IrInst *inst = b->insts; inst; inst = inst->next) {
+      pos++;
+      for (int j = 0; j < inst->nargs; j++)
+        extend(lv, inst->args[j]->id, pos);
+    }
+    extend_set(lv, lv->live_out[b->id], lv->bend[b->id]);
+  }
+}
+
+// 位置startとendの間(両端を除く)に、countsで数えた命令があればtrue
+static bool crosses(int *counts, int start, int end) {
+  return end > start + 1 && counts[end] - counts[start + 1] > 0;
+}
+
+// 値idに使えるレジスタの集合(1 << レジスタ番号 の和)
+static int allowed_regs(Liveness *lv, int id) {
+  int s = lv->start[id];
+  int e = lv->end[id];
+  int mask = 0;
+  for (int i = 0; i < NUM_ALLOC_REGS; i++)
+    mask = mask | (1 << alloc_order[i]);
+
+  if (crosses(lv->ncalls, s, e))
+    mask = (1 << REG_RBX) | (1 << REG_R12) | (1 << REG_R13) | (1 << REG_R14) | (1 << REG_R15);
+  if (crosses(lv->ndivs, s, e))
+    mask = mask & ~(1 << REG_RDX);
+  if (crosses(lv->nshifts, s, e))
+    mask = mask & ~(1 << REG_RCX);
+  return mask;
+}
+
+static void spill(RegAlloc *ra, int id) {
+  ra->reg[id] = -1;
+  ra->slot[id] = ra->nslots++;
+}
+
+// 関数のIRの値をレジスタかスタックのスロットに割り当てる
+RegAlloc *alloc_regs(IrFunc *ir) {
+  Liveness ctx = {};
+  Liveness *lv = &ctx;
+  lv->ir = ir;
+  lv->arena = ir->fn->arena;
+  lv->nwords = (ir->nvals >> 5) + 1;
+  compute_live_sets(lv);
+  compute_intervals(lv);
+
+  RegAlloc *ra = arena_alloc(lv->arena, sizeof(RegAlloc));
+  ra->reg = arena_alloc(lv->arena, sizeof(int) * (ir->nvals + 1));
+  ra->slot = arena_alloc(lv->arena, sizeof(int) * (ir->nvals + 1));
+
+  // 区間を始まりの位置ごとのリストにまとめる(位置の順に取り出せば、始まる順に並ぶ)
+  int *head = arena_alloc(lv->arena, sizeof(int) * (lv->npos + 1));
+  int *next = arena_alloc(lv->arena, sizeof(int) * (ir->nvals + 1));
+  for (int id = ir->nvals; id >= 1; id--) {
+    next[id] = head[lv->start[id]];
+    head[lv->start[id]] = id;
+  }
+
+  // 割り当て中の値(レジスタを使っている値)
+  int active[NUM_ALLOC_REGS];
+  int nactive = 0;
+  int free_regs = 0;
+  for (int i = 0; i < NUM_ALLOC_REGS; i++)
+    free_regs = free_regs | (1 << alloc_order[i]);
+
+  for (int pos = 0; pos < lv->npos; pos++) {
+    for (int id = head[pos]; id; id = next[id]) {
+      // 終わった区間のレジスタを空ける
+      int m = 0;
+      for (int i = 0; i < nactive; i++) {
+        if (lv->end[active[i]] < pos) {
+          free_regs = free_regs | (1 << ra->reg[active[i]]);
+          continue;
+        }
+        active[m++] = active[i];
+      }
+      nactive = m;
+
+      int allowed = allowed_regs(lv, id);
+      int reg = -1;
+      for (int i = 0; i < NUM_ALLOC_REGS && reg < 0; i++)
+        if ((free_regs & allowed) & (1 << alloc_order[i]))
+          reg = alloc_order[i];
+
+      if (reg >= 0) {
+        ra->reg[id] = reg;
+        ra->used = ra->used | (1 << reg);
+        free_regs = free_regs & ~(1 << reg);
+        active[nactive++] = id;
+        continue;
+      }
+
+      // 空いていなければ、使えるレジスタを持つ値のうち最も遠くまで生きるものと比べ、遠い方をスピルする
+      int victim = -1;
+      for (int i = 0; i < nactive; i++)
+        if ((allowed & (1 << ra->reg[active[i]])) &&
+            (victim < 0 || lv->end[active[victim]] < lv->end[active[i]]))
+          victim = i;
+
+      if (victim < 0 || lv->end[active[victim]] <= lv->end[id]) {
+        spill(ra, id);
+        continue;
+      }
+      ra->reg[id] = ra->reg[active[victim]];
+      spill(ra, active[victim]);
+      active[victim] = id;
+    }
+  }
+  return ra;
+}
@@ -0,0 +1,214 @@
+//
+// トークナイザで使う文字列走査のカーネル
+//
+// 空白の連続・行コメント・ブロックコメント・文字列リテラルの本体は、
+// 特定の文字が現れるまで読み飛ばすだけなので、SIMD命令で16/32バイトずつ調べる
+// どの実装を使うかは init_scan() がCPUを調べて1回だけ決める
+//
+// 入力の末尾には必ず'\0'があるので、どのカーネルも'\0'で止まる
+// ベクトルの読み込みは16/32バイト境界に揃えて行うので、ページ境界をまたいで入力の外を読むことはない
+//
+
+#include "dcc.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+//
+// スカラー実装
+//
+
+static bool is_space(char c) {
+  return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static char *skip_space_scalar(char *p) {
+  while (is_space(*p))
+    p++;
+  return p;
+}
+
+// a, b, c, d のいずれかが現れる位置を返す
+static char *find4_scalar(char *p, char a, char b, char c, char d) {
+  while (*p != a && *p != b && *p != c && *p != d)
+    p++;
+  return p;
+}
+
+#ifdef HAVE_X86_SIMD
+
+//
+// SSE2実装(16バイトずつ)
+//
+
+// ' ' と '\t'..'\r' に該当するバイトのビットを立てる
+__attribute__((target("sse2")))
+static unsigned space_mask_sse2(__m128i v) {
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8('\r' - '\t')), d);
+  __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  return _mm_movemask_epi8(_mm_or_si128(ctl, sp));
+}
+
+__attribute__((target("sse2")))
+static char *skip_space_sse2(char *p) {
+  int off = (uintptr_t) p & 15;
+  char *q = p - off;
+  unsigned mask = ~space_mask_sse2(_mm_load_si128((__m128i *) q)) & (0xFFFFu << off) & 0xFFFF;
+
+  while (!mask) {
+    q += 16;
+    mask = ~space_mask_sse2(_mm_load_si128((__m128i *) q)) & 0xFFFF;
+  }
+  return q + __builtin_ctz(mask);
+}
+
+__attribute__((target("sse2")))
+static unsigned eq4_mask_sse2(__m128i v, __m128i a, __m128i b, __m128i c, __m128i d) {
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b));
+  __m128i n = _mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d));
+  return _mm_movemask_epi8(_mm_or_si128(m, n));
+}
+
+__attribute__((target("sse2")))
+static char *find4_sse2(char *p, char a, char b, char c, char d) {
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c);
+  __m128i vd = _mm_set1_epi8(d);
+
+  int off = (uintptr_t) p & 15;
+  char *q = p - off;
+  unsigned mask = eq4_mask_sse2(_mm_load_si128((__m128i *) q), va, vb, vc, vd) & (0xFFFFu << off);
+
+  while (!mask) {
+    q += 16;
+    mask = eq4_mask_sse2(_mm_load_si128((__m128i *) q), va, vb, vc, vd);
+  }
+  return q + __builtin_ctz(mask);
+}
+
+//
+// AVX2実装(32バイトずつ)
+//
+
+__attribute__((target("avx2")))
+static unsigned space_mask_avx2(__m256i v) {
+  __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8('\r' - '\t')), d);
+  __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  return _mm256_movemask_epi8(_mm256_or_si256(ctl, sp));
+}
+
+__attribute__((target("avx2")))
+static char *skip_space_avx2(char *p) {
+  int off = (uintptr_t) p & 31;
+  char *q = p - off;
+  unsigned mask = ~space_mask_avx2(_mm256_load_si256((__m256i *) q)) & (0xFFFFFFFFu << off);
+
+  while (!mask) {
+    q += 32;
+    mask = ~space_mask_avx2(_mm256_load_si256((__m256i *) q));
+  }
+  return q + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned eq4_mask_avx2(__m256i v, __m256i a, __m256i b, __m256i c, __m256i d) {
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b));
+  __m256i n = _mm256_or_si256(_mm256_cmpeq_epi8(v, c), _mm256_cmpeq_epi8(v, d));
+  return _mm256_movemask_epi8(_mm256_or_si256(m, n));
+}
+
+__attribute__((target("avx2")))
+static char *find4_avx2(char *p, char a, char b, char c, char d) {
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i vc = _mm256_set1_epi8(c);
+  __m256i vd = _mm256_set1_epi8(d);
+
+  int off = (uintptr_t) p & 31;
+  char *q = p - off;
+  unsigned mask = eq4_mask_avx2(_mm256_load_si256((__m256i *) q), va, vb, vc, vd) & (0xFFFFFFFFu << off);
+
+  while (!mask) {
+    q += 32;
+    mask = eq4_mask_avx2(_mm256_load_si256((__m256i *) q), va, vb, vc, vd);
+  }
+  return q + __builtin_ctz(mask);
+}
+
+#endif
+
+//
+// 実装の選択
+//
+
+static char *(*skip_space_impl)(char *p) = skip_space_scalar;
+static char *(*find4_impl)(char *p, char a, char b, char c, char d) = find4_scalar;
+
+// CPUが対応している一番幅の広い実装を選ぶ
+// 環境変数 DCC_SCAN に scalar/sse2/avx2 を指定すると、それより広い実装は使わない
+void init_scan(void) {
+  char *limit = getenv("DCC_SCAN");
+  if (limit && !strcmp(limit, "scalar"))
+    return;
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && !(limit && !strcmp(limit, "sse2"))) {
+    skip_space_impl = skip_space_avx2;
+    find4_impl = find4_avx2;
+    return;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    skip_space_impl = skip_space_sse2;
+    find4_impl = find4_sse2;
+  }
+#endif
+}
+
+// pが指している空白文字から続く空白文字を読み飛ばし、最初の空白でない文字の位置を返す
+char *skip_space(char *p) {
+  // トークンの間の空白は1文字のことが多いので、まず1文字だけ見る
+  if (!is_space(p[1]))
+    return p + 1;
+  return skip_space_impl(p + 1);
+}
+
+// 行コメントの中身を読み飛ばし、行末('\n')の位置を返す
+char *skip_line_comment(char *p) {
+  return find4_impl(p, '\n', '\n', '\n', '\0');
+}
+
+// ブロックコメントの終わり("*/")の位置を返す
+// 見つからなかった場合はNULLを返す
+// ドキュメントコメントは各行が " * " で始まり'*'が多いので、'/'を探してから直前の'*'を確かめる
+char *find_comment_end(char *p) {
+  char *start = p;
+  for (char *q = p;; q++) {
+    q = find4_impl(q, '/', '/', '/', '\0');
+    if (*q == '\0')
+      return NULL;
+    if (q > start && q[-1] == '*')
+      return q - 1;
+  }
+}
+
+// 文字列リテラル・文字リテラル・コメントの始まりになりうる文字の手前まで読み飛ばす
+// '"'、'\''、'/'、'\0' のいずれかの位置を返す
+char *skip_code_chars(char *p) {
+  return find4_impl(p, '"', '\'', '/', '\0');
+}
+
+// 文字列リテラルの中で、エスケープも終端もない部分を読み飛ばす
+// '"'、'\\'、'\0' のいずれかの位置を返す
+char *skip_string_chars(char *p) {
+  return find4_impl(p, '"', '"', '\\', '\0');
+}
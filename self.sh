@@ -12,10 +12,8 @@ extern FILE *stdout;
 extern FILE *stderr;
 void *malloc(long size);
 void *calloc(long nmemb, long size);
+void free(void *ptr);
 char *strerror(int errnum);
-FILE *fopen(char *pathname, char *mode);
-long fread(void *ptr, long size, long nmemb, FILE *stream);
-int feof(FILE *stream);
 static void assert() {}
 int strcmp(char *s1, char *s2);
 int printf(char *fmt, ...);
@@ -56,7 +54,7 @@ EOF
   gsed -i 's/\bNULL\b/0/g' $TMP/$1
   gsed -i 's/INT_MAX/2147483647/g' $TMP/$1
 
-  ./dcc $TMP/$1 >$TMP/${1%.c}.s
+  ./dcc -o $TMP/${1%.c}.s $TMP/$1
   gcc -c -o $TMP/${1%.c}.o $TMP/${1%.c}.s
 }
 
@@ -70,6 +68,9 @@ done
 expand main.c
 expand type.c
 expand parse.c
+expand ir.c
+expand regalloc.c
 expand codegen.c
+expand peephole.c
 
-gcc -o dcc-gen2 $TMP/*.o
+gcc -pthread -o dcc-gen2 $TMP/*.o
@@ -14,7 +14,7 @@ try() {
   expected="$1"
   input="$2"
 
-  ./dcc <(echo "$input") >tmp.s
+  ./dcc -o tmp.s <(echo "$input")
   gcc -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
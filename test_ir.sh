@@ -0,0 +1,125 @@
+#!/bin/bash
+
+# 入力をIRに変換した結果(--dump-ir)が期待どおりか確かめる
+try_ir() {
+  input="$1"
+  expected="$2"
+
+  actual=$(./dcc --dump-ir <(echo "$input"))
+  if [ "$?" != 0 ]; then
+    echo "$input => IRに変換できません"
+    exit 1
+  fi
+
+  if [ "$actual" = "$expected" ]; then
+    echo "$input => OK"
+  else
+    echo "$input =>"
+    diff <(echo "$expected") <(echo "$actual")
+    exit 1
+  fi
+}
+
+# 直線的なコード
+try_ir 'int f(int a, int b) { return a + b * 2; }' "function f
+bb1:
+  %1 = param 0
+  %2 = param 1
+  %3 = sext.i32 %1
+  %4 = sext.i32 %2
+  %5 = const 2
+  %6 = mul %4, %5
+  %7 = add %3, %6
+  ret %7"
+
+# 合流点のφ命令
+try_ir 'int f(int x) { int y; if (x) y = 1; else y = 2; return y; }' "function f
+bb1:
+  %1 = param 0
+  %2 = sext.i32 %1
+  br %2, bb2, bb3
+bb2: ; preds bb1
+  %3 = const 1
+  %4 = sext.i32 %3
+  jmp bb4
+bb3: ; preds bb1
+  %5 = const 2
+  %6 = sext.i32 %5
+  jmp bb4
+bb4: ; preds bb2 bb3
+  %7 = phi [%4, bb2], [%6, bb3]
+  ret %7"
+
+# ループの先頭のφ命令
+try_ir 'int f(int n) { int s = 0; for (int i = 0; i < n; i++) s += i; return s; }' "function f
+bb1:
+  %1 = param 0
+  %2 = sext.i32 %1
+  %3 = const 0
+  %4 = sext.i32 %3
+  %5 = const 0
+  %6 = sext.i32 %5
+  jmp bb2
+bb2: ; preds bb1 bb4
+  %7 = phi [%4, bb1], [%11, bb4]
+  %8 = phi [%6, bb1], [%14, bb4]
+  %9 = lt %8, %2
+  br %9, bb3, bb5
+bb3: ; preds bb2
+  %10 = add %7, %8
+  %11 = sext.i32 %10
+  jmp bb4
+bb4: ; preds bb3
+  %12 = const 1
+  %13 = add %8, %12
+  %14 = sext.i32 %13
+  jmp bb2
+bb5: ; preds bb2
+  ret %7"
+
+# 右辺を評価しない場合の値を選ぶ&&
+try_ir 'int f(int a, int b) { return a && b; }' "function f
+bb1:
+  %1 = param 0
+  %2 = param 1
+  %3 = sext.i32 %1
+  %4 = sext.i32 %2
+  %5 = const 0
+  br %3, bb2, bb3
+bb2: ; preds bb1
+  %6 = const 0
+  %7 = ne %4, %6
+  jmp bb3
+bb3: ; preds bb1 bb2
+  %8 = phi [%5, bb1], [%7, bb2]
+  ret %8"
+
+# ローカル変数のアドレスを取る関数では、アドレスを取らない変数(p)もメモリに置く
+try_ir 'int f() { int x = 3; int *p = &x; *p = 5; return x; }' "function f
+bb1:
+  %1 = lvar x
+  %2 = const 3
+  store.i32 %1, %2
+  %3 = lvar p
+  %4 = lvar x
+  store.i64 %3, %4
+  %5 = lvar p
+  %6 = load.i64 %5
+  %7 = const 5
+  store.i32 %6, %7
+  %8 = lvar x
+  %9 = load.i32 %8
+  ret %9"
+
+# 到達できないブロックは取り除く
+try_ir 'int f(int x) { return x; x = 1; }' "function f
+bb1:
+  %1 = param 0
+  %2 = sext.i32 %1
+  ret %2"
+
+# テスト全体のIRを検査する
+./dcc --verify-ir tests >/dev/null || exit 1
+echo "tests => OK"
+
+echo OK
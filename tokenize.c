@@ -4,9 +4,77 @@
 
 #include "dcc.h"
 
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
+
 char *filename;
 char *user_input;
-Token *token;
+int token_pos;
+
+// トークンはパーサが必要とした分だけ読み進める(tokenize()の時点ではまだ何も読まない)
+// 読んだトークンはTOKEN_BLOCK個ずつのブロックにまとめて格納し、位置(添字)からブロックを引く
+// ブロックは移動しないので、トークンへのポインタはそのブロックが回収されるまで有効
+enum {
+  TOKEN_BLOCK_BITS = 10,
+  TOKEN_BLOCK = 1 << TOKEN_BLOCK_BITS,
+};
+
+// blocks[i]は位置 i * TOKEN_BLOCK から始まるブロック。回収済みのブロックはNULL
+static Token **blocks;
+static int blocks_cap;
+static int first_live_block; // これより前のブロックはすべて回収済み
+
+// 回収したブロック(再利用する)
+static Token **spare_blocks;
+static int nspare;
+
+// これまでに読んだトークンの個数
+static int ntokens;
+
+// 次に読む入力の位置
+static char *lex_p;
+
+// NULLでなければ、token_at()はトークン列の代わりにこの保存したトークンを読む
+// saved[0]が位置saved_posのトークンで、最後の要素はEOF
+static Token *saved;
+static int saved_pos;
+static int saved_len;
+
+// 大きな入力は複数のチャンクに分け、それぞれ別のスレッドで先にトークナイズしておく
+// チャンクの境界は文字列・文字リテラル・コメントの外側にある行頭に置くので、
+// どのトークンも1つのチャンクに収まり、チャンクごとのトークン列を順に繋げれば全体のトークン列になる
+// パーサはチャンクのトークン列を先頭から順に取り出す(後ろのチャンクを待たずに読み始められる)
+typedef struct {
+  char *begin;       // チャンクの開始位置
+  char *end;         // チャンクの終了位置(次のチャンクの開始位置)
+  pthread_t thread;
+  bool joined;
+
+  Token *toks;       // このチャンクのトークン列(識別子はまだインターンしていない)
+  int ntoks;
+  int cap;
+
+  // トークナイズ中のエラー。パーサがこの位置まで読み進めた時に報告する
+  jmp_buf jmpbuf;
+  char *err_loc;
+  char *err_msg;
+} LexChunk;
+
+enum {
+  PARALLEL_LEX_MIN = 1 << 20, // これより小さい入力は分割しない
+  LEX_CHUNK_MIN = 1 << 18,    // チャンクの最小サイズ
+  LEX_THREADS_MAX = 64,
+};
+
+static LexChunk *chunks;
+static int nchunks;
+static int chunk_idx; // 次にトークンを取り出すチャンク
+static int chunk_pos; // そのチャンクの中の位置
+static char *input_end;
+
+// ワーカースレッドが担当しているチャンク(メインスレッドではNULL)
+static __thread LexChunk *lex_chunk;
 
 // tokenize時のエラーを報告するための関数
 // printfと同じ引数をとる
@@ -24,6 +92,14 @@ void error(char *fmt, ...) {
 // foo.c:10: x = y + + 5;
 //                   ^ 式ではありません
 void verror_at(char *loc, char *fmt, va_list ap) {
+  // ワーカースレッドではエラーを記録しておき、そのチャンクのトークナイズを打ち切る
+  if (lex_chunk) {
+    lex_chunk->err_loc = loc;
+    lex_chunk->err_msg = malloc(1024);
+    vsnprintf(lex_chunk->err_msg, 1024, fmt, ap);
+    longjmp(lex_chunk->jmpbuf, 1);
+  }
+
   // locが含まれる行の開始地点と終了地点を取得
   char *line = loc;
   while (user_input < line && line[-1] != '\n')
@@ -64,76 +140,232 @@ void warn_at(char *loc, char *fmt, ...) {
   verror_at(loc, fmt, ap);
 }
 
-// 現在のトークンが期待している記号の時には、現在のトークンを返す
+static void lex_token(void);
+
+// 位置posのトークンを返す
+// まだ読んでいなければ、posまで読み進める
+// EOFより後ろの位置を指定した場合はEOFトークンを返す
+Token *token_at(int pos) {
+  if (saved) {
+    pos -= saved_pos;
+    return &saved[pos < saved_len ? pos : saved_len - 1];
+  }
+
+  while (ntokens <= pos && lex_p)
+    lex_token();
+  if (ntokens <= pos)
+    pos = ntokens - 1;
+  return &blocks[pos >> TOKEN_BLOCK_BITS][pos & (TOKEN_BLOCK - 1)];
+}
+
+// 現在着目しているトークンを返す
+Token *cur_token(void) {
+  return token_at(token_pos);
+}
+
+// 位置posより前のトークンしか含まないブロックを回収する
+// 以降、pos より前の位置に戻ったり、それらのトークンへのポインタを使ったりしてはいけない
+void release_tokens(int pos) {
+  // 回収済みのブロックは見直さない(毎回先頭から見ると入力の大きさの2乗に比例する)
+  for (; first_live_block < pos >> TOKEN_BLOCK_BITS; first_live_block++) {
+    if (!blocks[first_live_block])
+      continue;
+    spare_blocks[nspare++] = blocks[first_live_block];
+    blocks[first_live_block] = NULL;
+  }
+}
+
+// 位置begin..endのトークンをarenaにコピーして返す
+// コピーの最後にはEOFトークンを1つ加える
+Token *save_tokens(int begin, int end, Arena *arena) {
+  Token *toks = arena_alloc(arena, sizeof(Token) * (end - begin + 1));
+  for (int i = begin; i < end; i++)
+    toks[i - begin] = *token_at(i);
+
+  Token *eof = &toks[end - begin];
+  Token *last = eof - 1;
+  eof->kind = TK_EOF;
+  eof->str = last->str + last->len;
+  return toks;
+}
+
+// 以降、位置pos..pos+lenのトークンとして、save_tokens()で保存したトークンtoksを読む
+// toksにNULLを渡すと元のトークン列に戻る
+void read_saved_tokens(Token *toks, int pos, int len) {
+  saved = toks;
+  saved_pos = pos;
+  saved_len = len + 1;
+}
+
+// 現在のトークンが種類kindの時には、現在のトークンを返す
 // そうでない場合はNULLを返す
-Token *peek(char *op) {
-  if (token->kind != TK_RESERVED ||
-      strlen(op) != token->len ||
-      memcmp(token->str, op, token->len))
+Token *peek(TokenKind kind) {
+  Token *tok = cur_token();
+  if (tok->kind != kind)
     return NULL;
-  return token;
+  return tok;
 }
 
-// 現在のトークンが期待している記号の時には、トークンを1つ読み進めて現在のトークンを返す
-// それ以外の場合にはNULLを返す
-bool consume(char *op) {
-  if (!peek(op))
-    return NULL;
-  Token *t = token;
-  token = token->next;
-  return t;
+// 現在のトークンが種類kindの時には、トークンを1つ読み進めてtrueを返す
+// それ以外の場合にはfalseを返す
+bool consume(TokenKind kind) {
+  if (cur_token()->kind != kind)
+    return false;
+  token_pos++;
+  return true;
 }
 
 // 現在のトークンが識別子(TK_IDENT)の時には、トークンを1つ読み進めて現在のトークンを返す
 // それ以外の場合にはNULLを返す
 Token *consume_ident() {
-  if (token->kind != TK_IDENT)
+  Token *t = cur_token();
+  if (t->kind != TK_IDENT)
     return NULL;
-  Token *t = token;
-  token = token->next;
+  token_pos++;
   return t;
 }
 
-// 現在のトークンが期待している記号の時には、トークンを1つ読み進めてtrueを返す
+static char *token_kind_name(TokenKind kind);
+
+// 現在のトークンが種類kindの時には、トークンを1つ読み進めてtrueを返す
 // それ以外の場合はエラーを返す
-bool expect(char *op) {
-  if (token->kind != TK_RESERVED ||
-      strlen(op) != token->len ||
-      memcmp(token->str, op, token->len))
-    error_at(token->next->str, "'%s'ではありません", op);
-  token = token->next;
+bool expect(TokenKind kind) {
+  if (cur_token()->kind != kind)
+    error_at(cur_token()->str, "'%s'ではありません", token_kind_name(kind));
+  token_pos++;
   return true;
 }
 
 // 現在のトークンが数値の場合、トークンを一つ読み進めてその数値を返す
 // それ以外の場合はエラーを返す
 int expect_number() {
-  if (token->kind != TK_NUM)
-    error_at(token->next->str, "数値ではありません");
-  int val = token->val;
-  token = token->next;
-  return val;
+  Token *tok = cur_token();
+  if (tok->kind != TK_NUM)
+    error_at(tok->str, "数値ではありません");
+  token_pos++;
+  return tok->val;
 }
 
+// 現在のトークンが識別子の場合、トークンを一つ読み進めてインターンされた識別子名を返す
+// それ以外の場合はエラーを返す
 char *expect_ident() {
-  if (token->kind != TK_IDENT)
-    error_at(token->str, "識別子ではありません");
-  char *s = strndup(token->str, token->len);
-  token = token->next;
-  return s;
+  Token *tok = cur_token();
+  if (tok->kind != TK_IDENT)
+    error_at(tok->str, "識別子ではありません");
+  token_pos++;
+  return tok->ident;
 }
 
 bool at_eof() {
-  return token->kind == TK_EOF;
+  return cur_token()->kind == TK_EOF;
+}
+
+//
+// 識別子のインターン
+//
+// 同じ綴りの識別子には常に同じ文字列(ポインタ)を返すので、
+// パーサやコード生成では名前をポインタの比較だけで照合できる
+//
+
+// インターン表(オープンアドレス法のハッシュ表)
+static char **intern_table;
+static int intern_cap;
+static int intern_used;
+
+// インターンした文字列を詰めていく領域
+static char *intern_buf;
+static int intern_buf_left;
+
+// FNV-1a
+static unsigned intern_hash(char *s, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char) s[i]) * 16777619u;
+  return h;
+}
+
+static char *intern_copy(char *s, int len) {
+  if (intern_buf_left < len + 1) {
+    int sz = len + 1 > 65536 ? len + 1 : 65536;
+    intern_buf = malloc(sz);
+    intern_buf_left = sz;
+  }
+
+  char *p = intern_buf;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  intern_buf += len + 1;
+  intern_buf_left -= len + 1;
+  return p;
+}
+
+static void intern_grow(void) {
+  char **old = intern_table;
+  int old_cap = intern_cap;
+
+  intern_cap = old_cap ? old_cap * 2 : 4096;
+  intern_table = calloc(intern_cap, sizeof(char *));
+
+  for (int i = 0; i < old_cap; i++) {
+    if (!old[i])
+      continue;
+    unsigned h = intern_hash(old[i], strlen(old[i]));
+    while (intern_table[h & (intern_cap - 1)])
+      h++;
+    intern_table[h & (intern_cap - 1)] = old[i];
+  }
+  free(old);
+}
+
+// sから始まる長さlenの文字列をインターンして返す
+char *intern(char *s, int len) {
+  if (intern_used * 2 >= intern_cap)
+    intern_grow();
+
+  for (unsigned h = intern_hash(s, len);; h++) {
+    char **ent = &intern_table[h & (intern_cap - 1)];
+    if (!*ent) {
+      *ent = intern_copy(s, len);
+      intern_used++;
+      return *ent;
+    }
+    if (!strncmp(*ent, s, len) && (*ent)[len] == '\0')
+      return *ent;
+  }
 }
 
-// 新しいトークンを作成してcurに繋げる
-Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
+// トークン列の末尾に新しいトークンを追加する
+// ワーカースレッドでは担当しているチャンクのトークン列に追加する
+Token *new_token(TokenKind kind, char *str, int len) {
+  if (lex_chunk) {
+    LexChunk *c = lex_chunk;
+    if (c->ntoks == c->cap) {
+      c->cap = c->cap ? c->cap * 2 : 1024;
+      c->toks = realloc(c->toks, sizeof(Token) * c->cap);
+    }
+    Token *tok = &c->toks[c->ntoks++];
+    memset(tok, 0, sizeof(Token));
+    tok->kind = kind;
+    tok->str = str;
+    tok->len = len;
+    return tok;
+  }
+
+  int b = ntokens >> TOKEN_BLOCK_BITS;
+
+  if (b == blocks_cap) {
+    blocks_cap = blocks_cap ? blocks_cap * 2 : 64;
+    blocks = realloc(blocks, sizeof(Token *) * blocks_cap);
+    spare_blocks = realloc(spare_blocks, sizeof(Token *) * blocks_cap);
+  }
+  if ((ntokens & (TOKEN_BLOCK - 1)) == 0)
+    blocks[b] = nspare ? spare_blocks[--nspare] : malloc(sizeof(Token) * TOKEN_BLOCK);
+
+  Token *tok = &blocks[b][ntokens++ & (TOKEN_BLOCK - 1)];
+  memset(tok, 0, sizeof(Token));
   tok->kind = kind;
   tok->str = str;
   tok->len = len;
-  cur->next = tok;
   return tok;
 }
 
@@ -145,6 +377,57 @@ bool is_alnum(char c) {
   return is_alpha(c) || ('0' <= c && c <= '9');
 }
 
+// 予約語
+typedef struct {
+  char *name;
+  int len;
+  TokenKind kind;
+} Keyword;
+
+// 予約語の完全ハッシュ
+// (長さ + 先頭の文字 * 10 + 末尾の文字 * 3) & 127 はC11の全予約語(44個)について衝突しないので、
+// 識別子を1回読んだ後に表を1回引いて比較するだけで予約語かどうかを判定できる
+// 予約語を追加するときは、このハッシュ値の位置に登録すればよい
+static int keyword_hash(char *p, int len) {
+  return (len + p[0] * 10 + p[len - 1] * 3) & 127;
+}
+
+static Keyword keywords[128] = {
+    [17] = {"case", 4, TK_CASE},
+    [21] = {"continue", 8, TK_CONTINUE},
+    [26] = {"break", 5, TK_BREAK},
+    [37] = {"else", 4, TK_ELSE},
+    [45] = {"static", 6, TK_STATIC},
+    [54] = {"sizeof", 6, TK_SIZEOF},
+    [55] = {"do", 2, TK_DO},
+    [56] = {"char", 4, TK_CHAR},
+    [60] = {"switch", 6, TK_SWITCH},
+    [61] = {"enum", 4, TK_ENUM},
+    [65] = {"typedef", 7, TK_TYPEDEF},
+    [66] = {"extern", 6, TK_EXTERN},
+    [68] = {"return", 6, TK_RETURN},
+    [75] = {"default", 7, TK_DEFAULT},
+    [76] = {"void", 4, TK_VOID},
+    [78] = {"if", 2, TK_IF},
+    [85] = {"for", 3, TK_FOR},
+    [87] = {"goto", 4, TK_GOTO},
+    [90] = {"while", 5, TK_WHILE},
+    [95] = {"short", 5, TK_SHORT},
+    [96] = {"struct", 6, TK_STRUCT},
+    [112] = {"_Alignof", 8, TK_ALIGNOF},
+    [113] = {"long", 4, TK_LONG},
+    [121] = {"int", 3, TK_INT},
+    [127] = {"_Bool", 5, TK_BOOL},
+};
+
+// pから始まる長さlenの識別子が予約語ならその種類を、そうでなければTK_IDENTを返す
+static TokenKind keyword_kind(char *p, int len) {
+  Keyword *kw = &keywords[keyword_hash(p, len)];
+  if (kw->len == len && !memcmp(p, kw->name, len))
+    return kw->kind;
+  return TK_IDENT;
+}
+
 char get_escape_char(char c) {
   // http://wisdom.sakura.ne.jp/programming/c/Cdata1.html
   switch (c) {
@@ -171,30 +454,33 @@ char get_escape_char(char c) {
   }
 }
 
-Token *read_string_literal(Token *cur, char *start) {
+Token *read_string_literal(char *start) {
   char *p = start + 1;
   char buf[1024];
   int len = 0;
 
   for (;;) {
-    if (len == sizeof(buf))
+    // エスケープを含まない部分はまとめてコピーする
+    char *q = skip_string_chars(p);
+    if (len + (q - p) >= sizeof(buf))
       error_at(start, "文字列リテラルが長すぎます");
+    memcpy(buf + len, p, q - p);
+    len += q - p;
+    p = q;
+
     if (*p == '\0')
       error_at(start, "文字列リテラルが閉じられていません");
     if (*p == '"')
       break;
 
-    if (*p == '\\') {
-      p++;
-      buf[len++] = get_escape_char(*p++);
-    } else {
-      buf[len++] = *p++;
-    }
+    // エスケープシーケンス
+    p++;
+    buf[len++] = get_escape_char(*p++);
   }
   p++;
 
   // 例えば "abc"; のような入力文字列があった時、startは最初の'"'でpは';'になる
-  Token *tok = new_token(TK_STR, cur, start, p - start);
+  Token *tok = new_token(TK_STR, start, p - start);
   tok->contents = malloc(len + 1);
   memcpy(tok->contents, buf, len);
   tok->contents[len] = '\0';
@@ -202,7 +488,7 @@ Token *read_string_literal(Token *cur, char *start) {
   return tok;
 }
 
-Token *read_int_literal(Token *cur, char *start) {
+Token *read_int_literal(char *start) {
   char *p = start;
   int base;
 
@@ -219,13 +505,13 @@ Token *read_int_literal(Token *cur, char *start) {
   }
 
   long val = strtol(p, &p, base);
-  Token *tok = new_token(TK_NUM, cur, start, p - start);
+  Token *tok = new_token(TK_NUM, start, p - start);
   tok->val = val;
 
   return tok;
 }
 
-Token *read_char_literal(Token *cur, char *start) {
+Token *read_char_literal(char *start) {
   char *p = start + 1;
 
   char c;
@@ -241,259 +527,300 @@ Token *read_char_literal(Token *cur, char *start) {
   p++;
 
   // 例えば 'a'; のような入力文字列があった時、startは最初の'\''でpは';'になる
-  Token *tok = new_token(TK_NUM, cur, start, p - start);
+  Token *tok = new_token(TK_NUM, start, p - start);
   tok->val = c;
   return tok;
 }
 
-// 入力文字列pをトークナイズしてそれを返す
-Token *tokenize(char *p) {
-  Token head;
-  head.next = NULL;
-  Token *cur = &head;
-
-  while (*p) {
-    // 空白文字をスキップ
-    if (isspace(*p)) {
-      p++;
-      continue;
-    }
-
-    // 行コメント
-    if (strncmp(p, "//", 2) == 0) {
-      p += 2;
-      while (*p != '\n')
-        p++;
-      continue;
-    }
-
-    // ブロックコメント
-    if (strncmp(p, "/*", 2) == 0) {
-      // http://hitorilife.com/strstr.php
-      // 文字列から文字列を探して、渡された文字列が見つかったときはその先頭へのポインタ、見つからなかったときにはNULLを返す
-      char *q = strstr(p + 2, "*/");
-      if (!q)
-        error_at(p, "コメントが閉じられていません");
-      p = q + 2;
-      continue;
-    }
-
-    // 文字列リテラル
-    if (*p == '"') {
-      cur = read_string_literal(cur, p);
-      p += cur->len;
-      continue;
-    }
-
-    if (strncmp(p, "typedef", 7) == 0 && !is_alnum(p[7])) {
-      cur = new_token(TK_RESERVED, cur, p, 7);
-      p += 7;
-      continue;
-    }
-
-    if (strncmp(p, "sizeof", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (strncmp(p, "_Alignof", 8) == 0 && !is_alnum(p[8])) {
-      cur = new_token(TK_RESERVED, cur, p, 8);
-      p += 8;
-      continue;
-    }
-
-    if (strncmp(p, "struct", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
+// 記号の一覧
+typedef struct {
+  char *str;
+  TokenKind kind;
+} Punct;
+
+static Punct puncts[] = {
+    {"<<=", TK_SHL_ASSIGN}, {">>=", TK_SHR_ASSIGN}, {"...", TK_ELLIPSIS},
+    {"==", TK_EQ}, {"!=", TK_NE}, {"<=", TK_LE}, {">=", TK_GE}, {"->", TK_ARROW},
+    {"++", TK_INC}, {"--", TK_DEC}, {"+=", TK_ADD_ASSIGN}, {"-=", TK_SUB_ASSIGN}, {"*=", TK_MUL_ASSIGN}, {"/=", TK_DIV_ASSIGN},
+    {"&&", TK_LOGAND}, {"||", TK_LOGOR}, {"<<", TK_SHL}, {">>", TK_SHR}, {"&=", TK_AND_ASSIGN}, {"|=", TK_OR_ASSIGN}, {"^=", TK_XOR_ASSIGN},
+    {"+", TK_PLUS}, {"-", TK_MINUS}, {"*", TK_STAR}, {"/", TK_SLASH}, {"(", TK_LPAREN}, {")", TK_RPAREN},
+    {"<", TK_LT}, {">", TK_GT}, {";", TK_SEMICOLON}, {"=", TK_ASSIGN}, {"}", TK_RBRACE}, {"{", TK_LBRACE}, {",", TK_COMMA},
+    {"&", TK_AMP}, {"[", TK_LBRACKET}, {"]", TK_RBRACKET}, {".", TK_DOT}, {"!", TK_NOT}, {"~", TK_TILDE},
+    {"|", TK_PIPE}, {"^", TK_HAT}, {":", TK_COLON}, {"?", TK_QUESTION},
+};
+
+// 記号を最長一致で読むための状態遷移表
+// punct_dfa[0]が1文字目で引く256エントリの表で、0は「遷移なし」を表す
+// punct_kind[s]は、状態sまで読んだ文字列が記号として完結している場合はその種類、そうでなければTK_EOF
+// ex.) "..." の途中の ".." は記号ではないので、"..x" は "." と "." に分かれる
+static unsigned char punct_dfa[64][256];
+static TokenKind punct_kind[64];
+
+static void init_punct_dfa(void) {
+  int nstates = 1;
+
+  for (int i = 0; i < 64; i++)
+    punct_kind[i] = TK_EOF;
+
+  for (int i = 0; i < sizeof(puncts) / sizeof(*puncts); i++) {
+    int s = 0;
+    for (char *q = puncts[i].str; *q; q++) {
+      unsigned char c = *q;
+      if (!punct_dfa[s][c]) {
+        assert(nstates < 64);
+        punct_dfa[s][c] = nstates++;
+      }
+      s = punct_dfa[s][c];
+    }
+    punct_kind[s] = puncts[i].kind;
+  }
+}
 
-    if (strncmp(p, "static", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
+// pから始まる記号を最長一致で読み、その長さを返す(*kindには記号の種類を入れる)
+// 記号でなければ0を返す
+static int read_punct(char *p, TokenKind *kind) {
+  int len = 0;
+  int s = punct_dfa[0][(unsigned char) *p];
 
-    if (strncmp(p, "extern", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
+  for (int i = 1; s; i++) {
+    if (punct_kind[s] != TK_EOF) {
+      len = i;
+      *kind = punct_kind[s];
     }
+    s = punct_dfa[s][(unsigned char) p[i]];
+  }
+  return len;
+}
 
-    if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
-      cur = new_token(TK_RESERVED, cur, p, 2);
-      p += 2;
-      continue;
-    }
+// 予約語・記号の種類kindの綴りを返す(エラーメッセージ用)
+static char *token_kind_name(TokenKind kind) {
+  for (int i = 0; i < sizeof(puncts) / sizeof(*puncts); i++)
+    if (puncts[i].kind == kind)
+      return puncts[i].str;
+  for (int i = 0; i < sizeof(keywords) / sizeof(*keywords); i++)
+    if (keywords[i].name && keywords[i].kind == kind)
+      return keywords[i].name;
+  return "?";
+}
 
-    if (strncmp(p, "do", 2) == 0 && !is_alnum(p[2])) {
-      cur = new_token(TK_RESERVED, cur, p, 2);
-      p += 2;
-      continue;
-    }
+// pから空白文字の並びかコメントを1つ読み飛ばすか、トークンを1つ読んでトークン列に追加する
+// 次に読む位置を返す
+static char *lex_step(char *p) {
+  // 空白文字をスキップ
+  if (isspace(*p))
+    return skip_space(p);
+
+  // 行コメント
+  if (strncmp(p, "//", 2) == 0)
+    return skip_line_comment(p + 2);
+
+  // ブロックコメント
+  if (strncmp(p, "/*", 2) == 0) {
+    char *q = find_comment_end(p + 2);
+    if (!q)
+      error_at(p, "コメントが閉じられていません");
+    return q + 2;
+  }
 
-    if (strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
-      cur = new_token(TK_RESERVED, cur, p, 5);
-      p += 5;
-      continue;
-    }
+  // 文字列リテラル
+  if (*p == '"')
+    return p + read_string_literal(p)->len;
 
-    if (strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
-      cur = new_token(TK_RESERVED, cur, p, 3);
-      p += 3;
-      continue;
-    }
+  // 識別子 or 予約語
+  // ワーカースレッドではインターン表を触らず、メインスレッドが取り出す時にインターンする
+  if (is_alpha(*p)) {
+    char *q = p++;
+    while (is_alnum(*p))
+      p++;
+    int len = p - q;
+    TokenKind kind = keyword_kind(q, len);
+    if (kind != TK_IDENT)
+      new_token(kind, q, len);
+    else if (lex_chunk)
+      new_token(TK_IDENT, q, len);
+    else
+      new_token(TK_IDENT, q, len)->ident = intern(q, len);
+    return p;
+  }
 
-    if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
+  if (*p == '\'')
+    return p + read_char_literal(p)->len;
 
-    if (strncmp(p, "void", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
+  // 記号
+  TokenKind kind;
+  int len = read_punct(p, &kind);
+  if (len) {
+    new_token(kind, p, len);
+    return p + len;
+  }
 
+  if (isdigit(*p))
+    return p + read_int_literal(p)->len;
 
-    if (strncmp(p, "int", 3) == 0 && !is_alnum(p[3])) {
-      cur = new_token(TK_RESERVED, cur, p, 3);
-      p += 3;
-      continue;
-    }
+  error_at(p, "トークナイズできません");
+  return NULL;
+}
 
-    if (strncmp(p, "short", 5) == 0 && !is_alnum(p[5])) {
-      cur = new_token(TK_RESERVED, cur, p, 5);
-      p += 5;
-      continue;
-    }
+// 文字列・文字リテラル・コメントの外側にあるpから読み始めて、
+// target以降で最初にある、文字列・文字リテラル・コメントの外側の行頭を返す
+// 見つからなければ入力の終わりを返す
+// トークナイザと同じ規則でリテラルとコメントだけを読み飛ばす(それ以外の文字はSIMDでまとめて飛ばす)
+static char *find_chunk_end(char *p, char *target) {
+  for (;;) {
+    char *q = skip_code_chars(p);
 
-    if (strncmp(p, "long", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
+    // target以降の改行が、次のリテラル・コメントより手前にあればそこで区切る
+    if (q >= target) {
+      char *nl = skip_line_comment(p < target ? target : p);
+      if (nl < q || *q == '\0')
+        return *nl ? nl + 1 : nl;
     }
 
-    if (strncmp(p, "enum", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
+    p = q;
+    if (*p == '\0')
+      return p;
 
-    if (strncmp(p, "char", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
+    if (*p == '"') {
+      // 文字列リテラル
+      p++;
+      for (;;) {
+        p = skip_string_chars(p);
+        if (*p != '\\')
+          break;
+        if (*++p)
+          p++;
+      }
+      if (*p == '"')
+        p++;
+    } else if (*p == '\'') {
+      // 文字リテラル
+      p++;
+      if (*p == '\\')
+        p++;
+      if (*p)
+        p++;
+      if (*p == '\'')
+        p++;
+    } else if (p[1] == '/') {
+      p = skip_line_comment(p + 2);
+    } else if (p[1] == '*') {
+      p = find_comment_end(p + 2);
+      if (!p)
+        return input_end;
+      p += 2;
+    } else {
+      p++;
     }
+  }
+}
 
-    if (strncmp(p, "_Bool", 5) == 0 && !is_alnum(p[5])) {
-      cur = new_token(TK_RESERVED, cur, p, 5);
-      p += 5;
-      continue;
-    }
+// ワーカースレッドの本体。チャンク1つをトークナイズする
+static void *lex_chunk_main(void *arg) {
+  lex_chunk = arg;
+  if (setjmp(lex_chunk->jmpbuf))
+    return NULL;
 
-    if (strncmp(p, "break", 5) == 0 && !is_alnum(p[5])) {
-      cur = new_token(TK_RESERVED, cur, p, 5);
-      p += 5;
-      continue;
-    }
+  char *p = lex_chunk->begin;
+  while (p < lex_chunk->end)
+    p = lex_step(p);
+  return NULL;
+}
 
-    if (strncmp(p, "continue", 8) == 0 && !is_alnum(p[8])) {
-      cur = new_token(TK_RESERVED, cur, p, 8);
-      p += 8;
-      continue;
-    }
+// トークナイズに使うスレッド数を返す
+// 環境変数 DCC_LEX_THREADS で指定できる(1なら分割しない)
+static int lex_threads(void) {
+  char *s = getenv("DCC_LEX_THREADS");
+  long n = s ? atoi(s) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  return n < LEX_THREADS_MAX ? n : LEX_THREADS_MAX;
+}
 
-    if (strncmp(p, "goto", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
+// 入力をチャンクに分けて、それぞれのスレッドでトークナイズを始める
+static void start_parallel_lex(char *p, int nthreads) {
+  long size = input_end - p;
+  long chunk_size = size / nthreads;
+  if (chunk_size < LEX_CHUNK_MIN)
+    chunk_size = LEX_CHUNK_MIN;
+
+  chunks = calloc(size / chunk_size + 1, sizeof(LexChunk));
+  while (p < input_end) {
+    LexChunk *c = &chunks[nchunks++];
+    c->begin = p;
+    c->end = input_end - p > chunk_size ? find_chunk_end(p, p + chunk_size) : input_end;
+    p = c->end;
+  }
 
-    if (strncmp(p, "switch", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
+  for (int i = 0; i < nchunks; i++) {
+    if (pthread_create(&chunks[i].thread, NULL, lex_chunk_main, &chunks[i]))
+      error("スレッドを作成できません");
+  }
+}
 
-    if (strncmp(p, "case", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
+// 入力文字列pのトークナイズを始める
+// トークンは token_at() で必要になった時に読む
+// 大きな入力の場合は、ここで複数のスレッドに分けて先にトークナイズを始めておく
+void tokenize(char *p) {
+  // 記号の状態遷移表は最初の呼び出し時に作る
+  if (!punct_dfa[0]['+']) {
+    init_punct_dfa();
+    init_scan();
+  }
 
-    if (strncmp(p, "default", 7) == 0 && !is_alnum(p[7])) {
-      cur = new_token(TK_RESERVED, cur, p, 7);
-      p += 7;
-      continue;
-    }
+  lex_p = p;
+  input_end = p + strlen(p);
 
-    if (is_alpha(*p)) {
-      char *q = p++;
-      while (is_alnum(*p))
-        p++;
-      cur = new_token(TK_IDENT, cur, q, p - q);
-      continue;
-    }
+  int nthreads = lex_threads();
+  if (nthreads > 1 && input_end - p >= PARALLEL_LEX_MIN)
+    start_parallel_lex(p, nthreads);
+}
 
-    if (*p == '\'') {
-      cur = read_char_literal(cur, p);
-      p += cur->len;
-      continue;
+// チャンクのトークン列から次のトークンを取り出してトークン列に追加する
+// 全部取り出したらEOFトークンを追加する
+static void pull_chunk_token(void) {
+  while (chunk_idx < nchunks) {
+    LexChunk *c = &chunks[chunk_idx];
+    if (!c->joined) {
+      pthread_join(c->thread, NULL);
+      c->joined = true;
     }
 
-    if (strncmp(p, "<<=", 3) == 0 || strncmp(p, ">>=", 3) == 0) {
-      cur = new_token(TK_RESERVED, cur, p, 3);
-      p += 3;
-      continue;
+    if (chunk_pos < c->ntoks) {
+      Token *tok = new_token(TK_EOF, NULL, 0);
+      *tok = c->toks[chunk_pos++];
+      if (tok->kind == TK_IDENT)
+        tok->ident = intern(tok->str, tok->len);
+      return;
     }
 
-    if (strncmp(p, "...", 3) == 0) {
-      cur = new_token(TK_RESERVED, cur, p, 3);
-      p += 3;
-      continue;
-    }
+    // エラーの手前までのトークンを全部読んだので、エラーを報告する
+    if (c->err_loc)
+      error_at(c->err_loc, "%s", c->err_msg);
 
-    if (strncmp(p, "==", 2) == 0 || strncmp(p, "!=", 2) == 0 ||
-        strncmp(p, "<=", 2) == 0 || strncmp(p, ">=", 2) == 0 ||
-        strncmp(p, "->", 2) == 0 || strncmp(p, "++", 2) == 0 ||
-        strncmp(p, "--", 2) == 0 || strncmp(p, "+=", 2) == 0 ||
-        strncmp(p, "-=", 2) == 0 || strncmp(p, "*=", 2) == 0 ||
-        strncmp(p, "/=", 2) == 0 || strncmp(p, "&&", 2) == 0 ||
-        strncmp(p, "||", 2) == 0 || strncmp(p, "<<", 2) == 0 ||
-        strncmp(p, ">>", 2) == 0 || strncmp(p, "&=", 2) == 0 ||
-        strncmp(p, "|=", 2) == 0 || strncmp(p, "^=", 2) == 0) {
-      cur = new_token(TK_RESERVED, cur, p, 2);
-      p += 2;
-      continue;
-    }
+    free(c->toks);
+    chunk_idx++;
+    chunk_pos = 0;
+  }
 
-    if (*p == '+' || *p == '-' || *p == '*' || *p == '/' || *p == '(' ||
-        *p == ')' || *p == '<' || *p == '>' || *p == ';' || *p == '=' ||
-        *p == '}' || *p == '{' || *p == ',' || *p == '&' || *p == '[' ||
-        *p == ']' || *p == '.' || *p == '!' || *p == '~' || *p == '|' ||
-        *p == '^' || *p == ':' || *p == '?') {
-      cur = new_token(TK_RESERVED, cur, p++, 1);
-      continue;
-    }
+  new_token(TK_EOF, input_end, 0);
+  lex_p = NULL;
+}
 
-    if (isdigit(*p)) {
-      cur = read_int_literal(cur, p);
-      p += cur->len;
-      continue;
-    }
+// 入力からトークンを1つ読んでトークン列に追加する
+// 入力の終わりに達したらEOFトークンを追加し、lex_pをNULLにする
+static void lex_token(void) {
+  if (nchunks) {
+    pull_chunk_token();
+    return;
+  }
 
-    error_at(p, "トークナイズできません");
+  int n = ntokens;
+  while (*lex_p) {
+    lex_p = lex_step(lex_p);
+    if (ntokens != n)
+      return;
   }
 
-  new_token(TK_EOF, cur, p, 0);
-  return head.next;
+  new_token(TK_EOF, lex_p, 0);
+  lex_p = NULL;
 }
@@ -11,36 +11,123 @@ Type *short_type = &(Type) {TY_SHORT, 2, 2};
 Type *int_type = &(Type) {TY_INT, 4, 4};
 Type *long_type = &(Type) {TY_LONG, 8, 8};
 
+// ハッシュ表のための、xを混ぜた0以上のハッシュ値
+// xを31ビットに畳んでから掛けるので、longの掛け算があふれることはない
+int hash_long(long x) {
+  long h = ((x ^ (x >> 31)) & 2147483647) * 1540483477;
+  return (h ^ (h >> 24)) & 2147483647;
+}
+
 bool is_integer(Type *ty) {
   return ty->kind == TY_INT || ty->kind == TY_SHORT || ty->kind == TY_LONG ||
          ty->kind == TY_CHAR || ty->kind == TY_BOOL || ty->kind == TY_ENUM;
 }
 
 Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(tu_arena, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
   return ty;
 }
 
+//
+// 派生型(ポインタ・配列・関数)の共有
+//
+// 同じ型から作る同じ派生型は、1つのTypeオブジェクトを共有する
+// 例えば pointer_to(int_type) は何度呼んでも同じオブジェクトを返すので、同じ型かどうかはポインタの比較で分かる
+// 要素数を省略した配列は、初期化子を読んだ後に要素数を書き換えるので共有しない
+//
+
+// オープンアドレス法のハッシュ表
+static Type **type_table;
+static int type_table_cap;
+static int type_table_used;
+
+// 派生型の元になった型
+Type *base_type(Type *ty) {
+  if (ty->kind == TY_FUNC)
+    return ty->return_ty;
+  return ty->ptr_to;
+}
+
+// 種類kind・元の型base・要素数lenの派生型のハッシュ値
+int type_hash(TypeKind kind, Type *base, int len) {
+  return hash_long(((long) base >> 3) + kind * 31 + len);
+}
+
+void grow_type_table() {
+  Type **old = type_table;
+  int old_cap = type_table_cap;
+
+  if (old_cap)
+    type_table_cap = old_cap * 2;
+  else
+    type_table_cap = 1024;
+  type_table = calloc(type_table_cap, sizeof(Type *));
+
+  for (int i = 0; i < old_cap; i++) {
+    Type *ty = old[i];
+    if (!ty)
+      continue;
+    int h = type_hash(ty->kind, base_type(ty), ty->array_len) & (type_table_cap - 1);
+    while (type_table[h])
+      h = (h + 1) & (type_table_cap - 1);
+    type_table[h] = ty;
+  }
+  free(old);
+}
+
+// 種類kind・元の型base・要素数lenの派生型を返す
+// まだ作っていなければ作って表に加える
+Type *derived_type(TypeKind kind, Type *base, int len) {
+  if (type_table_used * 2 >= type_table_cap)
+    grow_type_table();
+
+  for (int h = type_hash(kind, base, len) & (type_table_cap - 1);; h = (h + 1) & (type_table_cap - 1)) {
+    Type **ent = &type_table[h];
+    Type *ty = *ent;
+    if (ty) {
+      if (ty->kind == kind && base_type(ty) == base && ty->array_len == len)
+        return ty;
+      continue;
+    }
+
+    if (kind == TY_PTR) {
+      ty = new_type(TY_PTR, 8, 8);
+      ty->ptr_to = base;
+    } else if (kind == TY_ARRAY) {
+      ty = new_type(TY_ARRAY, base->size * len, base->align);
+      ty->ptr_to = base;
+      ty->array_len = len;
+    } else {
+      ty = new_type(TY_FUNC, 1, 1);
+      ty->return_ty = base;
+    }
+    *ent = ty;
+    type_table_used++;
+    return ty;
+  }
+}
+
 Type *pointer_to(Type *ptr_to) {
-  Type *ty = new_type(TY_PTR, 8, 8);
-  ty->ptr_to = ptr_to;
-  return ty;
+  return derived_type(TY_PTR, ptr_to, 0);
 }
 
 Type *array_of(Type *pointer_to, int len) {
-  Type *ty = new_type(TY_ARRAY, pointer_to->size * len, pointer_to->align);
+  return derived_type(TY_ARRAY, pointer_to, len);
+}
+
+// 要素数を省略した配列の型。要素数を書き換えるので、呼ぶたびに新しく作る
+Type *incomplete_array_of(Type *pointer_to) {
+  Type *ty = new_type(TY_ARRAY, 0, pointer_to->align);
   ty->ptr_to = pointer_to;
-  ty->array_len = len;
+  ty->is_incomplete = true;
   return ty;
 }
 
 Type *func_type(Type *return_ty) {
-  Type *ty = new_type(TY_FUNC, 1, 1);
-  ty->return_ty = return_ty;
-  return ty;
+  return derived_type(TY_FUNC, return_ty, 0);
 }
 
 Type *enum_type() {
@@ -67,18 +154,19 @@ void add_type(Node *node) {
   if (!node || node->ty)
     return;
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
+  NodeExt *ext = node_ext(node);
+  add_type(node_at(node->lhs));
+  add_type(node_at(node->rhs));
+  add_type(node_at(ext->cond));
+  add_type(node_at(ext->then));
+  add_type(node_at(ext->els));
+  add_type(node_at(ext->init));
+  add_type(node_at(ext->inc));
 
-  for (Node *n = node->body; n; n = n->next)
+  for (Node *n = node_at(ext->body); n; n = node_at(n->next))
     add_type(n);
 
-  for (Node *n = node->args; n; n = n->next)
+  for (Node *n = node_at(ext->args); n; n = node_at(n->next))
     add_type(n);
 
   switch (node->kind) {
@@ -122,36 +210,36 @@ void add_type(Node *node) {
     case ND_BITAND_EQ:
     case ND_BITOR_EQ:
     case ND_BITXOR_EQ:
-      node->ty = node->lhs->ty;
+      node->ty = node_at(node->lhs)->ty;
       return;
     case ND_VAR: // 変数
       node->ty = node->var->ty;
       return;
     case ND_MEMBER: // 構造体のメンバ
-      node->ty = node->member->ty;
+      node->ty = ext->member->ty;
       return;
     case ND_ADDR: // &
-      if (node->lhs->ty->kind == TY_ARRAY)
-        node->ty = pointer_to(node->lhs->ty->ptr_to);
+      if (node_at(node->lhs)->ty->kind == TY_ARRAY)
+        node->ty = pointer_to(node_at(node->lhs)->ty->ptr_to);
       else {
-        node->ty = pointer_to(node->lhs->ty);
+        node->ty = pointer_to(node_at(node->lhs)->ty);
       }
       return;
     case ND_DEREF: // *
-      if (!node->lhs->ty->ptr_to)
+      if (!node_at(node->lhs)->ty->ptr_to)
         error("invalid pointer dereference");
-      node->ty = node->lhs->ty->ptr_to;
+      node->ty = node_at(node->lhs)->ty->ptr_to;
       return;
     case ND_COMMA:
-      node->ty = node->rhs->ty;
+      node->ty = node_at(node->rhs)->ty;
       return;
     case ND_TERNARY:
-      node->ty = node->then->ty;
+      node->ty = node_at(ext->then)->ty;
       return;
     case ND_STMT_EXPR: {
-      Node *last = node->body;
+      Node *last = node_at(ext->body);
       while (last->next)
-        last = last->next;
+        last = node_at(last->next);
       node->ty = last->ty;
       return;
     }